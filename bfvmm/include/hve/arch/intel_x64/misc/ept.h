@@ -19,8 +19,12 @@
 #ifndef EAPIS_EPT_HANDLER_INTEL_X64_H
 #define EAPIS_EPT_HANDLER_INTEL_X64_H
 
+#include <memory>
+#include <vector>
+
 #include "ept/mmap.h"
 #include "ept/helpers.h"
+#include "ept/guest_memory.h"
 
 #include "../base.h"
 
@@ -39,10 +43,32 @@ namespace intel_x64
 ///
 class EXPORT_EAPIS_HVE ept_handler
 {
+    struct view_type {
+        uint64_t index;
+        ept::mmap *map;
+        uint64_t generation;
+        bool stale;
+    };
+
     bool m_enabled{false};
+    bool m_accessed_and_dirty{false};
+    bool m_vmfunc{false};
+
+    ept::mmap *m_map{nullptr};
+    uint64_t m_generation{0};
+    bool m_stale{false};
+
+    std::unique_ptr<uintptr_t[]> m_eptp_list;
+    std::vector<view_type> m_views;
 
 public:
 
+    /// Max Views
+    ///
+    /// The number of EPTPs the EPTP list page can hold
+    ///
+    constexpr static const uint64_t max_views = 512;
+
     /// Constructor
     ///
     /// @expects
@@ -67,6 +93,139 @@ public:
     ///
     void set_eptp(ept::mmap *map);
 
+    /// Enable Accessed and Dirty Flags
+    ///
+    /// By default, the CPU does not set the accessed and dirty flags of the
+    /// EPT entries, and tracking which pages the guest writes to requires
+    /// write protecting them and taking an EPT violation on the first write.
+    /// Once enabled, the CPU sets these flags itself, and dirty pages can be
+    /// collected with ept::mmap::harvest_dirty(). This takes effect
+    /// immediately if EPT is already enabled, and otherwise when the next
+    /// EPTP is set.
+    ///
+    /// @expects the CPU supports EPT accessed and dirty flags
+    /// @ensures
+    ///
+    void enable_accessed_and_dirty_flags();
+
+    /// Disable Accessed and Dirty Flags
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_accessed_and_dirty_flags();
+
+    /// Add View
+    ///
+    /// Registers a map in the EPTP list, at the provided index. Once
+    /// VM functions are enabled (see enable_vmfunc()), the guest can switch
+    /// to this view with VMFUNC (leaf 0, ECX = index) without a VM exit.
+    /// Registering a map at an index that is already in use replaces the
+    /// previous view. The map must outlive its registration.
+    ///
+    /// @expects index < max_views
+    /// @expects map != nullptr
+    /// @ensures
+    ///
+    /// @param index the index of the view in the EPTP list
+    /// @param map the map to register
+    ///
+    void add_view(uint64_t index, gsl::not_null<ept::mmap *> map);
+
+    /// Remove View
+    ///
+    /// Removes a view from the EPTP list. A VMFUNC to a view that is not
+    /// registered causes a VM exit.
+    ///
+    /// @expects index < max_views
+    /// @expects if VMFUNC is enabled, the view is not the one the guest is
+    ///     currently using (see current_view()), as its EPTP list entry
+    ///     would be gone while the guest still runs on it
+    /// @ensures
+    ///
+    /// @param index the index of the view in the EPTP list
+    ///
+    void remove_view(uint64_t index);
+
+    /// Enable VMFUNC
+    ///
+    /// Enables VM functions, and EPTP switching using the EPTP list
+    /// (see add_view()).
+    ///
+    /// @expects EPT is enabled
+    /// @expects the CPU supports VM functions and EPTP switching
+    /// @ensures
+    ///
+    void enable_vmfunc();
+
+    /// Disable VMFUNC
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_vmfunc();
+
+    /// Set View
+    ///
+    /// Switches to a registered view from the VMM (e.g. from an exit
+    /// handler that decides which view the guest should run in), keeping
+    /// the EPTP index in the VMCS in sync with the EPTP so that
+    /// current_view() remains accurate whether the view was changed by the
+    /// guest or by the VMM.
+    ///
+    /// @expects a view is registered at index
+    /// @ensures
+    ///
+    /// @param index the index of the view in the EPTP list
+    ///
+    void set_view(uint64_t index);
+
+    /// Current View
+    ///
+    /// @expects VM functions are enabled
+    /// @ensures
+    ///
+    /// @return Returns the index of the view the guest is currently using
+    ///
+    uint64_t current_view() const;
+
+    /// Has Holes
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns true if the current map, or the map of any view, has
+    ///     holes (see ept::mmap::has_holes())
+    ///
+    bool has_holes() const;
+
+    /// Sync
+    ///
+    /// Executes a single-context INVEPT for the current EPTP if the map
+    /// has changed (see ept::mmap::generation()) since the last time this
+    /// vCPU invalidated its cached translations, or if the EPTP has been
+    /// set since then. This must be done before every VM entry, which the
+    /// vCPU does at the end of every exit (see vcpu::add_exit_handler()).
+    /// Since INVEPT only affects the CPU that executes it, each vCPU flushes
+    /// its own translations lazily, and any number of changes made to a map
+    /// between two VM entries cost a single INVEPT, without having to IPI
+    /// the other vCPUs that share the map.
+    ///
+    /// The same is done for every registered view, as the guest may switch
+    /// to any of them with VMFUNC without the VMM being aware of it.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns true if INVEPT was executed, false otherwise
+    ///
+    bool sync();
+
+private:
+
+    uintptr_t eptp(ept::mmap *map) const;
+    view_type *find_view(uint64_t index);
+
 public:
 
     /// @cond
@@ -0,0 +1,396 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef EPT_GUEST_MEMORY_INTEL_X64_H
+#define EPT_GUEST_MEMORY_INTEL_X64_H
+
+#include <algorithm>
+#include <new>
+#include <vector>
+
+#include <bfgsl.h>
+
+#include <intrinsics.h>
+#include <bfvmm/memory_manager/memory_manager.h>
+
+#include "mmap.h"
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+namespace ept
+{
+
+/// EPT Guest Memory
+///
+/// Backs guest physical memory with memory taken from the memory manager,
+/// and maps it into an EPT memory map. Unlike backing each page of the guest
+/// with its own page from the heap (which is rarely physically contiguous,
+/// and can therefore only be mapped using 4k pages), memory is allocated in
+/// 2m (and optionally 1g) chunks, and each chunk that turns out to be
+/// physically contiguous and aligned is mapped using a single large page.
+///
+/// If a chunk cannot be allocated, it is allocated one page at a time, and
+/// if a chunk is not physically contiguous (or aligned), the parts of it
+/// that are not are mapped using smaller pages. In both cases the memory is
+/// still backed and mapped, just with less TLB reach, which is reported by
+/// stats() and large_page_percent().
+///
+/// All of the memory is zeroed before it is given to the guest. The map
+/// must outlive this object, as the memory is unmapped from it (and
+/// returned to the memory manager) when this object is destroyed.
+///
+class guest_memory
+{
+
+public:
+
+    using phys_addr_t = mmap::phys_addr_t;              ///< Phys Address Type (as Int)
+    using virt_addr_t = mmap::virt_addr_t;              ///< Virt Address Type (as Int)
+    using size_type = mmap::size_type;                  ///< Size Type
+
+    /// Stats
+    ///
+    /// Statistics on how the guest memory was backed and mapped
+    ///
+    struct stats_type {
+        size_type mapped_1g{};                          ///< Number of 1g pages mapped
+        size_type mapped_2m{};                          ///< Number of 2m pages mapped
+        size_type mapped_4k{};                          ///< Number of 4k pages mapped
+        size_type chunks{};                             ///< Chunks allocated
+        size_type failed_chunks{};                      ///< Chunks that could not be allocated
+        size_type fragmented_chunks{};                  ///< Chunks not mapped with one page
+    };
+
+    /// Constructor
+    ///
+    /// @expects max_page_size is a 4k, 2m or 1g page size
+    /// @ensures
+    ///
+    /// @param map the map to add the guest memory to
+    /// @param max_page_size the largest page size (and therefore chunk
+    ///     size) to use. Note that 1g chunks are a lot harder for the memory
+    ///     manager to provide, so they are only used if asked for, and only
+    ///     if mmap::is_1g_supported() (otherwise 2m chunks are used).
+    ///
+    explicit guest_memory(
+        gsl::not_null<mmap *> map,
+        size_type max_page_size = ::intel_x64::ept::pd::page_size
+    ) :
+        m_map{map},
+        m_max_page_size{max_page_size}
+    {
+        expects(
+            max_page_size == ::intel_x64::ept::pdpt::page_size ||
+            max_page_size == ::intel_x64::ept::pd::page_size ||
+            max_page_size == ::intel_x64::ept::pt::page_size
+        );
+
+        if (max_page_size == ::intel_x64::ept::pdpt::page_size && !mmap::is_1g_supported()) {
+            m_max_page_size = ::intel_x64::ept::pd::page_size;
+        }
+    }
+
+    /// Destructor
+    ///
+    /// Unmaps all of the guest memory, and returns it to the memory manager
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~guest_memory()
+    {
+        for (const auto &backing : m_backing) {
+            this->unmap(backing);
+
+            if (backing.size == ::intel_x64::ept::pt::page_size) {
+                free_page(backing.virt_addr);
+            }
+            else {
+                g_mm->free(backing.virt_addr);
+            }
+        }
+    }
+
+    /// Map
+    ///
+    /// Backs [virt_addr, virt_addr + size) with newly allocated memory, and
+    /// maps it. Each part of the range is backed with the largest chunk
+    /// that is allowed and fits the alignment of the range. Once a chunk
+    /// size cannot be allocated, it is not tried again for the rest of the
+    /// range, as every attempt would likely fail the same way.
+    ///
+    /// @expects virt_addr and size are 4k aligned, size != 0
+    /// @expects the range is not already mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the guest physical address to start at
+    /// @param size the number of bytes to back
+    /// @param attr the map permissions
+    /// @param cache the memory type of the map
+    ///
+    void
+    map(
+        virt_addr_t virt_addr,
+        size_type size,
+        mmap::attr_type attr = mmap::attr_type::read_write_execute,
+        mmap::memory_type cache = mmap::memory_type::write_back)
+    {
+        using namespace ::intel_x64::ept;
+
+        expects(size != 0);
+        expects(bfn::lower(virt_addr, pt::from) == 0);
+        expects(bfn::lower(size, pt::from) == 0);
+
+        auto end = virt_addr + size;
+
+        for (auto addr = virt_addr; addr < end;) {
+            auto unmapped = m_map->unmapped_size(addr);
+            expects(unmapped != 0);
+
+            addr = (addr & ~(unmapped - 1)) + unmapped;
+        }
+
+        auto max_chunk_size = m_max_page_size;
+
+        for (auto addr = virt_addr; addr < end;) {
+            auto chunk_size = pt::page_size;
+            m_backing.reserve(m_backing.size() + 1);
+
+            for (auto page_size : {pdpt::page_size, pd::page_size}) {
+                if (page_size > max_chunk_size) {
+                    continue;
+                }
+
+                if ((addr & (page_size - 1)) != 0 || end - addr < page_size) {
+                    continue;
+                }
+
+                if (auto chunk = this->alloc_chunk(page_size)) {
+                    m_backing.push_back({chunk, addr, page_size});
+                    chunk_size = page_size;
+                    break;
+                }
+
+                m_stats.failed_chunks++;
+                max_chunk_size = page_size >> 9;
+            }
+
+            if (chunk_size == pt::page_size) {
+                auto page = static_cast<uint8_t *>(alloc_page());
+                m_backing.push_back({page, addr, pt::page_size});
+
+                std::fill(page, page + pt::page_size, 0);
+            }
+            else {
+                m_stats.chunks++;
+            }
+
+            this->map_backing(m_backing.back(), attr, cache);
+            addr += chunk_size;
+        }
+    }
+
+    /// Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns statistics on how the guest memory was mapped
+    ///
+    const stats_type &
+    stats() const noexcept
+    { return m_stats; }
+
+    /// Size
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of bytes of guest memory that are backed
+    ///
+    size_type
+    size() const noexcept
+    {
+        using namespace ::intel_x64::ept;
+
+        return
+            (m_stats.mapped_1g * pdpt::page_size) +
+            (m_stats.mapped_2m * pd::page_size) +
+            (m_stats.mapped_4k * pt::page_size);
+    }
+
+    /// Large Page Percent
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the percentage (rounded down) of the guest memory
+    ///     that is mapped using 2m or 1g pages, or 0 if nothing is mapped
+    ///
+    size_type
+    large_page_percent() const noexcept
+    {
+        auto total = this->size();
+
+        if (total == 0) {
+            return 0;
+        }
+
+        auto small = m_stats.mapped_4k * ::intel_x64::ept::pt::page_size;
+        return ((total - small) * 100) / total;
+    }
+
+private:
+
+    struct backing_type {
+        void *virt_addr;
+        virt_addr_t guest_addr;
+        size_type size;
+    };
+
+    void *
+    alloc_chunk(size_type size) noexcept
+    {
+        void *chunk = nullptr;
+
+        try {
+            chunk = g_mm->alloc(size);
+        }
+        catch (std::bad_alloc &) {
+            return nullptr;
+        }
+
+        if (chunk != nullptr) {
+            auto bytes = static_cast<uint8_t *>(chunk);
+            std::fill(bytes, bytes + size, 0);
+        }
+
+        return chunk;
+    }
+
+    bool
+    is_contiguous(uint8_t *virt_addr, phys_addr_t phys_addr, size_type size) const
+    {
+        for (auto offset = ::intel_x64::ept::pt::page_size; offset < size; offset += ::intel_x64::ept::pt::page_size) {
+            if (g_mm->virtptr_to_physint(virt_addr + offset) != phys_addr + offset) {
+                return false;
+            }
+        }
+
+        return true;
+    }
+
+    void
+    map_backing(
+        const backing_type &backing, mmap::attr_type attr, mmap::memory_type cache)
+    {
+        using namespace ::intel_x64::ept;
+
+        auto virt_addr = static_cast<uint8_t *>(backing.virt_addr);
+
+        for (size_type offset = 0; offset < backing.size;) {
+            auto guest_addr = backing.guest_addr + offset;
+            auto phys_addr = g_mm->virtptr_to_physint(virt_addr + offset);
+            auto page_size = pt::page_size;
+
+            for (auto size : {pdpt::page_size, pd::page_size}) {
+                if (size > m_max_page_size || size > backing.size - offset) {
+                    continue;
+                }
+
+                if (((guest_addr | phys_addr) & (size - 1)) != 0) {
+                    continue;
+                }
+
+                if (this->is_contiguous(virt_addr + offset, phys_addr, size)) {
+                    page_size = size;
+                    break;
+                }
+            }
+
+            switch (page_size) {
+                case pdpt::page_size:
+                    m_map->map_1g(guest_addr, phys_addr, attr, cache);
+                    m_stats.mapped_1g++;
+                    break;
+
+                case pd::page_size:
+                    m_map->map_2m(guest_addr, phys_addr, attr, cache);
+                    m_stats.mapped_2m++;
+                    break;
+
+                default:
+                    m_map->map_4k(guest_addr, phys_addr, attr, cache);
+                    m_stats.mapped_4k++;
+                    break;
+            }
+
+            if (offset == 0 && page_size != backing.size && backing.size != pt::page_size) {
+                m_stats.fragmented_chunks++;
+            }
+
+            offset += page_size;
+        }
+    }
+
+    void
+    unmap(const backing_type &backing)
+    {
+        for (size_type offset = 0; offset < backing.size;) {
+            auto guest_addr = backing.guest_addr + offset;
+            auto page_size = m_map->try_virt_to_phys(guest_addr).page_size;
+
+            m_map->unmap(guest_addr);
+            m_map->release(guest_addr);
+
+            offset += std::max(page_size, ::intel_x64::ept::pt::page_size);
+        }
+    }
+
+private:
+
+    gsl::not_null<mmap *> m_map;
+    size_type m_max_page_size;
+
+    stats_type m_stats{};
+    std::vector<backing_type> m_backing;
+
+public:
+
+    /// @cond
+
+    guest_memory(guest_memory &&) = delete;
+    guest_memory &operator=(guest_memory &&) = delete;
+
+    guest_memory(const guest_memory &) = delete;
+    guest_memory &operator=(const guest_memory &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+}
+
+#endif
@@ -20,6 +20,12 @@
 #ifndef EPT_HELPERS_INTEL_X64_H
 #define EPT_HELPERS_INTEL_X64_H
 
+#include <algorithm>
+#include <exception>
+#include <mutex>
+#include <utility>
+#include <vector>
+
 #include "mmap.h"
 #include "../mtrrs.h"
 
@@ -58,8 +64,8 @@ identity_map_1g(
     expects(bfn::lower(saddr, pdpt::from) == 0);
     expects(bfn::lower(eaddr, pdpt::from) == 0);
 
-    for (auto gpa = saddr; gpa < eaddr; gpa += pdpt::page_size) {
-        map.map_1g(gpa, gpa, attr, cache);
+    if (saddr < eaddr) {
+        map.map_range_1g(saddr, saddr, eaddr - saddr, attr, cache);
     }
 }
 
@@ -87,8 +93,8 @@ identity_map_2m(
     expects(bfn::lower(saddr, pd::from) == 0);
     expects(bfn::lower(eaddr, pd::from) == 0);
 
-    for (auto gpa = saddr; gpa < eaddr; gpa += pd::page_size) {
-        map.map_2m(gpa, gpa, attr, cache);
+    if (saddr < eaddr) {
+        map.map_range_2m(saddr, saddr, eaddr - saddr, attr, cache);
     }
 }
 
@@ -116,8 +122,8 @@ identity_map_4k(
     expects(bfn::lower(saddr, pt::from) == 0);
     expects(bfn::lower(eaddr, pt::from) == 0);
 
-    for (auto gpa = saddr; gpa < eaddr; gpa += pt::page_size) {
-        map.map_4k(gpa, gpa, attr, cache);
+    if (saddr < eaddr) {
+        map.map_range_4k(saddr, saddr, eaddr - saddr, attr, cache);
     }
 }
 
@@ -273,7 +279,10 @@ identity_release_4k(
 
 /// Convert Identity Map Granularity
 ///
-/// Converts the granularity of a map from 1g to 2m.
+/// Converts the granularity of a map from 1g to 2m. The range remains
+/// mapped while it is converted (see mmap::split_1g()), and the attributes
+/// and memory type of the new pages are then changed in place (see
+/// mmap::protect()).
 ///
 /// @param map the map to apply the identity map too
 /// @param addr the address to convert
@@ -290,18 +299,18 @@ identity_map_convert_1g_to_2m(
     using namespace ::intel_x64::ept;
 
     expects(bfn::lower(addr, pdpt::from) == 0);
-    expects(map.is_1g(addr));
+    expects(map.try_virt_to_phys(addr).page_size == pdpt::page_size);
 
-    map.unmap(addr);
-
-    ept::identity_map_2m(
-        map, addr, addr + pdpt::page_size, attr, cache
-    );
+    map.split_1g(addr);
+    map.protect(addr, pdpt::page_size, attr, cache);
 }
 
 /// Convert Identity Map Granularity
 ///
-/// Converts the granularity of a map from 1g to 4k.
+/// Converts the granularity of a map from 1g to 4k. The range remains
+/// mapped while it is converted (see mmap::split_1g() and
+/// mmap::split_2m()), and the attributes and memory type of the new pages
+/// are then changed in place (see mmap::protect()).
 ///
 /// @param map the map to apply the identity map too
 /// @param addr the address to convert
@@ -318,13 +327,15 @@ identity_map_convert_1g_to_4k(
     using namespace ::intel_x64::ept;
 
     expects(bfn::lower(addr, pdpt::from) == 0);
-    expects(map.is_1g(addr));
+    expects(map.try_virt_to_phys(addr).page_size == pdpt::page_size);
 
-    map.unmap(addr);
+    map.split_1g(addr);
 
-    ept::identity_map_4k(
-        map, addr, addr + pdpt::page_size, attr, cache
-    );
+    for (auto gpa = addr; gpa < addr + pdpt::page_size; gpa += pd::page_size) {
+        map.split_2m(gpa);
+    }
+
+    map.protect(addr, pdpt::page_size, attr, cache);
 }
 
 /// Convert Identity Map Granularity
@@ -346,7 +357,7 @@ identity_map_convert_2m_to_1g(
     using namespace ::intel_x64::ept;
 
     expects(bfn::lower(addr, pdpt::from) == 0);
-    expects(map.is_2m(addr));
+    expects(map.try_virt_to_phys(addr).page_size == pd::page_size);
 
     identity_release_2m(
         map, addr, addr + pdpt::page_size
@@ -374,7 +385,7 @@ identity_map_convert_4k_to_1g(
     using namespace ::intel_x64::ept;
 
     expects(bfn::lower(addr, pdpt::from) == 0);
-    expects(map.is_4k(addr));
+    expects(map.try_virt_to_phys(addr).page_size == pt::page_size);
 
     identity_release_4k(
         map, addr, addr + pdpt::page_size
@@ -385,7 +396,10 @@ identity_map_convert_4k_to_1g(
 
 /// Convert Identity Map Granularity
 ///
-/// Converts the granularity of a map from 2m to 4k.
+/// Converts the granularity of a map from 2m to 4k. The range remains
+/// mapped while it is converted (see mmap::split_2m()), and the attributes
+/// and memory type of the new pages are then changed in place (see
+/// mmap::protect()).
 ///
 /// @param map the map to apply the identity map too
 /// @param addr the address to convert
@@ -402,13 +416,10 @@ identity_map_convert_2m_to_4k(
     using namespace ::intel_x64::ept;
 
     expects(bfn::lower(addr, pd::from) == 0);
-    expects(map.is_2m(addr));
+    expects(map.try_virt_to_phys(addr).page_size == pd::page_size);
 
-    map.unmap(addr);
-
-    ept::identity_map_4k(
-        map, addr, addr + pd::page_size, attr, cache
-    );
+    map.split_2m(addr);
+    map.protect(addr, pd::page_size, attr, cache);
 }
 
 /// Convert Identity Map Granularity
@@ -430,7 +441,7 @@ identity_map_convert_4k_to_2m(
     using namespace ::intel_x64::ept;
 
     expects(bfn::lower(addr, pd::from) == 0);
-    expects(map.is_4k(addr));
+    expects(map.try_virt_to_phys(addr).page_size == pt::page_size);
 
     ept::identity_release_4k(
         map, addr, addr + pd::page_size
@@ -443,13 +454,138 @@ identity_map_convert_4k_to_2m(
 // Checked
 //--------------------------------------------------------------------------
 
+/// For Each MTRR Range
+///
+/// Splits the range from the starting address to the ending address at
+/// the boundaries of the ranges defined by the provided MTRRs, and calls
+/// func(addr, size, type) for each piece, in order, with the memory type
+/// the MTRRs define for it.
+///
+/// The search for the MTRR range that contains the starting address
+/// begins at the cursor, which is left at the range the last piece came
+/// from, so that calling this for a sorted list of ranges walks the MTRR
+/// ranges only once. A null cursor, or one that is past the starting
+/// address, starts over from the first range.
+///
+/// @expects every address in the range is covered by the MTRRs
+/// @ensures
+///
+/// @param mtrr the MTRRs that define the memory type of each range
+/// @param cursor the MTRR range to start searching from
+/// @param saddr the starting address of the range
+/// @param eaddr the ending address of the range
+/// @param func the function to call for each piece
+///
+template<typename func_type>
+inline void
+for_each_mtrr_range(
+    const mtrrs &mtrr,
+    const mtrrs::range_t *&cursor,
+    mmap::phys_addr_t saddr,
+    mmap::phys_addr_t eaddr,
+    func_type func)
+{
+    auto begin = mtrr.ranges().data();
+    auto end = begin + mtrr.size();
+
+    if (cursor == nullptr || cursor >= end || cursor->base > saddr) {
+        cursor = begin;
+    }
+
+    while (saddr < eaddr) {
+
+        // Note that contains() includes the end of a range, which means
+        // that the end of one range is also "contained" in the range before
+        // it. Skipping ranges with no distance left ensures each address
+        // gets the memory type of the range that actually starts there.
+        //
+        while (cursor != end && (!cursor->contains(saddr) || cursor->distance(saddr) == 0)) {
+            cursor++;
+        }
+
+        if (cursor == end) {
+            cursor = nullptr;
+
+            throw std::runtime_error(
+                "for_each_mtrr_range: address not covered by the mtrrs: " +
+                bfn::to_string(saddr, 16)
+            );
+        }
+
+        auto size = std::min(cursor->distance(saddr), eaddr - saddr);
+
+        func(saddr, size, cursor->type);
+        saddr += size;
+    }
+}
+
+/// For Each MTRR Range
+///
+/// Same as the version above, starting from the first MTRR range.
+///
+/// @expects every address in the range is covered by the MTRRs
+/// @ensures
+///
+/// @param mtrr the MTRRs that define the memory type of each range
+/// @param saddr the starting address of the range
+/// @param eaddr the ending address of the range
+/// @param func the function to call for each piece
+///
+template<typename func_type>
+inline void
+for_each_mtrr_range(
+    const mtrrs &mtrr,
+    mmap::phys_addr_t saddr,
+    mmap::phys_addr_t eaddr,
+    func_type func)
+{
+    const mtrrs::range_t *cursor = nullptr;
+    for_each_mtrr_range(mtrr, cursor, saddr, eaddr, std::move(func));
+}
+
+/// Identity Map
+///
+/// Adds a 1:1 map from the starting address to the ending address.
+/// This version incorporates the provided MTRRs, ensuring the cache type is
+/// set up properly in EPT. The largest page size possible is always used,
+/// which means 1g granularity is used for any 1g aligned region that is
+/// covered by a single MTRR range, and 2m and 4k granularity are only used
+/// where the MTRRs define a range that is not on a 1g or 2m boundry.
+/// Regular RAM is likely to be mapped using 1g regions.
+///
+/// @param map the map to apply the identity map too
+/// @param mtrr the MTRRs that define the memory type of each range
+/// @param saddr the starting address for the map
+/// @param eaddr the ending address for the map
+/// @param attr the memory attributes to apply to the map
+///
+inline void
+identity_map(
+    mmap &map,
+    const mtrrs &mtrr,
+    mmap::phys_addr_t saddr,
+    mmap::phys_addr_t eaddr,
+    mmap::attr_type attr = mmap::attr_type::read_write_execute)
+{
+    using namespace ::intel_x64::ept;
+
+    expects(mtrr.size() != 0);
+    expects(bfn::lower(saddr, pd::from) == 0);
+    expects(bfn::lower(eaddr, pd::from) == 0);
+
+    for_each_mtrr_range(mtrr, saddr, eaddr, [&](auto addr, auto size, auto type) {
+        map.map_range(addr, addr, size, attr, type);
+    });
+}
+
 /// Identity Map
 ///
 /// Adds a 1:1 map from the starting address to the ending address.
 /// This version incorporates the MTRRs, ensuring the cache type is set up
-/// properly in EPT. 2m granularity is always used unless the MTRRs define a
-/// range that is not on a 2m boundry in which case 4k is used. Regular RAM
-/// is likely to be mapped using 2m regions.
+/// properly in EPT. The largest page size possible is always used, which
+/// means 1g granularity is used unless the MTRRs define a range that is not
+/// on a 1g boundry in which case 2m or 4k is used. Regular RAM is likely to
+/// be mapped using 1g regions.
 ///
 /// Note that this version should ALWAYS be used when creating an EPT memory
 /// map for the Host OS, as using EPT ignores the MTRRs which can cause
@@ -466,54 +602,421 @@ identity_map(
     mmap::phys_addr_t saddr,
     mmap::phys_addr_t eaddr,
     mmap::attr_type attr = mmap::attr_type::read_write_execute)
+{ identity_map(map, *g_mtrrs, saddr, eaddr, attr); }
+
+/// Identity Map
+///
+/// Adds a 1:1 map from 0 to the ending address.
+/// This version incorporates the MTRRs, ensuring the cache type is set up
+/// properly in EPT. The largest page size possible is always used, which
+/// means 1g granularity is used unless the MTRRs define a range that is not
+/// on a 1g boundry in which case 2m or 4k is used. Regular RAM is likely to
+/// be mapped using 1g regions.
+///
+/// Note that this version should ALWAYS be used when creating an EPT memory
+/// map for the Host OS, as using EPT ignores the MTRRs which can cause
+/// corruption on the host OS.
+///
+/// @param map the map to apply the identity map too
+/// @param eaddr the ending address for the map
+/// @param attr the memory attributes to apply to the map
+///
+inline void
+identity_map(
+    mmap &map,
+    mmap::phys_addr_t eaddr,
+    mmap::attr_type attr = mmap::attr_type::read_write_execute)
+{ identity_map(map, 0, eaddr, attr); }
+
+/// Parallel Identity Map
+///
+/// Builds the same map as identity_map(map, mtrr, saddr, eaddr, attr), but
+/// splits the work into one task per 1g region (i.e. per PDPT entry), so
+/// that the page directories and page tables below each region are filled
+/// in by as many CPUs as the caller provides. Regions never share a table
+/// below the PDPT, so the tasks only contend when the first task of each
+/// 512g region installs its PDPT. This is done with the map in concurrent
+/// mode (see mmap::set_concurrent()), which installs new tables with a
+/// compare-and-swap, and counts the entries of each table once every task
+/// is done. The map is then returned to the mode it was in.
+///
+/// The tasks are run by calling parallel_for(num_tasks, task), which must
+/// call task(i) exactly once for each i in [0, num_tasks), from any number
+/// of CPUs (or threads), and only return once every call has returned.
+/// Tasks do not throw. If a task fails, the first error is rethrown once
+/// parallel_for() returns. Since the tables are allocated by every CPU at
+/// the same time, the map should take its tables from a page_pool, ideally
+/// one that has been reserved up front.
+///
+/// @expects the map shares no page tables with another map and its reverse
+///     map is disabled (see mmap::set_concurrent())
+/// @ensures
+///
+/// @param map the map to apply the identity map too
+/// @param mtrr the MTRRs that define the memory type of each range
+/// @param saddr the starting address for the map
+/// @param eaddr the ending address for the map
+/// @param parallel_for the function used to run the tasks
+/// @param attr the memory attributes to apply to the map
+///
+template<typename parallel_for_type>
+inline void
+identity_map_parallel(
+    mmap &map,
+    const mtrrs &mtrr,
+    mmap::phys_addr_t saddr,
+    mmap::phys_addr_t eaddr,
+    parallel_for_type parallel_for,
+    mmap::attr_type attr = mmap::attr_type::read_write_execute)
 {
     using namespace ::intel_x64::ept;
-    auto range = g_mtrrs->ranges().begin();
 
-    expects(g_mtrrs->size() != 0);
+    struct run_type {
+        mmap::phys_addr_t addr;
+        mmap::size_type size;
+        mmap::memory_type type;
+    };
+
+    expects(mtrr.size() != 0);
     expects(bfn::lower(saddr, pd::from) == 0);
     expects(bfn::lower(eaddr, pd::from) == 0);
 
-    while (saddr < eaddr) {
-        while (!range->contains(saddr)) {
-            range++;
+    if (saddr >= eaddr) {
+        return;
+    }
+
+    std::vector<run_type> runs;
+    for_each_mtrr_range(mtrr, saddr, eaddr, [&](auto addr, auto size, auto type) {
+        runs.push_back({addr, size, type});
+    });
+
+    auto base = bfn::upper(saddr, pdpt::from);
+    auto num_tasks = ((eaddr - base) + pdpt::page_size - 1) >> pdpt::from;
+
+    std::mutex mutex;
+    std::exception_ptr error;
+
+    auto task = [&](mmap::size_type i) {
+        try {
+            auto task_saddr = std::max(saddr, base + (i << pdpt::from));
+            auto task_eaddr = std::min(eaddr, base + ((i + 1) << pdpt::from));
+
+            auto run = std::upper_bound(
+                           runs.begin(), runs.end(), task_saddr,
+                           [](auto addr, const auto &r) { return addr < r.addr; }
+                       );
+
+            for (--run; run != runs.end() && run->addr < task_eaddr; ++run) {
+                auto addr = std::max(run->addr, task_saddr);
+                auto size = std::min(run->addr + run->size, task_eaddr) - addr;
+
+                map.map_range(addr, addr, size, attr, run->type);
+            }
         }
+        catch (...) {
+            std::lock_guard<std::mutex> lock(mutex);
+
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    };
+
+    auto concurrent = map.is_concurrent();
+    map.set_concurrent(true);
+
+    auto ___ = gsl::finally([&] {
+        map.set_concurrent(concurrent);
+    });
+
+    parallel_for(num_tasks, task);
+
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+/// Parallel Identity Map
+///
+/// Builds the same map as identity_map(map, saddr, eaddr, attr) using the
+/// MTRRs of this CPU, spreading the work over the CPUs provided by
+/// parallel_for (see the version above).
+///
+/// @param map the map to apply the identity map too
+/// @param saddr the starting address for the map
+/// @param eaddr the ending address for the map
+/// @param parallel_for the function used to run the tasks
+/// @param attr the memory attributes to apply to the map
+///
+template<typename parallel_for_type>
+inline void
+identity_map_parallel(
+    mmap &map,
+    mmap::phys_addr_t saddr,
+    mmap::phys_addr_t eaddr,
+    parallel_for_type parallel_for,
+    mmap::attr_type attr = mmap::attr_type::read_write_execute)
+{ identity_map_parallel(map, *g_mtrrs, saddr, eaddr, parallel_for, attr); }
+
+//--------------------------------------------------------------------------
+// Memory Map
+//--------------------------------------------------------------------------
+
+/// Memory Region
+///
+/// Describes a range of physical memory reported by the platform, i.e. an
+/// E820 or EFI memory map entry, or an MMIO window decoded by a PCI host
+/// bridge or device. Neither the base nor the size has to be page aligned.
+///
+struct memory_region_t {
+
+    /// Type
+    ///
+    /// Defines what the range is used for. Every type other than unusable
+    /// is mapped, as the firmware reserved and ACPI ranges also contain
+    /// MMIO (e.g. the local and I/O APICs and the PCIe configuration
+    /// space) and tables that the OS needs access to.
+    ///
+    enum class type_t {
+        ram,
+        reserved,
+        acpi_reclaimable,
+        acpi_nvs,
+        unusable,
+        mmio
+    };
+
+    /// Type
+    ///
+    /// Defines the type of the range
+    ///
+    type_t type{type_t::ram};
+
+    /// Base Address
+    ///
+    /// Defines the starting address of the range.
+    ///
+    uint64_t base{0};
 
-        if (bfn::lower(saddr, pd::from) == 0 &&
-            std::min(range->distance(saddr), eaddr - saddr) >= pd::page_size
-           ) {
-            map.map_2m(saddr, saddr, attr, range->type);
-            saddr += pd::page_size;
+    /// Size
+    ///
+    /// Defines the size of the range.
+    ///
+    uint64_t size{0};
+};
+
+/// Memory Map Type
+///
+/// The list of regions reported by the platform, in any order, and possibly
+/// overlapping.
+///
+using memory_map_t = std::vector<memory_region_t>;
+
+/// Memory Map Ranges
+///
+/// Returns the ranges of physical memory described by the provided memory
+/// map that should be mapped, as a sorted list of [start, end) pairs. Each
+/// region other than an unusable one is extended to 4k boundaries, and
+/// overlapping and adjacent regions are merged.
+///
+/// @param memory_map the regions reported by the platform
+/// @return Returns the sorted, merged, 4k aligned ranges
+///
+inline std::vector<std::pair<mmap::phys_addr_t, mmap::phys_addr_t>>
+memory_map_ranges(const memory_map_t &memory_map)
+{
+    using namespace ::intel_x64::ept;
+
+    std::vector<std::pair<mmap::phys_addr_t, mmap::phys_addr_t>> runs;
+    runs.reserve(memory_map.size());
+
+    for (const auto &region : memory_map) {
+        if (region.type == memory_region_t::type_t::unusable || region.size == 0) {
+            continue;
         }
-        else {
-            map.map_4k(saddr, saddr, attr, range->type);
-            saddr += pt::page_size;
+
+        runs.emplace_back(
+            bfn::upper(region.base, pt::from),
+            bfn::upper(region.base + region.size + pt::page_size - 1, pt::from)
+        );
+    }
+
+    std::sort(runs.begin(), runs.end());
+
+    std::vector<std::pair<mmap::phys_addr_t, mmap::phys_addr_t>> ranges;
+
+    for (const auto &run : runs) {
+        if (!ranges.empty() && run.first <= ranges.back().second) {
+            ranges.back().second = std::max(ranges.back().second, run.second);
+            continue;
         }
+
+        ranges.push_back(run);
     }
+
+    return ranges;
 }
 
 /// Identity Map
 ///
-/// Adds a 1:1 map from 0 to the ending address.
-/// This version incorporates the MTRRs, ensuring the cache type is set up
-/// properly in EPT. 2m granularity is always used unless the MTRRs define a
-/// range that is not on a 2m boundry in which case 4k is used. Regular RAM
-/// is likely to be mapped using 2m regions.
+/// Adds a 1:1 map of every region in the provided memory map, leaving the
+/// holes between the regions unmapped, so that a stray access to an
+/// address that is neither RAM nor MMIO causes an EPT violation instead of
+/// reaching whatever happens to decode it. Compared to mapping everything
+/// up to MAX_PHYS_ADDR, this also needs a lot fewer page tables.
 ///
-/// Note that this version should ALWAYS be used when creating an EPT memory
-/// map for the Host OS, as using EPT ignores the MTRRs which can cause
-/// corruption on the host OS.
+/// Each region is extended to 4k boundaries, overlapping and adjacent
+/// regions are merged, and every merged region is mapped like the other
+/// versions of identity_map(): the memory type is taken from the provided
+/// MTRRs, and the largest page size that fits inside both the region and
+/// the MTRR range is used. A 1g page is thus only used for a 1g aligned
+/// part of a region that covers the entire 1g.
+///
+/// @expects
+/// @ensures
 ///
 /// @param map the map to apply the identity map too
-/// @param eaddr the ending address for the map
+/// @param mtrr the MTRRs that define the memory type of each range
+/// @param memory_map the regions reported by the platform
 /// @param attr the memory attributes to apply to the map
 ///
 inline void
 identity_map(
     mmap &map,
+    const mtrrs &mtrr,
+    const memory_map_t &memory_map,
+    mmap::attr_type attr = mmap::attr_type::read_write_execute)
+{
+    const mtrrs::range_t *cursor = nullptr;
+
+    for (const auto &range : memory_map_ranges(memory_map)) {
+        for_each_mtrr_range(mtrr, cursor, range.first, range.second, [&](auto addr, auto size, auto type) {
+            map.map_range(addr, addr, size, attr, type);
+        });
+    }
+}
+
+/// Identity Map Page
+///
+/// Adds a 1:1 map of a single page that contains the provided address, for
+/// maps that are populated on demand (see
+/// ept_violation_handler::enable_demand_mapping()). The largest page that
+/// is no larger than max_page_size, that fits inside the range from the
+/// starting address to the ending address, that has a single memory type
+/// according to the provided MTRRs, and that does not overlap anything
+/// that is already mapped, is used.
+///
+/// The map may be shared with other CPUs that populate it at the same
+/// time (see mmap::set_concurrent()). If another CPU maps the same region
+/// first, nothing is mapped. If another CPU maps part of the region first,
+/// a smaller page is tried. A failure to map that is not caused by another
+/// CPU (i.e. nothing else was mapped in the meantime) is not retried, and
+/// is passed on to the caller.
+///
+/// @expects saddr <= addr < eaddr, and saddr and eaddr are 4k aligned
+/// @ensures
+///
+/// @param map the map to apply the identity map too
+/// @param mtrr the MTRRs that define the memory type of each range
+/// @param addr the address to map
+/// @param saddr the starting address of the range that may be mapped
+/// @param eaddr the ending address of the range that may be mapped
+/// @param max_page_size the largest page size that may be used. 1g pages
+///     are only used if mmap::is_1g_supported().
+/// @param attr the memory attributes to apply to the map
+/// @return Returns the size of the page that was mapped, or 0 if the
+///     address was already mapped
+///
+inline mmap::size_type
+identity_map_page(
+    mmap &map,
+    const mtrrs &mtrr,
+    mmap::phys_addr_t addr,
+    mmap::phys_addr_t saddr,
     mmap::phys_addr_t eaddr,
+    mmap::size_type max_page_size = ::intel_x64::ept::pdpt::page_size,
     mmap::attr_type attr = mmap::attr_type::read_write_execute)
-{ identity_map(map, 0, eaddr, attr); }
+{
+    using namespace ::intel_x64::ept;
+
+    expects(saddr <= addr && addr < eaddr);
+    expects(bfn::lower(saddr, pt::from) == 0);
+    expects(bfn::lower(eaddr, pt::from) == 0);
+
+    if (max_page_size > pd::page_size && !mmap::is_1g_supported()) {
+        max_page_size = pd::page_size;
+    }
+
+    while (auto unmapped = map.unmapped_size(addr)) {
+        for (auto page_size : {pdpt::page_size, pd::page_size, pt::page_size}) {
+            if (page_size > max_page_size && page_size != pt::page_size) {
+                continue;
+            }
+
+            if (page_size > unmapped) {
+                continue;
+            }
+
+            auto base = addr & ~(page_size - 1);
+            if (base < saddr || base + page_size > eaddr) {
+                continue;
+            }
+
+            auto num_types = 0ULL;
+            auto cache = mmap::memory_type::uncacheable;
+
+            for_each_mtrr_range(mtrr, base, base + page_size, [&](auto, auto, auto type) {
+                num_types += (num_types == 0 || type != cache) ? 1 : 0;
+                cache = type;
+            });
+
+            if (num_types != 1 && page_size != pt::page_size) {
+                continue;
+            }
+
+            try {
+                map.map_range(base, base, page_size, attr, cache);
+                return page_size;
+            }
+            catch (std::runtime_error &) {
+
+                // Another CPU mapped part of the region first, which leaves
+                // less unmapped around the address than before. Start over
+                // with what is left of it. Since that can only happen a
+                // few times before the region is down to a single page (or
+                // the address is mapped), this retries a bounded number of
+                // times. Any other failure is passed on.
+                //
+                if (map.unmapped_size(addr) >= unmapped) {
+                    throw;
+                }
+
+                break;
+            }
+        }
+    }
+
+    return 0;
+}
+
+/// Identity Map
+///
+/// Adds a 1:1 map of every region in the provided memory map, using the
+/// MTRRs of this CPU to set up the memory types (see the version above).
+///
+/// @expects
+/// @ensures
+///
+/// @param map the map to apply the identity map too
+/// @param memory_map the regions reported by the platform
+/// @param attr the memory attributes to apply to the map
+///
+inline void
+identity_map(
+    mmap &map,
+    const memory_map_t &memory_map,
+    mmap::attr_type attr = mmap::attr_type::read_write_execute)
+{ identity_map(map, *g_mtrrs, memory_map, attr); }
 
 }
 }
@@ -19,6 +19,14 @@
 #ifndef EPT_MMAP_INTEL_X64_H
 #define EPT_MMAP_INTEL_X64_H
 
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
 #include <bfgsl.h>
@@ -27,6 +35,8 @@
 #include <intrinsics.h>
 #include <bfvmm/memory_manager/memory_manager.h>
 
+#include "pool.h"
+
 // -----------------------------------------------------------------------------
 // Exports
 // -----------------------------------------------------------------------------
@@ -102,8 +112,66 @@ public:
         phys_addr_t phys_addr{};
     };
 
+    static_assert(
+        __atomic_always_lock_free(sizeof(entry_type), nullptr),
+        "entries must be lock-free atomics"
+    );
+
+    struct walk_cache_stats_type {
+        size_type size;
+        size_type hits;
+        size_type misses;
+    };
+
+    struct stats_type {
+        size_type num_pml4_tables;
+        size_type num_pdpt_tables;
+        size_type num_pd_tables;
+        size_type num_pt_tables;
+        size_type mapped_1g;
+        size_type mapped_2m;
+        size_type mapped_4k;
+        size_type num_memory_types;
+        size_type num_splits;
+        size_type num_merges;
+    };
+
+    using dirty_bitmap_type = std::vector<uint64_t>;
+    using rmap_type = std::unordered_multimap<phys_addr_t, virt_addr_t>;
+
+    struct image_run_type {
+        virt_addr_t virt_addr;
+        phys_addr_t phys_addr;
+        size_type size;
+        size_type page_size;
+        entry_type flags;
+    };
+
+    using image_type = std::vector<image_run_type>;
+
+    struct range_type {
+        virt_addr_t virt_addr;
+        phys_addr_t phys_addr;
+        size_type size;
+        entry_type flags;
+    };
+
+    struct translation_type {
+        phys_addr_t phys_addr;
+        size_type page_size;
+
+        explicit operator bool() const noexcept
+        { return page_size != 0; }
+    };
+
     // @endcond
 
+    /// Default Walk Cache Size
+    ///
+    /// The number of page tables the walk cache remembers by default
+    ///
+    constexpr static const size_type default_walk_cache_size = 8;
+
     /// Constructor
     ///
     /// @expects
@@ -113,6 +181,23 @@ public:
         m_pml4{allocate_span(::intel_x64::ept::pml4::num_entries), 0}
     { }
 
+    /// Constructor
+    ///
+    /// Creates a map that takes its page tables from the provided pool
+    /// instead of the memory manager. The pool may be shared with other
+    /// maps, and must outlive this map.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param pool the pool to allocate page tables from. If the pointer is
+    ///     a nullptr, the memory manager is used.
+    ///
+    explicit mmap(page_pool *pool) :
+        m_pool{pool},
+        m_pml4{this->allocate(::intel_x64::ept::pml4::num_entries)}
+    { }
+
     /// Destructor
     ///
     /// @expects
@@ -120,6 +205,10 @@ public:
     ///
     ~mmap()
     {
+        if (m_pml4.virt_addr.empty()) {
+            return;
+        }
+
         for (auto pml4i = 0; pml4i < ::intel_x64::ept::pml4::num_entries; pml4i++) {
             auto &entry = m_pml4.virt_addr.at(pml4i);
 
@@ -130,7 +219,7 @@ public:
             this->clear_pdpt(pml4i);
         }
 
-        free_page(m_pml4.virt_addr.data());
+        this->free(m_pml4);
     }
 
     /// EPTP
@@ -149,6 +238,302 @@ public:
         return m_pml4.phys_addr;
     }
 
+    /// Set Concurrent
+    ///
+    /// By default, a map keeps track of the tables it last walked (see
+    /// set_walk_cache_size()), which means that even lookups modify the
+    /// map, and the map cannot be shared between CPUs without a lock.
+    ///
+    /// In concurrent mode, every walk is done without touching any state
+    /// owned by the map. Lookups (entry(), virt_to_phys(), from()) take no
+    /// lock owned by the map and never allocate. Note that each step of a
+    /// walk translates the physical address of a table using
+    /// g_mm->physint_to_virtptr(), so lookups are only lock-free if the
+    /// memory manager's translation is. If it takes a lock, lookups must
+    /// not be made from a context that can interrupt the memory manager
+    /// (e.g. an NMI handler). New page tables are installed with a
+    /// compare-and-swap, with the loser of a race freeing its table and
+    /// using the winner's. Entries are installed and cleared atomically.
+    /// Since a reader might still be walking a page table that is no longer
+    /// used, release() only unmaps the address in concurrent mode, and
+    /// page tables are not freed until the map is destroyed. For the same
+    /// reason, the number of entries used in each page table (see
+    /// verify_occupancy()) is not tracked in concurrent mode, and is
+    /// recounted when concurrent mode is disabled.
+    ///
+    /// Enable concurrent mode before sharing the map. If a page_pool is
+    /// used, the pool is safe to share as well.
+    ///
+    /// @expects enabled is false, or the map shares no page tables with
+    ///     another map (see clone()), and the reverse map is disabled (see
+    ///     enable_rmap())
+    /// @ensures
+    ///
+    /// @param enabled true to enable concurrent mode, false to disable it
+    ///
+    void
+    set_concurrent(bool enabled)
+    {
+        expects(!enabled || !m_shared);
+        expects(!enabled || !m_rmap_enabled);
+
+        if (m_concurrent == enabled) {
+            return;
+        }
+
+        m_concurrent = enabled;
+        m_occupancy.clear();
+
+        if (!enabled) {
+            this->count_occupancy(m_pml4, ::intel_x64::ept::pml4::from, m_occupancy);
+        }
+    }
+
+    /// Is Concurrent
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return returns true if the map is in concurrent mode, false
+    ///     otherwise
+    ///
+    bool
+    is_concurrent() const noexcept
+    { return m_concurrent; }
+
+    /// Update Entry
+    ///
+    /// Atomically replaces the entry that maps the provided virtual
+    /// address, but only if it still contains the expected value. This is
+    /// how entries returned by entry() should be modified when the map is
+    /// shared.
+    ///
+    /// @expects the virtual address is mapped
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address whose entry is updated
+    /// @param expected the value the entry is expected to contain
+    /// @param desired the value to write into the entry
+    /// @return returns true if the entry was updated, false if the entry
+    ///     no longer contained the expected value
+    ///
+    bool
+    update_entry(virt_addr_t virt_addr, entry_type expected, entry_type desired)
+    {
+        auto &entry = this->entry(virt_addr);
+
+        uintptr_t from = 0;
+        if (m_concurrent) {
+            size_type page_size = 0;
+            this->concurrent_find(virt_addr, &page_size);
+            from = page_size_to_from(page_size);
+        }
+        else {
+            this->find(virt_addr, from);
+        }
+
+        if (!this->compare_exchange(entry, expected, desired)) {
+            return false;
+        }
+
+        if (desired == 0) {
+            this->occupy(&entry, -1);
+        }
+
+        this->count_pages(expected, from, -1);
+        this->count_pages(desired, from, 1);
+
+        this->rmap_erase(virt_addr, expected, from);
+        this->rmap_insert(virt_addr, desired, from);
+
+        this->invalidate();
+        return true;
+    }
+
+    /// Generation
+    ///
+    /// Returns the number of times the map has been changed in a way that
+    /// requires cached translations to be invalidated (i.e. an entry was
+    /// removed or modified). Adding a new mapping does not change the
+    /// generation, as the CPU does not cache entries that are not present.
+    ///
+    /// A vCPU that remembers the generation it last invalidated at only
+    /// needs to execute INVEPT when the generation has changed, no matter
+    /// how many entries were changed in the mean time (see
+    /// ept_handler::sync()).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the current generation of the map
+    ///
+    uint64_t
+    generation() const noexcept
+    { return m_generation.load(); }
+
+    /// Invalidate
+    ///
+    /// Increments the generation of the map. unmap(), release() and
+    /// update_entry() do this for you. If an entry returned by entry() or
+    /// one of the map functions is modified in place, this function must be
+    /// called once the modifications are complete.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void
+    invalidate() noexcept
+    { m_generation.fetch_add(1); }
+
+    /// Harvest Dirty
+    ///
+    /// Scans the provided range for pages the guest has written to, and
+    /// atomically clears their dirty flags. This requires the EPT accessed
+    /// and dirty flags to be enabled (see
+    /// ept_handler::enable_accessed_and_dirty_flags()).
+    ///
+    /// Every table in the range is walked, as the accessed flag of a table
+    /// entry cannot be used to skip the region below it: a CPU that caches
+    /// the table entry (in its paging-structure caches) does not set the
+    /// flag again after it is cleared, even though it keeps writing to the
+    /// pages below it, and the accessed flags of table entries are
+    /// therefore neither looked at nor cleared. A clean 1g or 2m page is
+    /// skipped as a single entry. The dirty flag of a large page is only
+    /// cleared if the entire page is inside the range, so scanning part of
+    /// it never loses writes made to the rest of it.
+    ///
+    /// Likewise, a CPU that still caches a translation for which it has
+    /// already set the dirty flag will not set it again, so a write made
+    /// through such a translation after the flag is cleared would be missed
+    /// by the next harvest. For this reason, if any flag was cleared, the
+    /// map is invalidated (see generation()) and flush is called before the
+    /// bitmap is returned. flush must not return until every CPU that may be
+    /// using this map has dropped its cached translations (i.e. it must
+    /// INVEPT on the current CPU, and shoot down every other vCPU using the
+    /// map and wait for each of them to INVEPT). Invalidating the map alone
+    /// is not enough, as a vCPU only syncs on its next VM exit. Writes made
+    /// between the flags being cleared and flush returning are to pages that
+    /// are reported in the returned bitmap, so they are not lost as long as
+    /// the pages are read after this function returns.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @expects the map shares no page tables with another map (see
+    ///     clone()), as the flags of a shared table would be cleared for
+    ///     every map that shares it
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range to scan
+    /// @param size the number of bytes to scan
+    /// @param flush called (with no arguments) if any flag was cleared, and
+    ///     must flush the cached translations of every CPU using this map
+    /// @return Returns a bitmap with one bit per 4k page in the range, with
+    ///     bit n (bit n % 64 of word n / 64) set if the page at
+    ///     virt_addr + (n * 4k) was written to
+    ///
+    template<typename flush_type>
+    dirty_bitmap_type
+    harvest_dirty(virt_addr_t virt_addr, size_type size, flush_type &&flush)
+    {
+        expects(bfn::lower(virt_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pt::from) == 0);
+        expects(!m_shared);
+
+        auto num_pages = size >> ::intel_x64::ept::pt::from;
+        dirty_bitmap_type bitmap((num_pages + 63) / 64, 0);
+
+        auto cleared = this->harvest_table(
+                           m_pml4, ::intel_x64::ept::pml4::from,
+                           virt_addr, virt_addr + size, virt_addr, bitmap
+                       );
+
+        if (cleared) {
+            this->invalidate();
+            flush();
+        }
+
+        return bitmap;
+    }
+
+    /// Set Walk Cache Size
+    ///
+    /// Every time a page table is walked, the virtual address of each table
+    /// along the way has to be looked up from the physical address stored in
+    /// its parent's entry. The walk cache remembers the last N tables that
+    /// were looked up (keyed by their parent table and index), so that
+    /// walks that alternate between a handful of regions do not have to
+    /// translate the same tables over and over. The tables the last walk
+    /// went through are always checked first, and do not count as hits or
+    /// misses. Changing the size of the cache flushes it, but does not
+    /// reset the hit / miss counters.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param num_entries the number of tables the walk cache should hold.
+    ///     A size of 0 disables the walk cache.
+    ///
+    void
+    set_walk_cache_size(size_type num_entries)
+    {
+        m_walk_cache.assign(num_entries, {});
+        m_walk_cache_next = 0;
+    }
+
+    /// Walk Cache Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the size of the walk cache, and the number of hits
+    ///     and misses it has seen so far
+    ///
+    walk_cache_stats_type
+    walk_cache_stats() const noexcept
+    { return {m_walk_cache.size(), m_walk_cache_hits, m_walk_cache_misses}; }
+
+    /// Stats
+    ///
+    /// Returns the number of page tables the map is made of (each of which
+    /// is a 4k page of VMM memory), the number of bytes mapped by 1g, 2m
+    /// and 4k pages, the number of distinct memory types used by the
+    /// mapped pages, and the number of times a large page was split (see
+    /// split_1g(), split_2m() and protect()) or a table was merged back
+    /// into a large page (see compact()) since the map was created.
+    ///
+    /// These are kept up to date as the map is modified, so calling this
+    /// function is cheap, and it can be called at any time, including in
+    /// concurrent mode (in which case each value is read atomically, but
+    /// the values are not a snapshot of a single point in time). Tables
+    /// that are shared with another map (see clone()) are counted by every
+    /// map that uses them.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the map's statistics
+    ///
+    stats_type
+    stats() const noexcept
+    {
+        size_type num_memory_types = 0;
+        for (const auto &mapped : m_num_mapped_by_type) {
+            num_memory_types += this->load(mapped) != 0 ? 1 : 0;
+        }
+
+        return {
+            this->load(m_num_tables[3]),
+            this->load(m_num_tables[2]),
+            this->load(m_num_tables[1]),
+            this->load(m_num_tables[0]),
+            this->load(m_num_mapped[2]),
+            this->load(m_num_mapped[1]),
+            this->load(m_num_mapped[0]),
+            num_memory_types,
+            this->load(m_num_splits),
+            this->load(m_num_merges)
+        };
+    }
+
     /// Map 1g Virt Address to Phys Address
     ///
     /// @expects
@@ -168,8 +553,10 @@ public:
         attr_type attr = attr_type::read_write_execute,
         memory_type cache = memory_type::write_back)
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        return this->map_pdpte(virt_addr, phys_addr, attr, cache);
+        return this->set_entry<pdpt_level>(
+                   this->walk_to(reinterpret_cast<virt_addr_t>(virt_addr), pdpt_level::from),
+                   reinterpret_cast<virt_addr_t>(virt_addr), phys_addr, leaf_bits(attr, cache)
+               );
     }
 
     /// Map 1g Virt Address to Phys Address
@@ -213,10 +600,10 @@ public:
         attr_type attr = attr_type::read_write_execute,
         memory_type cache = memory_type::write_back)
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
-
-        return this->map_pde(virt_addr, phys_addr, attr, cache);
+        return this->set_entry<pd_level>(
+                   this->walk_to(reinterpret_cast<virt_addr_t>(virt_addr), pd_level::from),
+                   reinterpret_cast<virt_addr_t>(virt_addr), phys_addr, leaf_bits(attr, cache)
+               );
     }
 
     /// Map 2m Virt Address to Phys Address
@@ -260,11 +647,10 @@ public:
         attr_type attr = attr_type::read_write_execute,
         memory_type cache = memory_type::write_back)
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
-        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
-
-        return this->map_pte(virt_addr, phys_addr, attr, cache);
+        return this->set_entry<pt_level>(
+                   this->walk_to(reinterpret_cast<virt_addr_t>(virt_addr), pt_level::from),
+                   reinterpret_cast<virt_addr_t>(virt_addr), phys_addr, leaf_bits(attr, cache)
+               );
     }
 
     /// Map 4k Virt Address to Phys Address
@@ -289,42 +675,219 @@ public:
         return map_4k(reinterpret_cast<virt_addr_t *>(virt_addr), phys_addr, attr, cache);
     }
 
-    /// Unmap Virtual Address
+    /// Map 1g Range
     ///
-    /// @expects
+    /// Maps a contiguous range of virtual addresses to a contiguous range
+    /// of physical addresses using 1g pages. Unlike calling map_1g() for
+    /// each page, each PDPT is only looked up once, and all of the entries
+    /// in the range that belong to the same PDPT are filled in one pass.
+    ///
+    /// @expects virt_addr, phys_addr and size are 1g aligned
     /// @ensures
     ///
-    /// @param virt_addr the virtual address to unmap
+    /// @param virt_addr the virtual address to map from
+    /// @param phys_addr the physical address to map to
+    /// @param size the number of bytes to map
+    /// @param attr the map permissions
+    /// @param cache the memory type for the mapping
     ///
     void
-    unmap(virt_addr_t *virt_addr)
+    map_range_1g(
+        virt_addr_t virt_addr,
+        phys_addr_t phys_addr,
+        size_type size,
+        attr_type attr = attr_type::read_write_execute,
+        memory_type cache = memory_type::write_back)
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        auto &pdpte = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+        expects(bfn::lower(virt_addr, ::intel_x64::ept::pdpt::from) == 0);
+        expects(bfn::lower(phys_addr, ::intel_x64::ept::pdpt::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pdpt::from) == 0);
 
-        if (pdpte == 0) {
-            return;
+        while (size != 0) {
+            auto bytes = this->map_run<pdpt_level>(virt_addr, phys_addr, size, attr, cache);
+
+            virt_addr += bytes;
+            phys_addr += bytes;
+            size -= bytes;
         }
+    }
 
-        if (::intel_x64::ept::pdpt::entry::ps::is_enabled(pdpte)) {
-            pdpte = 0;
-            return;
+    /// Map 2m Range
+    ///
+    /// Maps a contiguous range of virtual addresses to a contiguous range
+    /// of physical addresses using 2m pages. Unlike calling map_2m() for
+    /// each page, each PD is only looked up once, and all of the entries
+    /// in the range that belong to the same PD are filled in one pass.
+    ///
+    /// @expects virt_addr, phys_addr and size are 2m aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to map from
+    /// @param phys_addr the physical address to map to
+    /// @param size the number of bytes to map
+    /// @param attr the map permissions
+    /// @param cache the memory type for the mapping
+    ///
+    void
+    map_range_2m(
+        virt_addr_t virt_addr,
+        phys_addr_t phys_addr,
+        size_type size,
+        attr_type attr = attr_type::read_write_execute,
+        memory_type cache = memory_type::write_back)
+    {
+        expects(bfn::lower(virt_addr, ::intel_x64::ept::pd::from) == 0);
+        expects(bfn::lower(phys_addr, ::intel_x64::ept::pd::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pd::from) == 0);
+
+        while (size != 0) {
+            auto bytes = this->map_run<pd_level>(virt_addr, phys_addr, size, attr, cache);
+
+            virt_addr += bytes;
+            phys_addr += bytes;
+            size -= bytes;
         }
+    }
 
-        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
-        auto &pde = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+    /// Map 4k Range
+    ///
+    /// Maps a contiguous range of virtual addresses to a contiguous range
+    /// of physical addresses using 4k pages. Unlike calling map_4k() for
+    /// each page, each PT is only looked up once, and all of the entries
+    /// in the range that belong to the same PT are filled in one pass.
+    ///
+    /// @expects virt_addr, phys_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to map from
+    /// @param phys_addr the physical address to map to
+    /// @param size the number of bytes to map
+    /// @param attr the map permissions
+    /// @param cache the memory type for the mapping
+    ///
+    void
+    map_range_4k(
+        virt_addr_t virt_addr,
+        phys_addr_t phys_addr,
+        size_type size,
+        attr_type attr = attr_type::read_write_execute,
+        memory_type cache = memory_type::write_back)
+    {
+        expects(bfn::lower(virt_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(phys_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pt::from) == 0);
 
-        if (pde == 0) {
-            return;
+        while (size != 0) {
+            auto bytes = this->map_run<pt_level>(virt_addr, phys_addr, size, attr, cache);
+
+            virt_addr += bytes;
+            phys_addr += bytes;
+            size -= bytes;
+        }
+    }
+
+    /// 1g Pages Supported
+    ///
+    /// Not every CPU that supports EPT supports 1g pages, which is reported
+    /// by IA32_VMX_EPT_VPID_CAP. 2m pages are always supported. Functions
+    /// that pick the page size for you (e.g. map_range()) only use 1g pages
+    /// when this returns true. map_1g() does not check, as asking for a 1g
+    /// page explicitly is up to the caller.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns true if the CPU supports 1g EPT pages
+    ///
+    static bool
+    is_1g_supported()
+    { return ::intel_x64::msrs::ia32_vmx_ept_vpid_cap::pdpte_1gb_support::is_enabled(); }
+
+    /// Map Range
+    ///
+    /// Maps a contiguous range of virtual addresses to a contiguous range
+    /// of physical addresses using the largest page size that the alignment
+    /// of both addresses and the remaining size allow. Since the end of a
+    /// table is always aligned to the page size of the next level up, each
+    /// run is filled until it either ends, or the next larger page size
+    /// can be used. 1g pages are only used if is_1g_supported().
+    ///
+    /// @expects virt_addr, phys_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to map from
+    /// @param phys_addr the physical address to map to
+    /// @param size the number of bytes to map
+    /// @param attr the map permissions
+    /// @param cache the memory type for the mapping
+    ///
+    void
+    map_range(
+        virt_addr_t virt_addr,
+        phys_addr_t phys_addr,
+        size_type size,
+        attr_type attr = attr_type::read_write_execute,
+        memory_type cache = memory_type::write_back)
+    {
+        expects(bfn::lower(virt_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(phys_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pt::from) == 0);
+
+        auto use_1g = is_1g_supported();
+
+        while (size != 0) {
+            size_type bytes = 0;
+            auto addrs = virt_addr | phys_addr;
+
+            if (use_1g && bfn::lower(addrs, ::intel_x64::ept::pdpt::from) == 0 &&
+                size >= ::intel_x64::ept::pdpt::page_size) {
+                bytes = this->map_run<pdpt_level>(virt_addr, phys_addr, size, attr, cache);
+            }
+            else if (bfn::lower(addrs, ::intel_x64::ept::pd::from) == 0 &&
+                     size >= ::intel_x64::ept::pd::page_size) {
+                bytes = this->map_run<pd_level>(virt_addr, phys_addr, size, attr, cache);
+            }
+            else {
+                bytes = this->map_run<pt_level>(virt_addr, phys_addr, size, attr, cache);
+            }
+
+            virt_addr += bytes;
+            phys_addr += bytes;
+            size -= bytes;
         }
+    }
+
+    /// Unmap Virtual Address
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to unmap
+    ///
+    void
+    unmap(virt_addr_t *virt_addr)
+    {
+        if (m_concurrent) {
+            size_type page_size = 0;
+
+            if (auto entry = this->concurrent_find(reinterpret_cast<virt_addr_t>(virt_addr), &page_size)) {
+                if (auto value = this->exchange(*entry, 0)) {
+                    this->count_pages(value, page_size_to_from(page_size), -1);
+                    this->invalidate();
+                }
+            }
 
-        if (::intel_x64::ept::pd::entry::ps::is_enabled(pde)) {
-            pde = 0;
             return;
         }
 
-        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
-        m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr)) = 0;
+        uintptr_t from;
+
+        if (auto entry = this->find(reinterpret_cast<virt_addr_t>(virt_addr), from)) {
+            this->count_pages(*entry, from, -1);
+            this->rmap_erase(reinterpret_cast<virt_addr_t>(virt_addr), *entry, from);
+            this->clear(*entry);
+            this->invalidate();
+        }
     }
 
     /// Unmap Virtual Address
@@ -358,8 +921,25 @@ public:
     void
     release(virt_addr_t *virt_addr)
     {
+        if (m_concurrent) {
+            this->unmap(virt_addr);
+            return;
+        }
+
+        auto num_tables = m_num_tables;
+        auto num_mapped = m_num_mapped;
+
         if (this->release_pdpte(virt_addr)) {
-            m_pml4.virt_addr.at(::intel_x64::ept::pml4::index(virt_addr)) = 0;
+            this->clear(m_pml4.virt_addr.at(::intel_x64::ept::pml4::index(virt_addr)));
+        }
+
+        // Walking to an address that has no page tables allocates them
+        // along the way (and then frees them again), so only a change in
+        // the number of tables or mapped pages means that something the
+        // CPU might have cached was actually removed.
+        //
+        if (num_tables != m_num_tables || num_mapped != m_num_mapped) {
+            this->invalidate();
         }
     }
 
@@ -379,47 +959,208 @@ public:
     void release(virt_addr_t virt_addr)
     { release(reinterpret_cast<virt_addr_t *>(virt_addr)); }
 
-    /// Virtual Address to Entry
+    /// Protect
     ///
-    /// @expects
+    /// Changes the permissions of every page that is mapped in a range of
+    /// virtual addresses, keeping their physical addresses, memory types
+    /// and accessed / dirty flags. Pages are updated at the largest page
+    /// size they are mapped with: only the large pages that straddle either
+    /// end of the range are split, and only down to the page size needed
+    /// to line up with the range. Addresses in the range that are not
+    /// mapped are skipped. If anything changed, the map is invalidated
+    /// (see generation()).
+    ///
+    /// @expects virt_addr and size are 4k aligned
     /// @ensures
     ///
-    /// @param virt_addr the virtual address to be converted
-    /// @return returns entry for the map
+    /// @param virt_addr the first virtual address of the range to protect
+    /// @param size the number of bytes to protect
+    /// @param attr the new map permissions
+    /// @return Returns the ranges whose permissions actually changed (with
+    ///     their new flags, see range_iterator), sorted and coalesced, so
+    ///     that the caller can limit any follow up work (e.g. harvesting
+    ///     or flushing) to what changed.
     ///
-    entry_type &
-    entry(virt_addr_t *virt_addr)
+    std::vector<range_type>
+    protect(virt_addr_t virt_addr, size_type size, attr_type attr)
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        auto &pdpte = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
-
-        if (pdpte == 0) {
-            throw std::runtime_error("entry: pdpte not mapped");
-        }
-
-        if (::intel_x64::ept::pdpt::entry::ps::is_enabled(pdpte)) {
-            return pdpte;
-        }
+        using namespace ::intel_x64::ept::pd::entry;
 
-        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
-        auto &pde = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
-
-        if (pde == 0) {
-            throw std::runtime_error("entry: pde not mapped");
-        }
+        return this->update_range(
+                   virt_addr, size,
+                   read_access::mask | write_access::mask | execute_access::mask,
+                   attr_bits(attr)
+               );
+    }
 
-        if (::intel_x64::ept::pd::entry::ps::is_enabled(pde)) {
-            return pde;
+    /// Protect
+    ///
+    /// Same as protect(virt_addr, size, attr), except that the memory type
+    /// of every page is changed as well. Both are changed with a single
+    /// write to each entry.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range to protect
+    /// @param size the number of bytes to protect
+    /// @param attr the new map permissions
+    /// @param cache the new memory type
+    /// @return Returns the ranges that actually changed (see protect())
+    ///
+    std::vector<range_type>
+    protect(virt_addr_t virt_addr, size_type size, attr_type attr, memory_type cache)
+    {
+        using namespace ::intel_x64::ept::pd::entry;
+
+        return this->update_range(
+                   virt_addr, size,
+                   read_access::mask | write_access::mask | execute_access::mask |
+                   ::intel_x64::ept::pd::entry::memory_type::mask,
+                   attr_bits(attr) |
+                   (static_cast<entry_type>(cache) << ::intel_x64::ept::pd::entry::memory_type::from)
+               );
+    }
+
+    /// Enable #VE
+    ///
+    /// Pages are mapped with the suppress #VE bit set, so that EPT
+    /// violations cause a VM exit even if EPT-violation #VE is enabled on
+    /// the vCPU (see ve_handler). This clears the suppress #VE bit of every
+    /// page that is mapped in a range of virtual addresses, so that EPT
+    /// violations on these pages are delivered to the guest as a
+    /// virtualization exception instead, without a VM exit. Large pages
+    /// are split only where they straddle either end of the range, as with
+    /// protect(). Note that violations on addresses that are not mapped
+    /// at all are always delivered as #VE while #VE is enabled, as a
+    /// missing entry has no suppress #VE bit set.
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range
+    /// @param size the number of bytes in the range
+    /// @return Returns the ranges that actually changed (see protect())
+    ///
+    std::vector<range_type>
+    enable_ve(virt_addr_t virt_addr, size_type size)
+    {
+        return this->update_range(
+                   virt_addr, size, ::intel_x64::ept::pd::entry::suppress_ve::mask, 0
+               );
+    }
+
+    /// Disable #VE
+    ///
+    /// Sets the suppress #VE bit of every page that is mapped in a range of
+    /// virtual addresses, so that EPT violations on these pages cause a VM
+    /// exit again (see enable_ve()).
+    ///
+    /// @expects virt_addr and size are 4k aligned
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range
+    /// @param size the number of bytes in the range
+    /// @return Returns the ranges that actually changed (see protect())
+    ///
+    std::vector<range_type>
+    disable_ve(virt_addr_t virt_addr, size_type size)
+    {
+        return this->update_range(
+                   virt_addr, size,
+                   ::intel_x64::ept::pd::entry::suppress_ve::mask,
+                   ::intel_x64::ept::pd::entry::suppress_ve::mask
+               );
+    }
+
+    /// Compact
+    ///
+    /// Collapses page tables that could be expressed as a single larger
+    /// page. A page table whose 512 entries are all present, map a
+    /// physically contiguous (and 2m aligned) region, and have identical
+    /// attributes and memory types is replaced by a 2m entry, and the page
+    /// table is freed. The same is then done for page directories whose 512
+    /// entries are all 2m pages, which are replaced by a 1g entry if
+    /// is_1g_supported() (otherwise they are left as 2m pages). This
+    /// undoes the fragmentation left behind when the 4k mappings used to
+    /// hook a page are put back, without having to know the layout of the
+    /// map. The accessed and dirty flags of the collapsed entries are
+    /// combined into the new entry.
+    ///
+    /// Only 2m and 1g regions that are entirely inside the provided range
+    /// are considered. If anything was collapsed, the map is invalidated
+    /// (see generation()).
+    ///
+    /// @expects the map is not in concurrent mode
+    /// @ensures
+    ///
+    /// @param virt_addr the first virtual address of the range to compact
+    /// @param size the number of bytes to compact
+    /// @return Returns the number of page tables that were freed
+    ///
+    size_type
+    compact(virt_addr_t virt_addr, size_type size)
+    {
+        expects(!m_concurrent);
+
+        size_type num_freed = 0;
+        auto eaddr = virt_addr + size;
+
+        for (auto virt = virt_addr; virt < eaddr;) {
+            auto next = std::min(
+                            bfn::upper(virt, ::intel_x64::ept::pml4::from) +
+                            ::intel_x64::ept::pml4::page_size, eaddr
+                        );
+
+            auto entry = m_pml4.virt_addr.at(::intel_x64::ept::pml4::index(virt));
+
+            if (entry != 0) {
+                auto pdpt = this->phys_to_pair(
+                                ::intel_x64::ept::pml4::entry::phys_addr::get(entry),
+                                ::intel_x64::ept::pdpt::num_entries
+                            );
+
+                if (!this->is_shared(pdpt)) {
+                    num_freed += this->compact_pdpt(pdpt, virt, next, virt_addr, eaddr);
+                }
+            }
+
+            virt = next;
         }
 
-        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
-        auto &pte = m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+        if (num_freed != 0) {
+            this->invalidate();
+        }
+
+        return num_freed;
+    }
+
+    /// Virtual Address to Entry
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to be converted
+    /// @return returns entry for the map
+    ///
+    entry_type &
+    entry(virt_addr_t *virt_addr)
+    {
+        if (m_concurrent) {
+            if (auto entry = this->concurrent_find(reinterpret_cast<virt_addr_t>(virt_addr))) {
+                return *entry;
+            }
+
+            throw std::runtime_error("entry: not mapped");
+        }
+
+        uintptr_t from;
 
-        if (pte == 0) {
-            throw std::runtime_error("entry: pte not mapped");
+        if (auto entry = this->find(reinterpret_cast<virt_addr_t>(virt_addr), from)) {
+            return *entry;
         }
 
-        return pte;
+        throw std::runtime_error("entry: not mapped");
     }
 
     /// Virtual Address to Entry
@@ -444,36 +1185,21 @@ public:
     phys_addr_t
     virt_to_phys(virt_addr_t *virt_addr)
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        auto pdpte = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
-
-        if (pdpte == 0) {
-            throw std::runtime_error("virt_to_phys: pdpte not mapped");
-        }
-
-        if (::intel_x64::ept::pdpt::entry::ps::is_enabled(pdpte)) {
-            return ::intel_x64::ept::pdpt::entry::phys_addr::get(pdpte);
-        }
-
-        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
-        auto pde = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
-
-        if (pde == 0) {
-            throw std::runtime_error("virt_to_phys: pde not mapped");
-        }
+        if (m_concurrent || m_shared) {
+            if (auto entry = this->concurrent_find(reinterpret_cast<virt_addr_t>(virt_addr))) {
+                return ::intel_x64::ept::pt::entry::phys_addr::get(this->load(*entry));
+            }
 
-        if (::intel_x64::ept::pd::entry::ps::is_enabled(pde)) {
-            return ::intel_x64::ept::pd::entry::phys_addr::get(pde);
+            throw std::runtime_error("virt_to_phys: not mapped");
         }
 
-        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
-        auto pte = m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+        uintptr_t from;
 
-        if (pte == 0) {
-            throw std::runtime_error("virt_to_phys: pte not mapped");
+        if (auto entry = this->find(reinterpret_cast<virt_addr_t>(virt_addr), from)) {
+            return ::intel_x64::ept::pd::entry::phys_addr::get(*entry);
         }
 
-        return ::intel_x64::ept::pt::entry::phys_addr::get(pte);
+        throw std::runtime_error("virt_to_phys: not mapped");
     }
 
     /// Virtual Address to Physical Address
@@ -498,48 +1224,121 @@ public:
     auto
     from(virt_addr_t *virt_addr)
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        auto pdpte = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+        uintptr_t from;
 
-        if (pdpte == 0) {
-            throw std::runtime_error("from: pdpte not mapped");
-        }
+        if (m_concurrent || m_shared) {
+            size_type page_size = 0;
 
-        if (::intel_x64::ept::pdpt::entry::ps::is_enabled(pdpte)) {
-            return ::intel_x64::ept::pdpt::from;
+            if (this->concurrent_find(reinterpret_cast<virt_addr_t>(virt_addr), &page_size) != nullptr) {
+                return page_size_to_from(page_size);
+            }
+        }
+        else if (this->find(reinterpret_cast<virt_addr_t>(virt_addr), from) != nullptr) {
+            return from;
         }
 
-        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
-        auto pde = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+        throw std::runtime_error("from: not mapped");
+    }
 
-        if (pde == 0) {
-            throw std::runtime_error("from: pde not mapped");
-        }
+    /// Virtual Address to From
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to test
+    /// @return returns page size of the mapping (i.e. from)
+    ///
+    auto from(virt_addr_t virt_addr)
+    { return from(reinterpret_cast<virt_addr_t *>(virt_addr)); }
 
-        if (::intel_x64::ept::pd::entry::ps::is_enabled(pde)) {
-            return ::intel_x64::ept::pd::from;
+    /// Try Virtual Address to Entry
+    ///
+    /// Same as entry(), but for lookups that are expected to miss (e.g.
+    /// probing for a mapping while handling an EPT violation), where
+    /// throwing is much more expensive than the lookup itself. Like the
+    /// lookups in concurrent mode, this never allocates and does not use
+    /// the cursor, the walk cache, or copy a table that is shared with
+    /// another map (see clone()), which is why the value of the entry is
+    /// returned rather than a reference to it. Use update_entry() to
+    /// modify it.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to look up
+    /// @return Returns the entry that maps the virtual address, or 0 if
+    ///     the virtual address is not mapped (a mapped entry is never 0)
+    ///
+    entry_type
+    try_entry(virt_addr_t virt_addr)
+    {
+        if (auto entry = this->concurrent_find(virt_addr)) {
+            return this->load(*entry);
         }
 
-        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
-        auto pte = m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+        return 0;
+    }
+
+    /// Try Virtual Address to Physical Address
+    ///
+    /// Same as virt_to_phys() and from() combined, but for lookups that
+    /// are expected to miss (see try_entry()).
+    ///
+    /// Example:
+    /// @code
+    /// if (auto translation = map.try_virt_to_phys(gpa)) {
+    ///     hpa = translation.phys_addr | (gpa & (translation.page_size - 1));
+    /// }
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address to look up
+    /// @return Returns the physical address of the page that maps the
+    ///     virtual address and the size of that page. If the virtual
+    ///     address is not mapped, both are 0, and the result converts to
+    ///     false.
+    ///
+    translation_type
+    try_virt_to_phys(virt_addr_t virt_addr)
+    {
+        size_type page_size = 0;
 
-        if (pte == 0) {
-            throw std::runtime_error("from: pte not mapped");
+        if (auto entry = this->concurrent_find(virt_addr, &page_size)) {
+            return {::intel_x64::ept::pd::entry::phys_addr::get(this->load(*entry)), page_size};
         }
 
-        return ::intel_x64::ept::pt::from;
+        return {0, 0};
     }
 
-    /// Virtual Address to From
+    /// Unmapped Size
+    ///
+    /// Returns the size of the largest aligned region around the provided
+    /// address that nothing is mapped in (512g, 1g, 2m or 4k), i.e. the
+    /// largest page that could be mapped there without unmapping or
+    /// releasing anything first. Like the lookups in concurrent mode, this
+    /// never allocates and does not use the cursor, so it can be called at
+    /// any time, including from an exit handler on a shared map.
     ///
     /// @expects
     /// @ensures
     ///
-    /// @param virt_addr the virtual address to test
-    /// @return returns page size of the mapping (i.e. from)
+    /// @param virt_addr the virtual address to look up
+    /// @return Returns 0 if the address is mapped, and the size of the
+    ///     unmapped region around it otherwise
     ///
-    auto from(virt_addr_t virt_addr)
-    { return from(reinterpret_cast<virt_addr_t *>(virt_addr)); }
+    size_type
+    unmapped_size(virt_addr_t virt_addr)
+    {
+        size_type page_size = 0;
+
+        if (this->concurrent_find(virt_addr, &page_size) != nullptr) {
+            return 0;
+        }
+
+        return page_size;
+    }
 
     /// Is 1g
     ///
@@ -613,534 +1412,2214 @@ public:
     inline auto is_4k(virt_addr_t virt_addr)
     { return is_4k(reinterpret_cast<virt_addr_t *>(virt_addr)); }
 
-private:
-
-    gsl::span<virt_addr_t>
-    allocate_span(size_type num_entries)
+    /// Clone
+    ///
+    /// Creates a new map with the same mappings as this map, that shares
+    /// all of this map's page tables (other than the PML4, which every map
+    /// needs its own copy of). A shared page table is reference counted,
+    /// and is only copied when one of the maps that share it modifies it
+    /// (copy-on-write), so maps that only differ by a few pages (e.g. the
+    /// same identity map with different hooks) only pay for the page tables
+    /// that differ. Shared page tables are only freed once the last map
+    /// that references them releases them.
+    ///
+    /// The maps that share page tables may be used on different CPUs at the
+    /// same time, but none of them can use concurrent mode. Lookups in a
+    /// map that shares page tables do not use the walk cache, and compact()
+    /// skips page tables that are shared. The accessed and dirty flags of
+    /// shared page tables are shared as well.
+    ///
+    /// @expects the map is not in concurrent mode
+    /// @ensures
+    ///
+    /// @return Returns the new map. The new map uses the same page_pool as
+    ///     this map, if any.
+    ///
+    std::unique_ptr<mmap>
+    clone()
     {
-        return
-            gsl::make_span(
-                static_cast<virt_addr_t *>(alloc_page()),
-                num_entries
-            );
-    }
+        expects(!m_concurrent);
 
-    pair
-    allocate(size_type num_entries)
-    {
-        auto span =
-            gsl::make_span(
-                static_cast<virt_addr_t *>(alloc_page()),
-                num_entries
-            );
+        if (!m_shared) {
+            m_shared = std::make_shared<shared_tables_type>();
+        }
 
-        pair ptrs = {
-            span,
-            g_mm->virtptr_to_physint(
-                span.data()
-            )
-        };
+        auto map = std::make_unique<mmap>(m_pool);
+        map->m_shared = m_shared;
+        map->set_walk_cache_size(m_walk_cache.size());
 
-        return ptrs;
-    }
+        std::lock_guard<std::mutex> lock(m_shared->mutex);
 
-    void
-    free(const gsl::span<virt_addr_t> &virt_addr)
-    { free_page(virt_addr.data()); }
+        for (index_type pml4i = 0; pml4i < ::intel_x64::ept::pml4::num_entries; pml4i++) {
+            auto entry = m_pml4.virt_addr.at(pml4i);
 
-private:
+            if (entry != 0) {
+                map->m_pml4.virt_addr.at(pml4i) = entry;
+                this->add_ref(::intel_x64::ept::pml4::entry::phys_addr::get(entry));
+            }
+        }
 
-    pair
-    phys_to_pair(phys_addr_t phys_addr, size_type num_entries)
+        map->m_occupancy = m_occupancy;
+        map->m_rmap_enabled = m_rmap_enabled;
+        map->m_rmap = m_rmap;
+        map->m_num_tables = m_num_tables;
+        map->m_num_mapped = m_num_mapped;
+        map->m_num_mapped_by_type = m_num_mapped_by_type;
+        map->m_occupancy.erase(reinterpret_cast<uintptr_t>(m_pml4.virt_addr.data()));
+        map->m_occupancy.set(
+            reinterpret_cast<uintptr_t>(map->m_pml4.virt_addr.data()), this->occupancy(m_pml4)
+        );
+
+        return map;
+    }
+
+    /// Image
+    ///
+    /// Returns a run-length encoded description of every mapping in this
+    /// map, sorted by virtual address. Each run describes a range of pages
+    /// of the same size, with the same flags (i.e. the attributes, the
+    /// memory type and any other bit of the entry other than the physical
+    /// address, the accessed and dirty flags and the page size bit), whose
+    /// virtual and physical addresses are both contiguous. An identity map
+    /// made out of large pages is usually only a few dozen runs, so the
+    /// image can be computed once and used to restore() the same map in a
+    /// fraction of the time it takes to build it (e.g. for every vCPU, or
+    /// on every reboot of the guest).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the image of this map
+    ///
+    image_type
+    image()
     {
-        auto virt_addr =
-            static_cast<virt_addr_t *>(
-                g_mm->physint_to_virtptr(phys_addr)
-            );
+        image_type image;
+        this->image_table(m_pml4, ::intel_x64::ept::pml4::from, 0, image);
 
-        return {
-            gsl::make_span<virt_addr_t>(virt_addr, num_entries),
-            phys_addr
-        };
+        return image;
     }
 
+    /// Restore
+    ///
+    /// Fills an empty map with the mappings described by an image (see
+    /// image()). The image is streamed twice: the first pass validates it
+    /// and counts the page tables it needs, which are then all allocated
+    /// up front (so that running out of memory leaves the map empty), and
+    /// the second pass fills in the entries in order, without walking the
+    /// page tables.
+    ///
+    /// @expects the map is empty and not in concurrent mode
+    /// @expects the runs are sorted by virtual address, do not overlap,
+    ///     and are aligned to (and a multiple of) a 4k, 2m or 1g page size
+    /// @ensures
+    ///
+    /// @param image the image to restore
+    ///
     void
-    map_pdpt(index_type pml4i)
+    restore(const image_type &image)
     {
-        auto &entry = m_pml4.virt_addr.at(pml4i);
-
-        if (entry != 0) {
-            auto phys_addr = ::intel_x64::ept::pml4::entry::phys_addr::get(entry);
+        expects(!m_concurrent);
+        expects(this->occupancy(m_pml4) == 0);
+
+        size_type num_tables = 0;
+        virt_addr_t next_addr = 0;
+        uintptr_t keys[3] = {~0ULL, ~0ULL, ~0ULL};
+
+        for (const auto &run : image) {
+            expects(
+                run.page_size == ::intel_x64::ept::pdpt::page_size ||
+                run.page_size == ::intel_x64::ept::pd::page_size ||
+                run.page_size == ::intel_x64::ept::pt::page_size
+            );
 
-            if (m_pdpt.phys_addr == phys_addr) {
-                return;
-            }
+            expects(run.size != 0);
+            expects(run.virt_addr >= next_addr);
+            expects(((run.virt_addr | run.phys_addr | run.size) & (run.page_size - 1)) == 0);
 
-            m_pdpt = phys_to_pair(phys_addr, ::intel_x64::ept::pdpt::num_entries);
-            return;
-        }
+            next_addr = run.virt_addr + run.size;
 
-        m_pdpt = this->allocate(::intel_x64::ept::pdpt::num_entries);
+            num_tables += this->count_tables(run, ::intel_x64::ept::pml4::from, keys[0]);
 
-        ::intel_x64::ept::pml4::entry::phys_addr::set(entry, m_pdpt.phys_addr);
-        ::intel_x64::ept::pml4::entry::read_access::enable(entry);
-        ::intel_x64::ept::pml4::entry::write_access::enable(entry);
-        ::intel_x64::ept::pml4::entry::execute_access::enable(entry);
-    }
+            if (run.page_size != ::intel_x64::ept::pdpt::page_size) {
+                num_tables += this->count_tables(run, ::intel_x64::ept::pdpt::from, keys[1]);
+            }
 
-    void
-    map_pd(index_type pdpti)
-    {
-        auto &entry = m_pdpt.virt_addr.at(pdpti);
+            if (run.page_size == ::intel_x64::ept::pt::page_size) {
+                num_tables += this->count_tables(run, ::intel_x64::ept::pd::from, keys[2]);
+            }
+        }
 
-        if (entry != 0) {
-            auto phys_addr = ::intel_x64::ept::pdpt::entry::phys_addr::get(entry);
+        std::vector<pair> tables;
+        tables.reserve(num_tables);
 
-            if (m_pd.phys_addr == phys_addr) {
-                return;
+        try {
+            for (size_type i = 0; i < num_tables; i++) {
+                tables.push_back(this->allocate(::intel_x64::ept::pt::num_entries));
+            }
+        }
+        catch (...) {
+            for (const auto &table : tables) {
+                this->free(table);
             }
 
-            m_pd = phys_to_pair(phys_addr, ::intel_x64::ept::pd::num_entries);
-            return;
+            throw;
         }
 
-        m_pd = this->allocate(::intel_x64::ept::pd::num_entries);
+        // Since the runs are sorted, a parent entry that is already
+        // present always points to the table that was filled last at that
+        // level, so the tables never need to be walked.
+        //
+        auto next = tables.begin();
+        pair pdpt{}, pd{}, pt{};
+
+        for (const auto &run : image) {
+            for (size_type offset = 0; offset < run.size; offset += run.page_size) {
+                auto virt = run.virt_addr + offset;
+
+                auto entry = &m_pml4.virt_addr.at(::intel_x64::ept::pml4::index(virt));
+                if (*entry == 0) {
+                    pdpt = this->restore_table(*entry, next);
+                    this->count_table(::intel_x64::ept::pdpt::from, 1);
+                }
+
+                entry = &pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt));
+
+                if (run.page_size != ::intel_x64::ept::pdpt::page_size) {
+                    if (*entry == 0) {
+                        pd = this->restore_table(*entry, next);
+                        this->count_table(::intel_x64::ept::pd::from, 1);
+                    }
+
+                    entry = &pd.virt_addr.at(::intel_x64::ept::pd::index(virt));
+                }
+
+                if (run.page_size == ::intel_x64::ept::pt::page_size) {
+                    if (*entry == 0) {
+                        pt = this->restore_table(*entry, next);
+                        this->count_table(::intel_x64::ept::pt::from, 1);
+                    }
+
+                    entry = &pt.virt_addr.at(::intel_x64::ept::pt::index(virt));
+                }
+
+                auto value = run.flags;
+                ::intel_x64::ept::pd::entry::phys_addr::set(value, run.phys_addr + offset);
+
+                if (run.page_size != ::intel_x64::ept::pt::page_size) {
+                    ::intel_x64::ept::pd::entry::ps::enable(value);
+                }
+
+                *entry = value;
+                this->occupy(entry, 1);
+                this->count_pages(value, page_size_to_from(run.page_size), 1);
+                this->rmap_insert(virt, value, page_size_to_from(run.page_size));
+            }
+        }
 
-        ::intel_x64::ept::pdpt::entry::phys_addr::set(entry, m_pd.phys_addr);
-        ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-        ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
-        ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
+        ensures(next == tables.end());
+        this->invalidate();
     }
 
-    void
-    map_pt(index_type pdi)
+    /// Range Iterator
+    ///
+    /// Walks the page tables of a map depth first (skipping entries that
+    /// are not present, and thus any empty subtree), and yields maximal
+    /// ranges of virtual addresses that are mapped to contiguous physical
+    /// addresses with the same flags (i.e. the same attributes and memory
+    /// type, see image()), regardless of the page sizes used to map them.
+    /// The iterator never modifies the map and never allocates, so it can
+    /// be used to dump or diff the layout of a map. In
+    /// concurrent mode, each entry is read atomically, but entries that
+    /// are modified while iterating may or may not be seen.
+    ///
+    /// Example:
+    /// @code
+    /// for (const auto &range : mmap.ranges()) {
+    ///     bfdebug_nhex(0, "virt", range.virt_addr);
+    /// }
+    /// @endcode
+    ///
+    class range_iterator
     {
-        auto &entry = m_pd.virt_addr.at(pdi);
+    public:
 
-        if (entry != 0) {
-            auto phys_addr = ::intel_x64::ept::pd::entry::phys_addr::get(entry);
+        /// @cond
 
-            if (m_pt.phys_addr == phys_addr) {
-                return;
-            }
+        using iterator_category = std::forward_iterator_tag;
+        using value_type = range_type;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const range_type *;
+        using reference = const range_type &;
 
-            m_pt = phys_to_pair(phys_addr, ::intel_x64::ept::pt::num_entries);
-            return;
-        }
+        range_iterator() noexcept = default;
 
-        m_pt = this->allocate(::intel_x64::ept::pt::num_entries);
+        explicit range_iterator(const pair &pml4)
+        {
+            m_levels[0] = {pml4.virt_addr.data(), ::intel_x64::ept::pml4::from, 0, 0};
+            m_depth = 1;
 
-        ::intel_x64::ept::pd::entry::phys_addr::set(entry, m_pt.phys_addr);
-        ::intel_x64::ept::pd::entry::read_access::enable(entry);
-        ::intel_x64::ept::pd::entry::write_access::enable(entry);
-        ::intel_x64::ept::pd::entry::execute_access::enable(entry);
-    }
+            m_pending = this->next_page(m_page);
+            this->next();
+        }
 
-    void
-    clear_pdpt(index_type pml4i)
-    {
-        this->map_pdpt(pml4i);
+        reference operator*() const noexcept
+        { return m_range; }
 
-        for (auto pdpti = 0; pdpti < ::intel_x64::ept::pdpt::num_entries; pdpti++) {
-            auto &entry = m_pdpt.virt_addr.at(pdpti);
+        pointer operator->() const noexcept
+        { return &m_range; }
 
-            if (entry == 0) {
-                continue;
-            }
+        range_iterator &operator++()
+        {
+            this->next();
+            return *this;
+        }
 
-            if (::intel_x64::ept::pdpt::entry::ps::is_disabled(entry)) {
-                this->clear_pd(pdpti);
+        range_iterator operator++(int)
+        {
+            auto iter = *this;
+            this->next();
+            return iter;
+        }
+
+        bool operator==(const range_iterator &other) const noexcept
+        {
+            if (m_done || other.m_done) {
+                return m_done == other.m_done;
             }
 
-            entry = 0;
+            return m_range.virt_addr == other.m_range.virt_addr;
         }
 
-        this->free(m_pdpt.virt_addr);
-        m_pdpt = {};
-    }
+        bool operator!=(const range_iterator &other) const noexcept
+        { return !(*this == other); }
 
-    void
-    clear_pd(index_type pdpti)
-    {
-        this->map_pd(pdpti);
+        /// @endcond
 
-        for (auto pdi = 0; pdi < ::intel_x64::ept::pd::num_entries; pdi++) {
-            auto &entry = m_pd.virt_addr.at(pdi);
+    private:
 
-            if (entry == 0) {
-                continue;
+        void
+        next()
+        {
+            if ((m_done = !m_pending)) {
+                return;
             }
 
-            if (::intel_x64::ept::pd::entry::ps::is_disabled(entry)) {
-                this->clear_pt(pdi);
-            }
+            m_range = m_page;
 
-            entry = 0;
+            while ((m_pending = this->next_page(m_page))) {
+                if (m_page.flags != m_range.flags ||
+                    m_page.virt_addr != m_range.virt_addr + m_range.size ||
+                    m_page.phys_addr != m_range.phys_addr + m_range.size) {
+                    return;
+                }
+
+                m_range.size += m_page.size;
+            }
         }
 
-        this->free(m_pd.virt_addr);
-        m_pd = {};
-    }
+        bool
+        next_page(range_type &page)
+        {
+            using namespace ::intel_x64::ept::pd::entry;
 
-    void
-    clear_pt(index_type pdi)
-    {
-        this->map_pt(pdi);
+            while (m_depth != 0) {
+                auto &level = m_levels.at(m_depth - 1);
 
-        this->free(m_pt.virt_addr);
-        m_pt = {};
-    }
+                if (level.index == ::intel_x64::ept::pt::num_entries) {
+                    m_depth--;
+                    continue;
+                }
 
+                auto index = level.index++;
+                auto entry = mmap::load(level.table[index]);
+
+                if (entry == 0) {
+                    continue;
+                }
+
+                auto virt = level.base + (static_cast<virt_addr_t>(index) << level.from);
+                auto phys = phys_addr::get(entry);
+
+                if (level.from == ::intel_x64::ept::pml4::from ||
+                    (level.from != ::intel_x64::ept::pt::from && ps::is_disabled(entry))) {
+                    auto child_from = level.from - (::intel_x64::ept::pd::from - ::intel_x64::ept::pt::from);
+                    auto child = static_cast<entry_type *>(g_mm->physint_to_virtptr(phys));
+
+                    m_levels.at(m_depth++) = {child, child_from, 0, virt};
+                    continue;
+                }
+
+                page = {
+                    virt, phys, 1ULL << level.from,
+                    entry & ~(phys_addr::mask | accessed_flag::mask | dirty::mask | ps::mask)
+                };
+
+                return true;
+            }
+
+            return false;
+        }
+
+    private:
+
+        struct level_type {
+            const entry_type *table;
+            uintptr_t from;
+            index_type index;
+            virt_addr_t base;
+        };
+
+        std::array<level_type, 4> m_levels{};
+        size_type m_depth{0};
+
+        range_type m_range{};
+        range_type m_page{};
+        bool m_pending{false};
+        bool m_done{true};
+    };
+
+    /// @cond
+
+    struct ranges_type {
+        range_iterator first;
+
+        range_iterator begin() const noexcept
+        { return first; }
+
+        range_iterator end() const noexcept
+        { return {}; }
+    };
+
+    /// @endcond
+
+    /// Ranges
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns an object that can be used in a range-based for
+    ///     loop to iterate over the mapped ranges of this map (see
+    ///     range_iterator)
+    ///
+    ranges_type
+    ranges() const
+    { return {range_iterator{m_pml4}}; }
+
+    /// Has Holes
+    ///
+    /// A missing entry has no suppress #VE bit, so while EPT-violation #VE
+    /// is enabled, the guest gets a #VE instead of a VM exit when it
+    /// touches an address that is not mapped (see enable_ve()). This tells
+    /// whether that can happen below the end of the map.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns false if every virtual address from 0 up to the end
+    ///     of the last mapped range is mapped, true otherwise (including
+    ///     when nothing is mapped)
+    ///
+    bool
+    has_holes() const
+    {
+        virt_addr_t next = 0;
+
+        for (const auto &range : this->ranges()) {
+            if (range.virt_addr != next) {
+                return true;
+            }
+
+            next = range.virt_addr + range.size;
+        }
+
+        return next == 0;
+    }
+
+    /// Enable Reverse Map
+    ///
+    /// Builds an index from physical addresses to the virtual addresses
+    /// that map them, and keeps it up to date as pages are mapped,
+    /// unmapped, released, split and compacted, so that phys_to_virt() and
+    /// revoke() do not have to scan the page tables. Each mapped page
+    /// (of any size) costs one entry in the index.
+    ///
+    /// @expects the map is not in concurrent mode
+    /// @ensures
+    ///
+    void
+    enable_rmap()
+    {
+        expects(!m_concurrent);
+
+        if (m_rmap_enabled) {
+            return;
+        }
+
+        m_rmap_enabled = true;
+
+        for (const auto &run : this->image()) {
+            auto from = page_size_to_from(run.page_size);
+
+            for (size_type offset = 0; offset < run.size; offset += run.page_size) {
+                auto entry = run.flags;
+                ::intel_x64::ept::pd::entry::phys_addr::set(entry, run.phys_addr + offset);
+
+                this->rmap_insert(run.virt_addr + offset, entry, from);
+            }
+        }
+    }
+
+    /// Disable Reverse Map
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void
+    disable_rmap() noexcept
+    {
+        m_rmap_enabled = false;
+        m_rmap.clear();
+    }
+
+    /// Is Reverse Map Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns true if the reverse map is enabled
+    ///
+    bool
+    is_rmap_enabled() const noexcept
+    { return m_rmap_enabled; }
+
+    /// Physical Address to Virtual Addresses
+    ///
+    /// @expects the reverse map is enabled (see enable_rmap())
+    /// @ensures
+    ///
+    /// @param phys_addr the physical address to look up
+    /// @return Returns every virtual address that currently maps the
+    ///     provided physical address, in no particular order
+    ///
+    std::vector<virt_addr_t>
+    phys_to_virt(phys_addr_t phys_addr) const
+    {
+        expects(m_rmap_enabled);
+
+        std::vector<virt_addr_t> virt_addrs;
+
+        for (auto from : {pt_level::from, pd_level::from, pdpt_level::from}) {
+            auto range = m_rmap.equal_range(rmap_key(phys_addr, from));
+
+            for (auto iter = range.first; iter != range.second; ++iter) {
+                virt_addrs.push_back(iter->second + bfn::lower(phys_addr, from));
+            }
+        }
+
+        return virt_addrs;
+    }
+
+    /// Revoke
+    ///
+    /// Unmaps every page that maps the provided physical address (e.g.
+    /// when the host reclaims the page). Note that if the physical address
+    /// is mapped by a large page, the entire large page is unmapped. As
+    /// with unmap(), the page tables are not released.
+    ///
+    /// @expects the reverse map is enabled (see enable_rmap())
+    /// @ensures
+    ///
+    /// @param phys_addr the physical address to revoke
+    /// @return Returns the number of pages that were unmapped
+    ///
+    size_type
+    revoke(phys_addr_t phys_addr)
+    {
+        auto virt_addrs = this->phys_to_virt(phys_addr);
+
+        for (auto virt_addr : virt_addrs) {
+            this->unmap(virt_addr);
+        }
+
+        return virt_addrs.size();
+    }
+
+    /// Verify Occupancy
+    ///
+    /// To avoid scanning a page table every time an entry is released in
+    /// order to find out if the table is empty and can be freed, the map
+    /// keeps track of the number of entries used in each page table. These
+    /// counts are kept outside of the page tables, as the format of the
+    /// page tables is defined by the hardware. Note that as a result,
+    /// entries must be cleared using unmap() or update_entry(), and not
+    /// by writing 0 to an entry returned by entry().
+    ///
+    /// This function recounts the entries of every page table, and
+    /// compares the result with the tracked counts. It is meant for
+    /// testing and debugging, and is as expensive as walking the entire
+    /// map.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns true if the tracked counts are correct, false
+    ///     otherwise
+    ///
+    bool
+    verify_occupancy()
+    {
+        if (m_concurrent) {
+            return m_occupancy.empty();
+        }
+
+        occupancy_type occupancy;
+        this->count_occupancy(m_pml4, ::intel_x64::ept::pml4::from, occupancy);
+
+        return occupancy == m_occupancy;
+    }
+
+    /// Split 1g
+    ///
+    /// Replaces a 1g page with 512 2m pages that map the same physical
+    /// memory, with the same attributes and memory type. The new page
+    /// directory is fully populated before it is installed with a single
+    /// write to the 1g entry, so the range is never unmapped, and other
+    /// CPUs walking the map always see either the 1g page or the 2m pages.
+    ///
+    /// @expects the virtual address is mapped with a 1g page
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the 1g page to split
+    ///
+    void
+    split_1g(virt_addr_t virt_addr)
+    {
+        expects(this->is_1g(virt_addr));
+        this->split(this->entry(virt_addr), virt_addr, ::intel_x64::ept::pd::from);
+    }
+
+    /// Split 2m
+    ///
+    /// Replaces a 2m page with 512 4k pages that map the same physical
+    /// memory, with the same attributes and memory type. The new page
+    /// table is fully populated before it is installed with a single write
+    /// to the 2m entry, so the range is never unmapped, and other CPUs
+    /// walking the map always see either the 2m page or the 4k pages.
+    ///
+    /// This makes remapping a single 4k page inside of a 2m page cheap:
+    /// split the 2m page, then modify the 4k entry (see update_entry()).
+    ///
+    /// @expects the virtual address is mapped with a 2m page
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the 2m page to split
+    ///
+    void
+    split_2m(virt_addr_t virt_addr)
+    {
+        expects(this->is_2m(virt_addr));
+        this->split(this->entry(virt_addr), virt_addr, ::intel_x64::ept::pt::from);
+    }
+
+private:
+
+    // Occupancy
+    //
+    // The number of entries used in each page table, keyed by the virtual
+    // address of the table. This is updated every time an entry is set or
+    // cleared, so it is an open addressing hash table (with linear probing
+    // and backward shift deletion) kept in a single array instead of a
+    // node based map: changing a count never allocates, and the array only
+    // grows when it would become more than half full, which allocate()
+    // takes care of ahead of time when a table is allocated. Tables are
+    // page aligned and never at 0, so 0 marks an empty slot.
+    //
+    class occupancy_type
+    {
+    public:
+
+        occupancy_type() = default;
+
+        occupancy_type(occupancy_type &&other) noexcept :
+            m_slots{std::move(other.m_slots)},
+            m_bits{std::exchange(other.m_bits, 0)},
+            m_size{std::exchange(other.m_size, 0)}
+        { }
+
+        occupancy_type &operator=(occupancy_type &&other) noexcept
+        {
+            m_slots = std::move(other.m_slots);
+            m_bits = std::exchange(other.m_bits, 0);
+            m_size = std::exchange(other.m_size, 0);
+
+            return *this;
+        }
+
+        occupancy_type(const occupancy_type &) = default;
+        occupancy_type &operator=(const occupancy_type &) = default;
+
+        ~occupancy_type() = default;
+
+        size_type
+        size() const noexcept
+        { return m_size; }
+
+        bool
+        empty() const noexcept
+        { return m_size == 0; }
+
+        size_type
+        get(uintptr_t key) const noexcept
+        {
+            auto i = this->find(key);
+            return i != npos ? m_slots[i].count : 0;
+        }
+
+        void
+        set(uintptr_t key, size_type count)
+        {
+            if (count == 0) {
+                this->erase(key);
+                return;
+            }
+
+            auto i = this->find(key);
+
+            if (i == npos) {
+                this->reserve(m_size + 1);
+                i = this->insert(key);
+            }
+
+            m_slots[i].count = count;
+        }
+
+        void
+        add(uintptr_t key, index_type num)
+        {
+            auto count = static_cast<index_type>(this->get(key)) + num;
+            this->set(key, static_cast<size_type>(count));
+        }
+
+        void
+        erase(uintptr_t key) noexcept
+        {
+            auto i = this->find(key);
+
+            if (i == npos) {
+                return;
+            }
+
+            // Moves back every entry of the probe sequence after the
+            // erased one that would otherwise no longer be found, which
+            // keeps lookups from having to skip over deleted slots
+            //
+            auto mask = m_slots.size() - 1;
+
+            for (auto j = (i + 1) & mask; m_slots[j].key != 0; j = (j + 1) & mask) {
+                auto home = this->home(m_slots[j].key);
+
+                auto in_place = i <= j ?
+                                (home > i && home <= j) :
+                                (home > i || home <= j);
+
+                if (!in_place) {
+                    m_slots[i] = m_slots[j];
+                    i = j;
+                }
+            }
+
+            m_slots[i] = {};
+            m_size--;
+        }
+
+        void
+        clear() noexcept
+        {
+            std::fill(m_slots.begin(), m_slots.end(), slot_type{});
+            m_size = 0;
+        }
+
+        void
+        reserve(size_type num)
+        {
+            if (num * 2 <= m_slots.size()) {
+                return;
+            }
+
+            auto slots = std::max(m_slots.size(), min_slots);
+            while (num * 2 > slots) {
+                slots *= 2;
+            }
+
+            auto old = std::exchange(m_slots, std::vector<slot_type>(slots));
+
+            m_size = 0;
+            m_bits = 0;
+            while ((1ULL << m_bits) < slots) {
+                m_bits++;
+            }
+
+            for (const auto &slot : old) {
+                if (slot.key != 0) {
+                    m_slots[this->insert(slot.key)].count = slot.count;
+                }
+            }
+        }
+
+        bool
+        operator==(const occupancy_type &other) const noexcept
+        {
+            if (m_size != other.m_size) {
+                return false;
+            }
+
+            for (const auto &slot : m_slots) {
+                if (slot.key != 0 && other.get(slot.key) != slot.count) {
+                    return false;
+                }
+            }
+
+            return true;
+        }
+
+    private:
+
+        struct slot_type {
+            uintptr_t key;
+            size_type count;
+        };
+
+        constexpr static const size_type npos = ~0ULL;
+        constexpr static const size_type min_slots = 64;
+
+        size_type
+        home(uintptr_t key) const noexcept
+        {
+            return static_cast<size_type>(
+                       ((key >> ::intel_x64::ept::pt::from) * 0x9E3779B97F4A7C15ULL) >> (64 - m_bits)
+                   );
+        }
+
+        size_type
+        find(uintptr_t key) const noexcept
+        {
+            if (m_size == 0) {
+                return npos;
+            }
+
+            auto mask = m_slots.size() - 1;
+
+            for (auto i = this->home(key); m_slots[i].key != 0; i = (i + 1) & mask) {
+                if (m_slots[i].key == key) {
+                    return i;
+                }
+            }
+
+            return npos;
+        }
+
+        size_type
+        insert(uintptr_t key) noexcept
+        {
+            auto mask = m_slots.size() - 1;
+            auto i = this->home(key);
+
+            while (m_slots[i].key != 0) {
+                i = (i + 1) & mask;
+            }
+
+            m_slots[i] = {key, 0};
+            m_size++;
+
+            return i;
+        }
+
+    private:
+
+        std::vector<slot_type> m_slots;
+        size_type m_bits{0};
+        size_type m_size{0};
+    };
+
+private:
+
+    gsl::span<virt_addr_t>
+    allocate_span(size_type num_entries)
+    {
+        return
+            gsl::make_span(
+                static_cast<virt_addr_t *>(alloc_page()),
+                num_entries
+            );
+    }
+
+    pair
+    allocate(size_type num_entries)
+    {
+        if (!m_concurrent) {
+            m_occupancy.reserve(m_occupancy.size() + 1);
+        }
+
+        if (m_pool != nullptr) {
+            auto page = m_pool->allocate();
+            return {gsl::make_span(page.virt_addr, num_entries), page.phys_addr};
+        }
+
+        auto span =
+            gsl::make_span(
+                static_cast<virt_addr_t *>(alloc_page()),
+                num_entries
+            );
+
+        pair ptrs = {
+            span,
+            g_mm->virtptr_to_physint(
+                span.data()
+            )
+        };
+
+        return ptrs;
+    }
+
+    void
+    free(const pair &ptrs)
+    {
+        if (!m_concurrent) {
+            m_occupancy.erase(reinterpret_cast<uintptr_t>(ptrs.virt_addr.data()));
+        }
+
+        if (this->drop_ref(ptrs)) {
+            return;
+        }
+
+        if (m_pool != nullptr) {
+            m_pool->free(ptrs.virt_addr.data(), ptrs.phys_addr);
+            return;
+        }
+
+        free_page(ptrs.virt_addr.data());
+    }
+
+private:
+
+    pair
+    phys_to_pair(phys_addr_t phys_addr, size_type num_entries)
+    {
+        auto virt_addr =
+            static_cast<virt_addr_t *>(
+                g_mm->physint_to_virtptr(phys_addr)
+            );
+
+        return {
+            gsl::make_span<virt_addr_t>(virt_addr, num_entries),
+            phys_addr
+        };
+    }
+
+    // Page table entries are plain integers that the CPU (and other CPUs
+    // walking the map in concurrent mode) access in place, so they are
+    // accessed using the compiler's atomic builtins rather than by
+    // pretending that they are std::atomic objects.
+    //
+    static entry_type
+    load(const entry_type &entry) noexcept
+    { return __atomic_load_n(&entry, __ATOMIC_ACQUIRE); }
+
+    static entry_type
+    exchange(entry_type &entry, entry_type desired) noexcept
+    { return __atomic_exchange_n(&entry, desired, __ATOMIC_ACQ_REL); }
+
+    static entry_type
+    fetch_and(entry_type &entry, entry_type mask) noexcept
+    { return __atomic_fetch_and(&entry, mask, __ATOMIC_ACQ_REL); }
+
+    static bool
+    compare_exchange(entry_type &entry, entry_type &expected, entry_type desired) noexcept
+    {
+        return __atomic_compare_exchange_n(
+                   &entry, &expected, desired, false, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE
+               );
+    }
+
+    bool
+    install(entry_type &entry, entry_type value)
+    {
+        if (m_concurrent) {
+            entry_type expected = 0;
+            return compare_exchange(entry, expected, value);
+        }
+
+        if (entry != 0) {
+            return false;
+        }
+
+        entry = value;
+        this->occupy(&entry, 1);
+
+        return true;
+    }
+
+    // Walks to the entry that maps the provided address using the cursor
+    // (so that, unlike concurrent_find(), a shared table is copied before
+    // it is returned, see clone()). If the address is not mapped, nullptr
+    // is returned. In both cases, from is set to the level the walk
+    // stopped at.
+    //
+    entry_type *
+    find(virt_addr_t virt_addr, uintptr_t &from)
+    {
+        using namespace ::intel_x64::ept::pd::entry;
+
+        from = pdpt_level::from;
+        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
+        auto entry = &m_pdpt.virt_addr.at(pdpt_level::index(virt_addr));
+
+        if (*entry == 0 || ps::is_enabled(*entry)) {
+            return *entry != 0 ? entry : nullptr;
+        }
+
+        from = pd_level::from;
+        this->map_pd(pdpt_level::index(virt_addr));
+        entry = &m_pd.virt_addr.at(pd_level::index(virt_addr));
+
+        if (*entry == 0 || ps::is_enabled(*entry)) {
+            return *entry != 0 ? entry : nullptr;
+        }
+
+        from = pt_level::from;
+        this->map_pt(pd_level::index(virt_addr));
+        entry = &m_pt.virt_addr.at(pt_level::index(virt_addr));
+
+        return *entry != 0 ? entry : nullptr;
+    }
+
+    entry_type &
+    walk_to(virt_addr_t virt_addr, uintptr_t page_from)
+    {
+        if (m_concurrent) {
+            return this->concurrent_walk(virt_addr, page_from);
+        }
+
+        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
+
+        if (page_from == ::intel_x64::ept::pdpt::from) {
+            return m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+        }
+
+        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
+
+        if (page_from == ::intel_x64::ept::pd::from) {
+            return m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+        }
+
+        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
+        return m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+    }
+
+    entry_type &
+    concurrent_walk(virt_addr_t virt_addr, uintptr_t page_from)
+    {
+        auto pdpt = this->concurrent_table(
+                        m_pml4.virt_addr.at(::intel_x64::ept::pml4::index(virt_addr)),
+                        ::intel_x64::ept::pdpt::from
+                    );
+
+        auto &pdpte = pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+        if (page_from == ::intel_x64::ept::pdpt::from) {
+            return pdpte;
+        }
+
+        auto pd = this->concurrent_table(pdpte, ::intel_x64::ept::pd::from);
+
+        auto &pde = pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+        if (page_from == ::intel_x64::ept::pd::from) {
+            return pde;
+        }
+
+        auto pt = this->concurrent_table(pde, ::intel_x64::ept::pt::from);
+        return pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+    }
+
+    // Note that entries that point to a page table have the same layout at
+    // every level (and the PS bit is reserved in a PML4 entry), so the PD
+    // definitions are used for all of them. Since every table has the same
+    // number of entries, from is only needed to account for the table.
+    //
+    pair
+    concurrent_table(entry_type &entry, uintptr_t from)
+    {
+        constexpr const auto num_entries = ::intel_x64::ept::pt::num_entries;
+        auto value = this->load(entry);
+
+        if (value == 0) {
+            auto table = this->allocate(num_entries);
+
+            entry_type desired = 0;
+            ::intel_x64::ept::pd::entry::phys_addr::set(desired, table.phys_addr);
+            ::intel_x64::ept::pd::entry::read_access::enable(desired);
+            ::intel_x64::ept::pd::entry::write_access::enable(desired);
+            ::intel_x64::ept::pd::entry::execute_access::enable(desired);
+
+            if (this->compare_exchange(entry, value, desired)) {
+                this->count_table(from, 1);
+                return table;
+            }
+
+            this->free(table);
+        }
+
+        if (::intel_x64::ept::pd::entry::ps::is_enabled(value)) {
+            throw std::runtime_error(
+                "concurrent_table: map failed, virt / phys map already exists"
+            );
+        }
+
+        return phys_to_pair(::intel_x64::ept::pd::entry::phys_addr::get(value), num_entries);
+    }
+
+    // Returns the entry that maps the provided address, and the size of
+    // the page it maps. If the address is not mapped, nullptr is returned,
+    // and the size is that of the (aligned) region around the address that
+    // is not mapped either.
+    //
+    entry_type *
+    concurrent_find(virt_addr_t virt_addr, size_type *page_size = nullptr)
+    {
+        size_type unused;
+        if (page_size == nullptr) {
+            page_size = &unused;
+        }
+
+        *page_size = 1ULL << ::intel_x64::ept::pml4::from;
+        auto pml4e = this->load(m_pml4.virt_addr.at(::intel_x64::ept::pml4::index(virt_addr)));
+
+        if (pml4e == 0) {
+            return nullptr;
+        }
+
+        auto pdpt = phys_to_pair(
+                        ::intel_x64::ept::pml4::entry::phys_addr::get(pml4e),
+                        ::intel_x64::ept::pdpt::num_entries
+                    );
+
+        *page_size = ::intel_x64::ept::pdpt::page_size;
+        auto &pdpte = pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+        auto pdpte_value = this->load(pdpte);
+
+        if (pdpte_value == 0) {
+            return nullptr;
+        }
+
+        if (::intel_x64::ept::pdpt::entry::ps::is_enabled(pdpte_value)) {
+            return &pdpte;
+        }
+
+        auto pd = phys_to_pair(
+                      ::intel_x64::ept::pdpt::entry::phys_addr::get(pdpte_value),
+                      ::intel_x64::ept::pd::num_entries
+                  );
+
+        *page_size = ::intel_x64::ept::pd::page_size;
+        auto &pde = pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+        auto pde_value = this->load(pde);
+
+        if (pde_value == 0) {
+            return nullptr;
+        }
+
+        if (::intel_x64::ept::pd::entry::ps::is_enabled(pde_value)) {
+            return &pde;
+        }
+
+        auto pt = phys_to_pair(
+                      ::intel_x64::ept::pd::entry::phys_addr::get(pde_value),
+                      ::intel_x64::ept::pt::num_entries
+                  );
+
+        *page_size = ::intel_x64::ept::pt::page_size;
+        auto &pte = pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+
+        if (this->load(pte) == 0) {
+            return nullptr;
+        }
+
+        return &pte;
+    }
+
+    pair
+    walk(
+        const pair &cursor, const pair &parent, index_type index,
+        phys_addr_t phys_addr, size_type num_entries)
+    {
+        if (cursor.phys_addr == phys_addr) {
+            return cursor;
+        }
+
+        auto key = walk_cache_key(parent, index);
+
+        for (const auto &cached : m_walk_cache) {
+            if (cached.key == key && cached.table.phys_addr == phys_addr) {
+                m_walk_cache_hits++;
+                return cached.table;
+            }
+        }
+
+        m_walk_cache_misses++;
+
+        auto table = phys_to_pair(phys_addr, num_entries);
+        this->walk_cache_insert(parent, index, table);
+
+        return table;
+    }
+
+    void
+    walk_cache_insert(const pair &parent, index_type index, const pair &table)
+    {
+        if (m_walk_cache.empty()) {
+            return;
+        }
+
+        auto key = walk_cache_key(parent, index);
+
+        for (auto &cached : m_walk_cache) {
+            if (cached.key == key) {
+                cached.table = table;
+                return;
+            }
+        }
+
+        m_walk_cache.at(m_walk_cache_next) = {key, table};
+        m_walk_cache_next = (m_walk_cache_next + 1) % m_walk_cache.size();
+    }
+
+    static phys_addr_t
+    walk_cache_key(const pair &parent, index_type index) noexcept
+    {
+        // The parent table is page aligned, and the index is always less
+        // than 512, so the index fits in the unused lower bits.
+        //
+        return parent.phys_addr | static_cast<phys_addr_t>(index);
+    }
+
+    void
+    map_pdpt(index_type pml4i, bool copy_on_write = true)
+    {
+        auto &entry = m_pml4.virt_addr.at(pml4i);
+
+        if (entry != 0) {
+            m_pdpt = this->walk(
+                m_pdpt, m_pml4, pml4i,
+                ::intel_x64::ept::pml4::entry::phys_addr::get(entry),
+                ::intel_x64::ept::pdpt::num_entries
+            );
+
+            if (copy_on_write && m_shared) {
+                m_pdpt = this->copy_if_shared(entry, m_pdpt, ::intel_x64::ept::pdpt::from);
+                this->walk_cache_insert(m_pml4, pml4i, m_pdpt);
+            }
+
+            return;
+        }
+
+        m_pdpt = this->allocate(::intel_x64::ept::pdpt::num_entries);
+        this->count_table(::intel_x64::ept::pdpt::from, 1);
+        this->walk_cache_insert(m_pml4, pml4i, m_pdpt);
+        this->occupy(&entry, 1);
+
+        ::intel_x64::ept::pml4::entry::phys_addr::set(entry, m_pdpt.phys_addr);
+        ::intel_x64::ept::pml4::entry::read_access::enable(entry);
+        ::intel_x64::ept::pml4::entry::write_access::enable(entry);
+        ::intel_x64::ept::pml4::entry::execute_access::enable(entry);
+    }
+
+    void
+    map_pd(index_type pdpti, bool copy_on_write = true)
+    {
+        auto &entry = m_pdpt.virt_addr.at(pdpti);
+
+        if (entry != 0) {
+            m_pd = this->walk(
+                m_pd, m_pdpt, pdpti,
+                ::intel_x64::ept::pdpt::entry::phys_addr::get(entry),
+                ::intel_x64::ept::pd::num_entries
+            );
+
+            if (copy_on_write && m_shared) {
+                m_pd = this->copy_if_shared(entry, m_pd, ::intel_x64::ept::pd::from);
+                this->walk_cache_insert(m_pdpt, pdpti, m_pd);
+            }
+
+            return;
+        }
+
+        m_pd = this->allocate(::intel_x64::ept::pd::num_entries);
+        this->count_table(::intel_x64::ept::pd::from, 1);
+        this->walk_cache_insert(m_pdpt, pdpti, m_pd);
+        this->occupy(&entry, 1);
+
+        ::intel_x64::ept::pdpt::entry::phys_addr::set(entry, m_pd.phys_addr);
+        ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
+        ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
+        ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
+    }
+
+    void
+    map_pt(index_type pdi, bool copy_on_write = true)
+    {
+        auto &entry = m_pd.virt_addr.at(pdi);
+
+        if (entry != 0) {
+            m_pt = this->walk(
+                m_pt, m_pd, pdi,
+                ::intel_x64::ept::pd::entry::phys_addr::get(entry),
+                ::intel_x64::ept::pt::num_entries
+            );
+
+            if (copy_on_write && m_shared) {
+                m_pt = this->copy_if_shared(entry, m_pt, ::intel_x64::ept::pt::from);
+                this->walk_cache_insert(m_pd, pdi, m_pt);
+            }
+
+            return;
+        }
+
+        m_pt = this->allocate(::intel_x64::ept::pt::num_entries);
+        this->count_table(::intel_x64::ept::pt::from, 1);
+        this->walk_cache_insert(m_pd, pdi, m_pt);
+        this->occupy(&entry, 1);
+
+        ::intel_x64::ept::pd::entry::phys_addr::set(entry, m_pt.phys_addr);
+        ::intel_x64::ept::pd::entry::read_access::enable(entry);
+        ::intel_x64::ept::pd::entry::write_access::enable(entry);
+        ::intel_x64::ept::pd::entry::execute_access::enable(entry);
+    }
+
+    void
+    clear_pdpt(index_type pml4i)
+    {
+        this->map_pdpt(pml4i, false);
+
+        if (this->drop_ref(m_pdpt)) {
+            m_pdpt = {};
+            return;
+        }
+
+        for (auto pdpti = 0; pdpti < ::intel_x64::ept::pdpt::num_entries; pdpti++) {
+            auto &entry = m_pdpt.virt_addr.at(pdpti);
+
+            if (entry == 0) {
+                continue;
+            }
+
+            if (::intel_x64::ept::pdpt::entry::ps::is_disabled(entry)) {
+                this->clear_pd(pdpti);
+            }
+
+            entry = 0;
+        }
+
+        this->free(m_pdpt);
+        m_pdpt = {};
+    }
+
+    void
+    clear_pd(index_type pdpti)
+    {
+        this->map_pd(pdpti, false);
+
+        if (this->drop_ref(m_pd)) {
+            m_pd = {};
+            return;
+        }
+
+        for (auto pdi = 0; pdi < ::intel_x64::ept::pd::num_entries; pdi++) {
+            auto &entry = m_pd.virt_addr.at(pdi);
+
+            if (entry == 0) {
+                continue;
+            }
+
+            if (::intel_x64::ept::pd::entry::ps::is_disabled(entry)) {
+                this->clear_pt(pdi);
+            }
+
+            entry = 0;
+        }
+
+        this->free(m_pd);
+        m_pd = {};
+    }
+
+    void
+    clear_pt(index_type pdi)
+    {
+        this->map_pt(pdi, false);
+
+        this->free(m_pt);
+        m_pt = {};
+    }
+
+    // Replaces the bits in mask with bits in every page that is mapped in
+    // a range, splitting the large pages that straddle either end of it.
+    // The entries are updated with a compare and exchange so that accessed
+    // and dirty flags set by the CPU in the meantime are not lost.
+    //
+    std::vector<range_type>
+    update_range(virt_addr_t virt_addr, size_type size, entry_type mask, entry_type bits)
+    {
+        using namespace ::intel_x64::ept::pd::entry;
+
+        expects(bfn::lower(virt_addr, ::intel_x64::ept::pt::from) == 0);
+        expects(bfn::lower(size, ::intel_x64::ept::pt::from) == 0);
+
+        std::vector<range_type> changed;
+
+        auto eaddr = virt_addr + size;
+
+        for (auto virt = virt_addr; virt < eaddr;) {
+            size_type page_size = 0;
+            auto found = this->concurrent_find(virt, &page_size);
+            auto base = virt & ~(page_size - 1);
+
+            if (found == nullptr) {
+                virt = base + page_size;
+                continue;
+            }
+
+            auto from = page_size_to_from(page_size);
+            auto &entry = this->walk_to(base, from);
+
+            if (base < virt_addr || base + page_size > eaddr) {
+                this->split(entry, base, from - (::intel_x64::ept::pd::from - ::intel_x64::ept::pt::from));
+                continue;
+            }
+
+            auto value = this->load(entry);
+            while (!this->compare_exchange(entry, value, (value & ~mask) | bits)) { }
+
+            if ((mask & ::intel_x64::ept::pd::entry::memory_type::mask) != 0) {
+                this->count_pages(value, from, -1);
+                this->count_pages((value & ~mask) | bits, from, 1);
+            }
+
+            virt = base + page_size;
+
+            if ((value & mask) == bits) {
+                continue;
+            }
+
+            auto phys = phys_addr::get(value);
+            auto flags = ((value & ~mask) | bits) &
+                         ~(phys_addr::mask | accessed_flag::mask | dirty::mask | ps::mask);
+
+            if (!changed.empty()) {
+                auto &range = changed.back();
+
+                if (range.flags == flags &&
+                    range.virt_addr + range.size == base &&
+                    range.phys_addr + range.size == phys) {
+                    range.size += page_size;
+                    continue;
+                }
+            }
+
+            changed.push_back({base, phys, page_size, flags});
+        }
+
+        if (!changed.empty()) {
+            this->invalidate();
+        }
+
+        return changed;
+    }
+
+    // Level Traits
+    //
+    // Compile time descriptions of the levels that can map a page, used to
+    // write the code that fills in entries once for all three of them. Note
+    // that the bits of an entry that maps a page are located at the same
+    // position at every level (the page size bit is ignored in a page
+    // table, and is left cleared there), so the PD definitions are used for
+    // all of them.
+    //
+    struct pdpt_level {
+        constexpr static const uintptr_t from = ::intel_x64::ept::pdpt::from;
+        constexpr static const size_type page_size = 1ULL << from;
+        constexpr static const index_type num_entries = ::intel_x64::ept::pdpt::num_entries;
+        constexpr static const entry_type ps_mask = ::intel_x64::ept::pdpt::entry::ps::mask;
+
+        static index_type index(virt_addr_t virt_addr) noexcept
+        { return ::intel_x64::ept::pdpt::index(virt_addr); }
+
+        constexpr static const char *name() noexcept
+        { return "map_pdpte"; }
+    };
+
+    struct pd_level {
+        constexpr static const uintptr_t from = ::intel_x64::ept::pd::from;
+        constexpr static const size_type page_size = 1ULL << from;
+        constexpr static const index_type num_entries = ::intel_x64::ept::pd::num_entries;
+        constexpr static const entry_type ps_mask = ::intel_x64::ept::pd::entry::ps::mask;
+
+        static index_type index(virt_addr_t virt_addr) noexcept
+        { return ::intel_x64::ept::pd::index(virt_addr); }
+
+        constexpr static const char *name() noexcept
+        { return "map_pde"; }
+    };
+
+    struct pt_level {
+        constexpr static const uintptr_t from = ::intel_x64::ept::pt::from;
+        constexpr static const size_type page_size = 1ULL << from;
+        constexpr static const index_type num_entries = ::intel_x64::ept::pt::num_entries;
+        constexpr static const entry_type ps_mask = 0;
+
+        static index_type index(virt_addr_t virt_addr) noexcept
+        { return ::intel_x64::ept::pt::index(virt_addr); }
+
+        constexpr static const char *name() noexcept
+        { return "map_pte"; }
+    };
+
+    // The access bits for each attr_type, in the order the enum is
+    // declared. The memory_type enum uses the values the hardware expects,
+    // so it does not need a table.
+    //
+    constexpr static entry_type
+    attr_bits(attr_type attr) noexcept
+    {
+        using namespace ::intel_x64::ept::pd::entry;
+
+        constexpr const entry_type table[] = {
+            0,
+            read_access::mask,
+            write_access::mask,
+            execute_access::mask,
+            read_access::mask | write_access::mask,
+            read_access::mask | execute_access::mask,
+            read_access::mask | write_access::mask | execute_access::mask
+        };
+
+        return table[static_cast<size_type>(attr)];
+    }
+
+    constexpr static entry_type
+    leaf_bits(attr_type attr, memory_type cache) noexcept
+    {
+        return attr_bits(attr) |
+               (static_cast<entry_type>(cache) << ::intel_x64::ept::pd::entry::memory_type::from) |
+               ::intel_x64::ept::pd::entry::suppress_ve::mask;
+    }
+
+    constexpr static uintptr_t
+    page_size_to_from(size_type page_size) noexcept
+    {
+        return page_size == pdpt_level::page_size ? pdpt_level::from :
+               page_size == pd_level::page_size ? pd_level::from : pt_level::from;
+    }
+
+    template<typename level>
     entry_type &
-    map_pdpte(
-        virt_addr_t *virt_addr, phys_addr_t phys_addr,
+    set_entry(entry_type &entry, virt_addr_t virt_addr, phys_addr_t phys_addr, entry_type bits)
+    {
+        auto value = bits | level::ps_mask;
+        ::intel_x64::ept::pd::entry::phys_addr::set(value, phys_addr);
+
+        if (!this->install(entry, value)) {
+            throw std::runtime_error(
+                std::string(level::name()) + ": map failed, virt / phys map already exists: " +
+                bfn::to_string(phys_addr, 16)
+            );
+        }
+
+        this->count_pages(value, level::from, 1);
+        this->rmap_insert(virt_addr, value, level::from);
+
+        return entry;
+    }
+
+    template<typename level>
+    size_type
+    map_run(
+        virt_addr_t virt_addr, phys_addr_t phys_addr, size_type size,
         attr_type attr, memory_type cache)
     {
-        auto &entry = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+        auto index = level::index(virt_addr);
+        auto num = std::min<size_type>(
+                       static_cast<size_type>(level::num_entries - index),
+                       size >> level::from
+                   );
+
+        auto bits = leaf_bits(attr, cache);
+        auto entries = &this->walk_to(virt_addr, level::from);
+
+        for (size_type i = 0; i < num; i++) {
+            this->set_entry<level>(
+                entries[i], virt_addr + (i << level::from), phys_addr + (i << level::from), bits
+            );
+        }
+
+        return num << level::from;
+    }
+
+    bool
+    release_pdpte(virt_addr_t *virt_addr)
+    {
+        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
+        auto &entry = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+
+        if (::intel_x64::ept::pdpt::entry::ps::is_disabled(entry)) {
+            if (!this->release_pde(virt_addr)) {
+                return false;
+            }
+        }
+        else {
+            this->count_pages(entry, ::intel_x64::ept::pdpt::from, -1);
+            this->rmap_erase(reinterpret_cast<virt_addr_t>(virt_addr), entry, ::intel_x64::ept::pdpt::from);
+        }
+
+        this->clear(entry);
+
+        if (this->occupancy(m_pdpt) == 0) {
+            this->count_table(::intel_x64::ept::pdpt::from, -1);
+            this->free(m_pdpt);
+            return true;
+        }
+
+        return false;
+    }
+
+    bool
+    release_pde(virt_addr_t *virt_addr)
+    {
+        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
+        auto &entry = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
 
-        if (entry != 0) {
-            throw std::runtime_error(
-                "map_pdpte: map failed, virt / phys map already exists: " +
-                bfn::to_string(phys_addr, 16)
-            );
+        if (::intel_x64::ept::pd::entry::ps::is_disabled(entry)) {
+            if (!this->release_pte(virt_addr)) {
+                return false;
+            }
+        }
+        else {
+            this->count_pages(entry, ::intel_x64::ept::pd::from, -1);
+            this->rmap_erase(reinterpret_cast<virt_addr_t>(virt_addr), entry, ::intel_x64::ept::pd::from);
         }
 
-        ::intel_x64::ept::pdpt::entry::phys_addr::set(entry, phys_addr);
+        this->clear(entry);
 
-        switch (attr) {
-            case attr_type::none:
-                break;
+        if (this->occupancy(m_pd) == 0) {
+            this->count_table(::intel_x64::ept::pd::from, -1);
+            this->free(m_pd);
+            return true;
+        }
 
-            case attr_type::read_only:
-                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-                break;
+        return false;
+    }
 
-            case attr_type::write_only:
-                ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
-                break;
+    bool
+    release_pte(virt_addr_t *virt_addr)
+    {
+        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
+        auto &entry = m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
 
-            case attr_type::execute_only:
-                ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
-                break;
+        this->count_pages(entry, ::intel_x64::ept::pt::from, -1);
+        this->rmap_erase(reinterpret_cast<virt_addr_t>(virt_addr), entry, ::intel_x64::ept::pt::from);
+        this->clear(entry);
 
-            case attr_type::read_write:
-                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
-                break;
+        if (this->occupancy(m_pt) == 0) {
+            this->count_table(::intel_x64::ept::pt::from, -1);
+            this->free(m_pt);
+            return true;
+        }
 
-            case attr_type::read_execute:
-                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
-                break;
+        return false;
+    }
 
-            case attr_type::read_write_execute:
-                ::intel_x64::ept::pdpt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pdpt::entry::write_access::enable(entry);
-                ::intel_x64::ept::pdpt::entry::execute_access::enable(entry);
-                break;
-        };
+    // The reference count of a page table is the number of entries (in
+    // any of the maps that share page tables) that point to it. Tables
+    // that are not in the list are referenced once, and are owned by the
+    // one map that can reach them.
+    //
+    bool
+    is_shared(const pair &table)
+    {
+        if (!m_shared) {
+            return false;
+        }
 
-        switch (cache) {
-            case memory_type::uncacheable:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::uncacheable
-                );
-                break;
+        std::lock_guard<std::mutex> lock(m_shared->mutex);
+        return m_shared->refs.count(table.phys_addr) != 0;
+    }
 
-            case memory_type::write_combining:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::write_combining
-                );
-                break;
+    void
+    add_ref(phys_addr_t phys_addr)
+    {
+        auto iter = m_shared->refs.find(phys_addr);
 
-            case memory_type::write_through:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::write_through
-                );
-                break;
+        if (iter == m_shared->refs.end()) {
+            m_shared->refs[phys_addr] = 2;
+            return;
+        }
 
-            case memory_type::write_protected:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::write_protected
-                );
-                break;
+        iter->second++;
+    }
 
-            case memory_type::write_back:
-                ::intel_x64::ept::pdpt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pdpt::entry::memory_type::write_back
-                );
-                break;
-        };
+    bool
+    drop_ref(const pair &table)
+    {
+        if (!m_shared) {
+            return false;
+        }
 
-        ::intel_x64::ept::pdpt::entry::ps::enable(entry);
-        return entry;
+        std::lock_guard<std::mutex> lock(m_shared->mutex);
+        auto iter = m_shared->refs.find(table.phys_addr);
+
+        if (iter == m_shared->refs.end()) {
+            return false;
+        }
+
+        if (--iter->second == 1) {
+            m_shared->refs.erase(iter);
+        }
+
+        return true;
     }
 
-    entry_type &
-    map_pde(
-        virt_addr_t *virt_addr, phys_addr_t phys_addr,
-        attr_type attr, memory_type cache)
+    // Gives this map its own copy of a page table that is shared with
+    // another map, and points the provided entry (which must belong to a
+    // table that is owned by this map) to it. Every table the copy points
+    // to gains a reference. The lock is held for the entire copy so that
+    // two maps that write to the same shared table at the same time do not
+    // both think they are the last owner.
+    //
+    pair
+    copy_if_shared(entry_type &entry, const pair &table, uintptr_t from)
     {
-        auto &entry = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+        std::lock_guard<std::mutex> lock(m_shared->mutex);
+        auto iter = m_shared->refs.find(table.phys_addr);
 
-        if (entry != 0) {
-            throw std::runtime_error(
-                "map_pde: map failed, virt / phys map already exists: " +
-                bfn::to_string(phys_addr, 16)
-            );
+        if (iter == m_shared->refs.end()) {
+            return table;
         }
 
-        ::intel_x64::ept::pd::entry::phys_addr::set(entry, phys_addr);
+        auto copy = this->allocate(::intel_x64::ept::pt::num_entries);
+        std::copy(table.virt_addr.begin(), table.virt_addr.end(), copy.virt_addr.begin());
 
-        switch (attr) {
-            case attr_type::none:
-                break;
+        if (from != ::intel_x64::ept::pt::from) {
+            for (auto child : copy.virt_addr) {
+                if (child != 0 && ::intel_x64::ept::pd::entry::ps::is_disabled(child)) {
+                    this->add_ref(::intel_x64::ept::pd::entry::phys_addr::get(child));
+                }
+            }
+        }
 
-            case attr_type::read_only:
-                ::intel_x64::ept::pd::entry::read_access::enable(entry);
-                break;
+        if (--iter->second == 1) {
+            m_shared->refs.erase(iter);
+        }
 
-            case attr_type::write_only:
-                ::intel_x64::ept::pd::entry::write_access::enable(entry);
-                break;
+        auto num = this->occupancy(table);
+        m_occupancy.erase(reinterpret_cast<uintptr_t>(table.virt_addr.data()));
+        m_occupancy.set(reinterpret_cast<uintptr_t>(copy.virt_addr.data()), num);
 
-            case attr_type::execute_only:
-                ::intel_x64::ept::pd::entry::execute_access::enable(entry);
-                break;
+        ::intel_x64::ept::pd::entry::phys_addr::set(entry, copy.phys_addr);
+        return copy;
+    }
 
-            case attr_type::read_write:
-                ::intel_x64::ept::pd::entry::read_access::enable(entry);
-                ::intel_x64::ept::pd::entry::write_access::enable(entry);
-                break;
+    // Returns 0 for the PT level, 1 for the PD level, 2 for the PDPT level
+    // and 3 for the PML4 level.
+    //
+    static constexpr size_type
+    level_index(uintptr_t from) noexcept
+    {
+        return (from - ::intel_x64::ept::pt::from) /
+               (::intel_x64::ept::pd::from - ::intel_x64::ept::pt::from);
+    }
 
-            case attr_type::read_execute:
-                ::intel_x64::ept::pd::entry::read_access::enable(entry);
-                ::intel_x64::ept::pd::entry::execute_access::enable(entry);
-                break;
+    // Each leaf entry is recorded once, keyed by the physical address of
+    // the page it maps, tagged with its page size (see level_index()) in
+    // the low bits of the key, which are always 0 otherwise.
+    //
+    static phys_addr_t
+    rmap_key(phys_addr_t phys_addr, uintptr_t from) noexcept
+    { return bfn::upper(phys_addr, from) | level_index(from); }
 
-            case attr_type::read_write_execute:
-                ::intel_x64::ept::pd::entry::read_access::enable(entry);
-                ::intel_x64::ept::pd::entry::write_access::enable(entry);
-                ::intel_x64::ept::pd::entry::execute_access::enable(entry);
-                break;
-        };
+    void
+    rmap_insert(virt_addr_t virt_addr, entry_type entry, uintptr_t from)
+    {
+        if (!m_rmap_enabled || entry == 0) {
+            return;
+        }
 
-        switch (cache) {
-            case memory_type::uncacheable:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::uncacheable
-                );
-                break;
+        m_rmap.emplace(
+            rmap_key(::intel_x64::ept::pd::entry::phys_addr::get(entry), from),
+            bfn::upper(virt_addr, from)
+        );
+    }
 
-            case memory_type::write_combining:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::write_combining
-                );
-                break;
+    void
+    rmap_erase(virt_addr_t virt_addr, entry_type entry, uintptr_t from)
+    {
+        if (!m_rmap_enabled || entry == 0) {
+            return;
+        }
 
-            case memory_type::write_through:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::write_through
-                );
-                break;
+        auto range = m_rmap.equal_range(
+                         rmap_key(::intel_x64::ept::pd::entry::phys_addr::get(entry), from)
+                     );
 
-            case memory_type::write_protected:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::write_protected
-                );
-                break;
+        for (auto iter = range.first; iter != range.second; ++iter) {
+            if (iter->second == bfn::upper(virt_addr, from)) {
+                m_rmap.erase(iter);
+                return;
+            }
+        }
+    }
 
-            case memory_type::write_back:
-                ::intel_x64::ept::pd::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pd::entry::memory_type::write_back
-                );
-                break;
-        };
+    // The statistics (see stats()) are only updated atomically in
+    // concurrent mode, so that keeping them costs nothing more than an add
+    // otherwise.
+    //
+    void
+    count(uint64_t &counter, int64_t num) noexcept
+    {
+        if (m_concurrent) {
+            __atomic_fetch_add(&counter, static_cast<uint64_t>(num), __ATOMIC_RELAXED);
 
-        ::intel_x64::ept::pd::entry::ps::enable(entry);
-        return entry;
+            return;
+        }
+
+        counter += static_cast<uint64_t>(num);
     }
 
-    entry_type &
-    map_pte(
-        virt_addr_t *virt_addr, phys_addr_t phys_addr,
-        attr_type attr, memory_type cache)
-    {
-        auto &entry = m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr));
+    void
+    count_table(uintptr_t from, int64_t num) noexcept
+    { this->count(m_num_tables[level_index(from)], num); }
 
-        if (entry != 0) {
-            throw std::runtime_error(
-                "map_pte: map failed, virt / phys map already exists: " +
-                bfn::to_string(phys_addr, 16)
-            );
+    void
+    count_pages(entry_type entry, uintptr_t from, int64_t num) noexcept
+    {
+        if (entry == 0) {
+            return;
         }
 
-        ::intel_x64::ept::pt::entry::phys_addr::set(entry, phys_addr);
+        auto bytes = num * (1LL << from);
+        auto type = ::intel_x64::ept::pd::entry::memory_type::get(entry);
 
-        switch (attr) {
-            case attr_type::none:
-                break;
+        this->count(m_num_mapped[level_index(from)], bytes);
+        this->count(m_num_mapped_by_type[type], bytes);
+    }
 
-            case attr_type::read_only:
-                ::intel_x64::ept::pt::entry::read_access::enable(entry);
-                break;
+    void
+    clear(entry_type &entry)
+    {
+        if (entry != 0) {
+            entry = 0;
+            this->occupy(&entry, -1);
+        }
+    }
 
-            case attr_type::write_only:
-                ::intel_x64::ept::pt::entry::write_access::enable(entry);
-                break;
+    void
+    occupy(entry_type *entry, index_type num)
+    {
+        if (m_concurrent) {
+            return;
+        }
 
-            case attr_type::execute_only:
-                ::intel_x64::ept::pt::entry::execute_access::enable(entry);
-                break;
+        auto key = bfn::upper(reinterpret_cast<uintptr_t>(entry), ::intel_x64::ept::pt::from);
+        m_occupancy.add(key, num);
+    }
 
-            case attr_type::read_write:
-                ::intel_x64::ept::pt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pt::entry::write_access::enable(entry);
-                break;
+    size_type
+    occupancy(const pair &table) const
+    { return m_occupancy.get(reinterpret_cast<uintptr_t>(table.virt_addr.data())); }
 
-            case attr_type::read_execute:
-                ::intel_x64::ept::pt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pt::entry::execute_access::enable(entry);
-                break;
+    void
+    count_occupancy(const pair &table, uintptr_t from, occupancy_type &occupancy)
+    {
+        size_type count = 0;
 
-            case attr_type::read_write_execute:
-                ::intel_x64::ept::pt::entry::read_access::enable(entry);
-                ::intel_x64::ept::pt::entry::write_access::enable(entry);
-                ::intel_x64::ept::pt::entry::execute_access::enable(entry);
-                break;
-        };
+        for (auto entry : table.virt_addr) {
+            if (entry == 0) {
+                continue;
+            }
 
-        switch (cache) {
-            case memory_type::uncacheable:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::uncacheable
-                );
-                break;
+            count++;
 
-            case memory_type::write_combining:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::write_combining
-                );
-                break;
+            if (from == ::intel_x64::ept::pt::from) {
+                continue;
+            }
 
-            case memory_type::write_through:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::write_through
-                );
-                break;
+            if (from != ::intel_x64::ept::pml4::from && ::intel_x64::ept::pd::entry::ps::is_enabled(entry)) {
+                continue;
+            }
 
-            case memory_type::write_protected:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::write_protected
-                );
-                break;
+            auto child = this->phys_to_pair(
+                             ::intel_x64::ept::pd::entry::phys_addr::get(entry),
+                             ::intel_x64::ept::pt::num_entries
+                         );
 
-            case memory_type::write_back:
-                ::intel_x64::ept::pt::entry::memory_type::set(
-                    entry,
-                    ::intel_x64::ept::pt::entry::memory_type::write_back
-                );
-                break;
-        };
+            auto child_from = from - (::intel_x64::ept::pd::from - ::intel_x64::ept::pt::from);
+            this->count_occupancy(child, child_from, occupancy);
+        }
 
-        return entry;
+        occupancy.set(reinterpret_cast<uintptr_t>(table.virt_addr.data()), count);
     }
 
-    bool
-    release_pdpte(virt_addr_t *virt_addr)
+    void
+    image_table(const pair &table, uintptr_t from, virt_addr_t base, image_type &image)
     {
-        this->map_pdpt(::intel_x64::ept::pml4::index(virt_addr));
-        auto &entry = m_pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt_addr));
+        using namespace ::intel_x64::ept::pd::entry;
 
-        if (::intel_x64::ept::pdpt::entry::ps::is_disabled(entry)) {
-            if (!this->release_pde(virt_addr)) {
-                return false;
+        for (index_type i = 0; i < table.virt_addr.size(); i++) {
+            auto entry = this->load(table.virt_addr.at(i));
+
+            if (entry == 0) {
+                continue;
             }
-        }
 
-        entry = 0;
+            auto virt = base + (i << from);
+            auto phys = phys_addr::get(entry);
 
-        auto empty = true;
-        for (auto pdpti = 0; pdpti < ::intel_x64::ept::pdpt::num_entries; pdpti++) {
-            if (m_pdpt.virt_addr.at(pdpti) != 0) {
-                empty = false;
+            if (from == ::intel_x64::ept::pml4::from ||
+                (from != ::intel_x64::ept::pt::from && ps::is_disabled(entry))) {
+                auto child = this->phys_to_pair(phys, ::intel_x64::ept::pt::num_entries);
+                auto child_from = from - (::intel_x64::ept::pd::from - ::intel_x64::ept::pt::from);
+
+                this->image_table(child, child_from, virt, image);
+                continue;
+            }
+
+            auto page_size = 1ULL << from;
+            auto flags = entry & ~(phys_addr::mask | accessed_flag::mask | dirty::mask | ps::mask);
+
+            if (!image.empty()) {
+                auto &run = image.back();
+
+                if (run.page_size == page_size && run.flags == flags &&
+                    run.virt_addr + run.size == virt && run.phys_addr + run.size == phys) {
+                    run.size += page_size;
+                    continue;
+                }
             }
+
+            image.push_back({virt, phys, page_size, page_size, flags});
         }
+    }
 
-        if (empty) {
-            this->free(m_pdpt.virt_addr);
-            return true;
+    // Returns the number of tables (that hold entries of 1 << from bytes
+    // each) a run needs that the runs before it have not already counted.
+    // Since the runs are sorted, only the key of the last table needs to
+    // be remembered.
+    //
+    size_type
+    count_tables(const image_run_type &run, uintptr_t from, uintptr_t &last_key)
+    {
+        auto first_key = run.virt_addr >> from;
+        auto next_key = (run.virt_addr + run.size - 1) >> from;
+
+        auto num = next_key - first_key + 1;
+        if (first_key == last_key) {
+            num--;
         }
 
-        return false;
+        last_key = next_key;
+        return num;
+    }
+
+    pair
+    restore_table(entry_type &entry, std::vector<pair>::iterator &next)
+    {
+        auto table = *next++;
+        this->occupy(&entry, 1);
+
+        ::intel_x64::ept::pd::entry::phys_addr::set(entry, table.phys_addr);
+        ::intel_x64::ept::pd::entry::read_access::enable(entry);
+        ::intel_x64::ept::pd::entry::write_access::enable(entry);
+        ::intel_x64::ept::pd::entry::execute_access::enable(entry);
+
+        return table;
     }
 
+    // Note that the accessed flag, the dirty flag and the page size bit are
+    // located at the same bit position at every level of the EPT, which
+    // is what allows this walk to be written once for all four levels.
+    //
     bool
-    release_pde(virt_addr_t *virt_addr)
+    harvest_table(
+        const pair &table, uintptr_t from, virt_addr_t saddr,
+        virt_addr_t eaddr, virt_addr_t base, dirty_bitmap_type &bitmap)
     {
-        this->map_pd(::intel_x64::ept::pdpt::index(virt_addr));
-        auto &entry = m_pd.virt_addr.at(::intel_x64::ept::pd::index(virt_addr));
+        using namespace ::intel_x64::ept::pd::entry;
 
-        if (::intel_x64::ept::pd::entry::ps::is_disabled(entry)) {
-            if (!this->release_pte(virt_addr)) {
-                return false;
+        auto cleared = false;
+        auto entry_size = static_cast<virt_addr_t>(1ULL << from);
+
+        for (auto virt = saddr; virt < eaddr;) {
+            auto start = bfn::upper(virt, from);
+            auto end = start + entry_size;
+            auto next = std::min(end, eaddr);
+
+            auto &entry = table.virt_addr.at(
+                              static_cast<index_type>((virt >> from) % table.virt_addr.size())
+                          );
+
+            auto value = this->load(entry);
+            auto whole = start >= saddr && end <= eaddr;
+
+            if (from == ::intel_x64::ept::pt::from || ps::is_enabled(value)) {
+                if (dirty::is_enabled(value)) {
+                    this->set_dirty(bitmap, base, virt, next);
+
+                    if (whole) {
+                        this->fetch_and(entry, ~dirty::mask);
+                        cleared = true;
+                    }
+                }
+            }
+            else if (value != 0) {
+                auto child = this->phys_to_pair(
+                                 phys_addr::get(value), ::intel_x64::ept::pt::num_entries
+                             );
+
+                auto child_from = from - (::intel_x64::ept::pd::from - ::intel_x64::ept::pt::from);
+
+                if (this->harvest_table(child, child_from, virt, next, base, bitmap)) {
+                    cleared = true;
+                }
             }
+
+            virt = next;
         }
 
-        entry = 0;
+        return cleared;
+    }
 
-        auto empty = true;
-        for (auto pdi = 0; pdi < ::intel_x64::ept::pd::num_entries; pdi++) {
-            if (m_pd.virt_addr.at(pdi) != 0) {
-                empty = false;
+    size_type
+    compact_pdpt(
+        const pair &pdpt, virt_addr_t saddr, virt_addr_t eaddr,
+        virt_addr_t range_saddr, virt_addr_t range_eaddr)
+    {
+        size_type num_freed = 0;
+
+        for (auto virt = saddr; virt < eaddr;) {
+            auto start = bfn::upper(virt, ::intel_x64::ept::pdpt::from);
+            auto end = start + ::intel_x64::ept::pdpt::page_size;
+            auto next = std::min(end, eaddr);
+
+            auto &entry = pdpt.virt_addr.at(::intel_x64::ept::pdpt::index(virt));
+
+            if (entry != 0 && ::intel_x64::ept::pdpt::entry::ps::is_disabled(entry)) {
+                auto pd = this->phys_to_pair(
+                              ::intel_x64::ept::pdpt::entry::phys_addr::get(entry),
+                              ::intel_x64::ept::pd::num_entries
+                          );
+
+                if (this->is_shared(pd)) {
+                    virt = next;
+                    continue;
+                }
+
+                auto pdv = bfn::upper(virt, ::intel_x64::ept::pd::from);
+                for (; pdv < next; pdv += ::intel_x64::ept::pd::page_size) {
+                    if (pdv < range_saddr || pdv + ::intel_x64::ept::pd::page_size > range_eaddr) {
+                        continue;
+                    }
+
+                    auto &pde = pd.virt_addr.at(::intel_x64::ept::pd::index(pdv));
+
+                    if (pde != 0 && ::intel_x64::ept::pd::entry::ps::is_disabled(pde)) {
+                        num_freed += this->promote(pde, pdv, ::intel_x64::ept::pt::from) ? 1 : 0;
+                    }
+                }
+
+                if (start >= range_saddr && end <= range_eaddr && is_1g_supported()) {
+                    num_freed += this->promote(entry, start, ::intel_x64::ept::pd::from) ? 1 : 0;
+                }
             }
+
+            virt = next;
         }
 
-        if (empty) {
-            this->free(m_pd.virt_addr);
-            return true;
+        return num_freed;
+    }
+
+    // Replaces a large page entry with a table entry that points to a new
+    // table of pages of child_from size. Like promote(), this relies on the
+    // bits being in the same position at every level, except that the
+    // page size bit must be cleared in a page table, where it is ignored.
+    //
+    void
+    split(entry_type &entry, virt_addr_t virt_addr, uintptr_t child_from)
+    {
+        using namespace ::intel_x64::ept::pd::entry;
+
+        auto value = this->load(entry);
+        auto table = this->allocate(::intel_x64::ept::pt::num_entries);
+
+        auto base = phys_addr::get(value);
+        auto flags = value & ~phys_addr::mask;
+
+        if (child_from == ::intel_x64::ept::pt::from) {
+            ps::disable(flags);
         }
 
-        return false;
+        for (index_type i = 0; i < table.virt_addr.size(); i++) {
+            table.virt_addr.at(i) = flags | (base + (i << child_from));
+        }
+
+        entry_type table_entry = 0;
+        phys_addr::set(table_entry, table.phys_addr);
+        read_access::enable(table_entry);
+        write_access::enable(table_entry);
+        execute_access::enable(table_entry);
+
+        if (!this->compare_exchange(entry, value, table_entry)) {
+            this->free(table);
+
+            throw std::runtime_error(
+                "split: entry was modified while it was being split: " +
+                bfn::to_string(base, 16)
+            );
+        }
+
+        this->occupy(table.virt_addr.data(), ::intel_x64::ept::pt::num_entries);
+
+        auto from = child_from + (::intel_x64::ept::pd::from - ::intel_x64::ept::pt::from);
+
+        this->count_table(child_from, 1);
+        this->count(m_num_mapped[level_index(from)], -(1LL << from));
+        this->count(m_num_mapped[level_index(child_from)], 1LL << from);
+        this->count(m_num_splits, 1);
+
+        if (m_rmap_enabled) {
+            this->rmap_erase(virt_addr, value, from);
+
+            for (index_type i = 0; i < table.virt_addr.size(); i++) {
+                this->rmap_insert(
+                    virt_addr + (i << child_from), table.virt_addr.at(i), child_from
+                );
+            }
+        }
+
+        this->invalidate();
     }
 
+    // Replaces a table entry with a large page entry if every entry in the
+    // table it points to is a page of child_from size, and all of them
+    // together form one larger, aligned, physically contiguous page with
+    // the same attributes and memory type. As with harvest_table(), this
+    // relies on the bits being in the same position at every level.
+    //
     bool
-    release_pte(virt_addr_t *virt_addr)
+    promote(entry_type &entry, virt_addr_t virt_addr, uintptr_t child_from)
     {
-        this->map_pt(::intel_x64::ept::pd::index(virt_addr));
-        m_pt.virt_addr.at(::intel_x64::ept::pt::index(virt_addr)) = 0;
+        using namespace ::intel_x64::ept::pd::entry;
+
+        auto table = this->phys_to_pair(
+                         phys_addr::get(entry), ::intel_x64::ept::pt::num_entries
+                     );
+
+        auto first = table.virt_addr.at(0);
+        auto base = phys_addr::get(first);
+        auto flags_mask = ~(phys_addr::mask | accessed_flag::mask | dirty::mask);
+        auto large_from = child_from + (::intel_x64::ept::pd::from - ::intel_x64::ept::pt::from);
+
+        if (first == 0 || bfn::lower(base, large_from) != 0) {
+            return false;
+        }
+
+        entry_type accessed_and_dirty = 0;
+        for (index_type i = 0; i < table.virt_addr.size(); i++) {
+            auto child = table.virt_addr.at(i);
+
+            if (child == 0 || (child & flags_mask) != (first & flags_mask)) {
+                return false;
+            }
+
+            if (child_from != ::intel_x64::ept::pt::from && ps::is_disabled(child)) {
+                return false;
+            }
 
-        auto empty = true;
-        for (auto pti = 0; pti < ::intel_x64::ept::pt::num_entries; pti++) {
-            if (m_pt.virt_addr.at(pti) != 0) {
-                empty = false;
+            if (phys_addr::get(child) != base + (i << child_from)) {
+                return false;
             }
+
+            accessed_and_dirty |= child & (accessed_flag::mask | dirty::mask);
         }
 
-        if (empty) {
-            this->free(m_pt.virt_addr);
-            return true;
+        auto value = (first & flags_mask) | base | accessed_and_dirty;
+        ps::enable(value);
+
+        this->exchange(entry, value);
+
+        this->count_table(child_from, -1);
+        this->count(m_num_mapped[level_index(child_from)], -(1LL << large_from));
+        this->count(m_num_mapped[level_index(large_from)], 1LL << large_from);
+        this->count(m_num_merges, 1);
+
+        if (m_rmap_enabled) {
+            for (index_type i = 0; i < table.virt_addr.size(); i++) {
+                this->rmap_erase(
+                    virt_addr + (i << child_from), table.virt_addr.at(i), child_from
+                );
+            }
+
+            this->rmap_insert(virt_addr, value, large_from);
         }
 
-        return false;
+        this->free(table);
+        return true;
+    }
+
+    static void
+    set_dirty(
+        dirty_bitmap_type &bitmap, virt_addr_t base,
+        virt_addr_t saddr, virt_addr_t eaddr)
+    {
+        auto first = (saddr - base) >> ::intel_x64::ept::pt::from;
+        auto last = (eaddr - base) >> ::intel_x64::ept::pt::from;
+
+        for (auto n = first; n < last; n++) {
+            bitmap.at(n / 64) |= 1ULL << (n % 64);
+        }
     }
 
 private:
 
+    page_pool *m_pool{nullptr};
+    bool m_concurrent{false};
+    std::atomic<uint64_t> m_generation{0};
+    occupancy_type m_occupancy;
+
+    bool m_rmap_enabled{false};
+    rmap_type m_rmap;
+
+    std::array<uint64_t, 4> m_num_tables{{0, 0, 0, 1}};
+    std::array<uint64_t, 3> m_num_mapped{};
+    std::array<uint64_t, 8> m_num_mapped_by_type{};
+    uint64_t m_num_splits{0};
+    uint64_t m_num_merges{0};
+
+    struct shared_tables_type {
+        std::mutex mutex;
+        std::unordered_map<phys_addr_t, size_type> refs;
+    };
+
+    std::shared_ptr<shared_tables_type> m_shared;
+
+    struct walk_cache_entry {
+        phys_addr_t key{~0ULL};
+        pair table{};
+    };
+
+    std::vector<walk_cache_entry> m_walk_cache{
+        std::vector<walk_cache_entry>(static_cast<size_type>(default_walk_cache_size))
+    };
+    size_type m_walk_cache_next{0};
+    size_type m_walk_cache_hits{0};
+    size_type m_walk_cache_misses{0};
+
     pair m_pml4;
     pair m_pdpt;
     pair m_pd;
@@ -1150,8 +3629,30 @@ public:
 
     /// @cond
 
-    mmap(mmap &&) = default;
-    mmap &operator=(mmap &&) = default;
+    mmap(mmap &&other) noexcept :
+        m_pool{other.m_pool},
+        m_concurrent{other.m_concurrent},
+        m_generation{other.m_generation.load()},
+        m_occupancy{std::move(other.m_occupancy)},
+        m_rmap_enabled{other.m_rmap_enabled},
+        m_rmap{std::move(other.m_rmap)},
+        m_num_tables{other.m_num_tables},
+        m_num_mapped{other.m_num_mapped},
+        m_num_mapped_by_type{other.m_num_mapped_by_type},
+        m_num_splits{other.m_num_splits},
+        m_num_merges{other.m_num_merges},
+        m_shared{std::move(other.m_shared)},
+        m_walk_cache{std::move(other.m_walk_cache)},
+        m_walk_cache_next{other.m_walk_cache_next},
+        m_walk_cache_hits{other.m_walk_cache_hits},
+        m_walk_cache_misses{other.m_walk_cache_misses},
+        m_pml4{std::exchange(other.m_pml4, {})},
+        m_pdpt{std::exchange(other.m_pdpt, {})},
+        m_pd{std::exchange(other.m_pd, {})},
+        m_pt{std::exchange(other.m_pt, {})}
+    { }
+
+    mmap &operator=(mmap &&) = delete;
 
     mmap(const mmap &) = delete;
     mmap &operator=(const mmap &) = delete;
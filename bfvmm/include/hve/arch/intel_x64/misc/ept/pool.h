@@ -0,0 +1,253 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef EPT_POOL_INTEL_X64_H
+#define EPT_POOL_INTEL_X64_H
+
+#include <algorithm>
+#include <mutex>
+#include <vector>
+
+#include <bfgsl.h>
+
+#include <intrinsics.h>
+#include <bfvmm/memory_manager/memory_manager.h>
+
+// -----------------------------------------------------------------------------
+// Definition
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+namespace ept
+{
+
+/// EPT Page Table Pool
+///
+/// A cache of the pages used by an EPT memory map for its page tables.
+/// Pages are taken from the memory manager one at a time, several at once
+/// when the pool runs out, and the physical address of each page is looked
+/// up (prefetched) when it is added to the pool, so that handing a page out
+/// never needs a lookup. The pages are not contiguous. Pages that are freed
+/// are zeroed and kept in the pool for reuse instead of being returned to
+/// the memory manager.
+///
+/// A pool can be given to a single map, or shared by several maps. Calling
+/// reserve() up front ensures that no allocations (or physical address
+/// lookups) are needed when a map is changed later on (e.g. while handling
+/// a VM exit). The pool must outlive any map that uses it, and is safe to
+/// use from more than one CPU at a time.
+///
+class page_pool
+{
+
+public:
+
+    using phys_addr_t = uintptr_t;                      ///< Phys Address Type (as Int)
+    using virt_addr_t = uintptr_t;                      ///< Virt Address Type (as Ptr)
+    using size_type = size_t;                           ///< Size Type
+
+    /// Page
+    ///
+    /// A page table page along with its cached physical address
+    ///
+    struct page_type {
+        virt_addr_t *virt_addr{};                       ///< Virtual address of the page
+        phys_addr_t phys_addr{};                        ///< Physical address of the page
+    };
+
+    /// Stats
+    ///
+    /// Usage statistics for the pool
+    ///
+    struct stats_type {
+        size_type total{};                              ///< Pages owned by the pool
+        size_type free{};                               ///< Pages ready to be handed out
+        size_type used{};                               ///< Pages handed out
+        size_type peak{};                               ///< Largest value used has reached
+        size_type allocations{};                        ///< Calls to allocate()
+        size_type releases{};                           ///< Calls to free()
+        size_type misses{};                             ///< allocate() calls that had to grow
+    };
+
+    /// Constructor
+    ///
+    /// @expects grow_size != 0
+    /// @ensures
+    ///
+    /// @param grow_size the number of pages to add to the pool each time
+    ///     it runs out of free pages
+    ///
+    explicit page_pool(size_type grow_size = 64) :
+        m_grow_size{grow_size}
+    { expects(grow_size != 0); }
+
+    /// Destructor
+    ///
+    /// Returns all of the pages owned by the pool back to the memory
+    /// manager, including pages that are still in use.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~page_pool()
+    {
+        for (const auto &virt_addr : m_pages) {
+            free_page(virt_addr);
+        }
+    }
+
+    /// Reserve
+    ///
+    /// Ensures that at least num_pages pages can be allocated from the pool
+    /// without the pool having to go back to the memory manager.
+    ///
+    /// @expects
+    /// @ensures stats().free >= num_pages
+    ///
+    /// @param num_pages the number of free pages to reserve
+    ///
+    void
+    reserve(size_type num_pages)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_free.size() < num_pages) {
+            this->grow(num_pages - m_free.size());
+        }
+    }
+
+    /// Allocate
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns a zeroed page along with its physical address. If
+    ///     the pool is empty, grow_size pages are added to it first.
+    ///
+    page_type
+    allocate()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        if (m_free.empty()) {
+            m_stats.misses++;
+            this->grow(m_grow_size);
+        }
+
+        auto page = m_free.back();
+        m_free.pop_back();
+
+        m_stats.allocations++;
+        m_stats.peak = std::max(m_stats.peak, m_pages.size() - m_free.size());
+
+        return page;
+    }
+
+    /// Free
+    ///
+    /// Zeroes the page and returns it to the pool. Note that this never
+    /// allocates memory, as the list of free pages always has enough room
+    /// for every page the pool owns.
+    ///
+    /// @expects virt_addr != nullptr
+    /// @ensures
+    ///
+    /// @param virt_addr the virtual address of the page to free
+    /// @param phys_addr the physical address of the page to free
+    ///
+    void
+    free(virt_addr_t *virt_addr, phys_addr_t phys_addr)
+    {
+        expects(virt_addr != nullptr);
+
+        auto entries = gsl::make_span(virt_addr, ::intel_x64::ept::pt::num_entries);
+        std::fill(entries.begin(), entries.end(), 0);
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        m_free.push_back({virt_addr, phys_addr});
+        m_stats.releases++;
+    }
+
+    /// Stats
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the usage statistics of the pool
+    ///
+    stats_type
+    stats() const
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+
+        auto stats = m_stats;
+
+        stats.total = m_pages.size();
+        stats.free = m_free.size();
+        stats.used = m_pages.size() - m_free.size();
+
+        return stats;
+    }
+
+private:
+
+    void
+    grow(size_type num_pages)
+    {
+        m_pages.reserve(m_pages.size() + num_pages);
+        m_free.reserve(m_pages.size() + num_pages);
+
+        for (size_type i = 0; i < num_pages; i++) {
+            auto virt_addr = static_cast<virt_addr_t *>(alloc_page());
+
+            m_pages.push_back(virt_addr);
+            m_free.push_back({virt_addr, g_mm->virtptr_to_physint(virt_addr)});
+        }
+    }
+
+private:
+
+    size_type m_grow_size;
+    mutable std::mutex m_mutex;
+    stats_type m_stats{};
+
+    std::vector<virt_addr_t *> m_pages;
+    std::vector<page_type> m_free;
+
+public:
+
+    /// @cond
+
+    page_pool(page_pool &&) = delete;
+    page_pool &operator=(page_pool &&) = delete;
+
+    page_pool(const page_pool &) = delete;
+    page_pool &operator=(const page_pool &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+}
+
+#endif
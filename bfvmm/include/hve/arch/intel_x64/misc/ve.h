@@ -0,0 +1,172 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef VE_INTEL_X64_EAPIS_H
+#define VE_INTEL_X64_EAPIS_H
+
+#include <memory>
+
+#include "../base.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+/// Virtualization Exceptions
+///
+/// Provides an interface for enabling EPT-violation #VE. Once enabled, an
+/// EPT violation on a page whose suppress #VE bit is cleared (see
+/// ept::mmap::enable_ve()) is delivered to the guest as a virtualization
+/// exception (vector 20) instead of causing a VM exit, and the details of
+/// the violation are written to the #VE information page managed by this
+/// handler. The CPU only delivers a #VE if the page is not busy, and marks
+/// it busy when it does, so the in-guest agent must clear the busy flag
+/// once it is done with the information (otherwise the next violation
+/// causes a VM exit as usual). For the agent to be able to read the page,
+/// it must be mapped into the guest's EPT, e.g.:
+///
+/// @code
+/// mmap.map_4k(agent_gpa, vcpu->ve()->phys_addr(), ept::mmap::attr_type::read_write);
+/// @endcode
+///
+class EXPORT_EAPIS_HVE ve_handler
+{
+public:
+
+    /// #VE Information
+    ///
+    /// The layout of the #VE information area, as defined by the SDM
+    ///
+    struct info_type {
+        uint32_t exit_reason;
+        uint32_t busy;
+        uint64_t exit_qualification;
+        uint64_t guest_linear_address;
+        uint64_t guest_physical_address;
+        uint16_t eptp_index;
+    };
+
+    /// Busy
+    ///
+    /// The value the CPU writes to info_type::busy when it delivers a #VE
+    ///
+    constexpr static const uint32_t busy = 0xFFFFFFFF;
+
+    /// Constructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ve_handler();
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~ve_handler() = default;
+
+    /// Enable
+    ///
+    /// @expects EPT is enabled
+    /// @expects the CPU supports EPT-violation #VE
+    /// @ensures
+    ///
+    void enable();
+
+    /// Disable
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Info
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the #VE information page. Its contents are only
+    ///     valid while it is busy (see is_busy()).
+    ///
+    const info_type &info() const noexcept
+    { return *m_info; }
+
+    /// Is Busy
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns true if a #VE was delivered and the guest has not
+    ///     cleared the busy flag yet, in which case no further #VE will be
+    ///     delivered, and EPT violations cause a VM exit instead
+    ///
+    bool is_busy() const noexcept
+    { return m_info->busy == busy; }
+
+    /// Clear
+    ///
+    /// Clears the busy flag on behalf of the guest, so that the next EPT
+    /// violation can be delivered as a #VE again (e.g. when the agent
+    /// reports that it is done through a hypercall, or when it is being
+    /// reset).
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void clear() noexcept
+    { m_info->busy = 0; }
+
+    /// Physical Address
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the physical address of the #VE information page
+    ///
+    uintptr_t phys_addr() const noexcept
+    { return m_phys_addr; }
+
+private:
+
+    std::unique_ptr<uintptr_t[]> m_page;
+    info_type *m_info;
+    uintptr_t m_phys_addr;
+
+public:
+
+    /// @cond
+
+    ve_handler(ve_handler &&) = default;
+    ve_handler &operator=(ve_handler &&) = default;
+
+    ve_handler(const ve_handler &) = delete;
+    ve_handler &operator=(const ve_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
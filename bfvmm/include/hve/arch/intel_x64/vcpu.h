@@ -29,11 +29,13 @@
 #include "vmexit/io_instruction.h"
 #include "vmexit/monitor_trap.h"
 #include "vmexit/mov_dr.h"
+#include "vmexit/pml.h"
 #include "vmexit/rdmsr.h"
 #include "vmexit/sipi.h"
 #include "vmexit/wrmsr.h"
 
 #include "misc/ept.h"
+#include "misc/ve.h"
 #include "misc/vpid.h"
 
 #include <bfvmm/hve/arch/intel_x64/vcpu/vcpu.h>
@@ -70,6 +72,46 @@ public:
     ///
     ~vcpu() = default;
 
+public:
+
+    //==========================================================================
+    // VMExits
+    //==========================================================================
+
+    /// Add Exit Handler
+    ///
+    /// Registers a handler for a basic exit reason. The handlers in the
+    /// EAPIs register through this function instead of directly with the
+    /// base exit handler. Upon construction, the vCPU registers itself with
+    /// the base exit handler for every basic exit reason, so that every
+    /// exit, whether or not an EAPIs handler exists for its reason, is
+    /// finished the same way before the guest is resumed: if EPT is enabled,
+    /// any translations the CPU might have cached from a map that has since
+    /// changed are invalidated (see ept_handler::sync()). Handlers are
+    /// called from the most recently added to the least recently added,
+    /// until one of them returns true. If none of them do, the exit is
+    /// passed on to the handlers registered with the base exit handler.
+    ///
+    /// @note handlers that are added directly to the base exit handler
+    ///     after construction are called before the vCPU, and resume the
+    ///     guest without this sync, and should therefore be registered here
+    ///     instead.
+    ///
+    /// @expects reason is a basic exit reason defined by the SDM
+    /// @ensures
+    ///
+    /// @param reason the basic exit reason to call the given handler for
+    /// @param d the delegate to call when an exit with this reason occurs
+    ///
+    void add_exit_handler(
+        vmcs_n::value_type reason, const ::handler_delegate_t &d);
+
+    /// @cond
+
+    bool handle_exit(gsl::not_null<vmcs_t *> vmcs);
+
+    /// @endcond
+
 public:
 
     //==========================================================================
@@ -148,6 +190,79 @@ public:
     ///
     void disable_vpid();
 
+    //--------------------------------------------------------------------------
+    // PML
+    //--------------------------------------------------------------------------
+
+    /// Get PML Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the PML handler stored in the vcpu if PML is
+    ///     enabled, otherwise an exception is thrown
+    ///
+    gsl::not_null<eapis::intel_x64::pml_handler *> pml();
+
+    /// Enable PML
+    ///
+    /// Enables page-modification logging. Since the CPU only logs pages
+    /// when it sets their EPT dirty flag, the EPT accessed and dirty flags
+    /// are enabled as well.
+    ///
+    /// @expects EPT is enabled (see set_eptp())
+    /// @ensures
+    ///
+    void enable_pml();
+
+    /// Disable PML
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_pml();
+
+    //--------------------------------------------------------------------------
+    // #VE
+    //--------------------------------------------------------------------------
+
+    /// Get #VE Handler
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the #VE handler stored in the vcpu if #VE is
+    ///     enabled, otherwise an exception is thrown
+    ///
+    gsl::not_null<eapis::intel_x64::ve_handler *> ve();
+
+    /// Enable #VE
+    ///
+    /// Enables EPT-violation #VE. Which EPT violations are delivered to
+    /// the guest as a #VE, and which cause a VM exit, is decided per page
+    /// by the EPT (see ept::mmap::enable_ve()).
+    ///
+    /// Violations on addresses that are not mapped at all are always
+    /// delivered as a #VE, so #VE cannot be used together with demand
+    /// mapping, or with maps that have holes. This is only checked when #VE
+    /// is enabled; the maps must not gain holes afterwards.
+    ///
+    /// @expects EPT is enabled (see set_eptp())
+    /// @expects demand mapping is not enabled (see
+    ///     enable_ept_demand_mapping())
+    /// @expects the current map and the maps of all views have no holes
+    ///     (see ept::mmap::has_holes())
+    /// @ensures
+    ///
+    void enable_ve();
+
+    /// Disable #VE
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_ve();
+
     //==========================================================================
     // VMExit
     //==========================================================================
@@ -336,6 +451,27 @@ public:
     void add_ept_execute_violation_handler(
         ept_violation_handler::handler_delegate_t &&d);
 
+    /// Enable EPT Demand Mapping
+    ///
+    /// Populates the provided map as the guest touches memory inside the
+    /// provided regions (see
+    /// ept_violation_handler::enable_demand_mapping()).
+    ///
+    /// @expects max_page_size is 4k, 2m or 1g
+    /// @expects #VE is not enabled (see enable_ve())
+    /// @ensures
+    ///
+    /// @param map the map to populate
+    /// @param memory_map the regions that may be mapped on demand
+    /// @param max_page_size the largest page size that may be used
+    /// @param attr the memory attributes to apply to the map
+    ///
+    void enable_ept_demand_mapping(
+        ept::mmap &map,
+        const ept::memory_map_t &memory_map,
+        uint64_t max_page_size = ::intel_x64::ept::pdpt::page_size,
+        ept::mmap::attr_type attr = ept::mmap::attr_type::read_write_execute);
+
     //--------------------------------------------------------------------------
     // External Interrupt
     //--------------------------------------------------------------------------
@@ -619,8 +755,15 @@ private:
     std::unique_ptr<uint8_t[]> m_msr_bitmap;
     std::unique_ptr<uint8_t[]> m_io_bitmaps;
 
+    static constexpr const auto s_num_exit_reasons =
+        vmcs_n::exit_reason::basic_exit_reason::xrstors + 1;
+
+    std::array<std::list<::handler_delegate_t>, s_num_exit_reasons> m_exit_handlers;
+
     std::unique_ptr<eapis::intel_x64::ept_handler> m_ept_handler;
     std::unique_ptr<eapis::intel_x64::vpid_handler> m_vpid_handler;
+    std::unique_ptr<eapis::intel_x64::pml_handler> m_pml_handler;
+    std::unique_ptr<eapis::intel_x64::ve_handler> m_ve_handler;
 
     std::unique_ptr<eapis::intel_x64::control_register_handler> m_control_register_handler;
     std::unique_ptr<eapis::intel_x64::cpuid_handler> m_cpuid_handler;
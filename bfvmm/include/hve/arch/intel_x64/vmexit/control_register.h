@@ -304,8 +304,6 @@ private:
 
 private:
 
-    gsl::not_null<exit_handler_t *> m_exit_handler;
-
     std::list<handler_delegate_t> m_wrcr0_handlers;
     std::list<handler_delegate_t> m_rdcr3_handlers;
     std::list<handler_delegate_t> m_wrcr3_handlers;
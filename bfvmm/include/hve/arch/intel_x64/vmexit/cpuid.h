@@ -155,7 +155,6 @@ public:
 
 private:
 
-    gsl::not_null<exit_handler_t *> m_exit_handler;
     std::unordered_map<leaf_t, std::list<handler_delegate_t>> m_handlers;
 
 private:
@@ -20,6 +20,7 @@
 #define EPT_VIOLATION_INTEL_X64_H
 
 #include "../base.h"
+#include "../misc/ept/helpers.h"
 
 // -----------------------------------------------------------------------------
 // Definitions
@@ -131,6 +132,67 @@ public:
     ///
     void add_execute_handler(handler_delegate_t &&d);
 
+    /// Enable Demand Mapping
+    ///
+    /// Allows the guest to start with an empty (or sparse) map, and to have
+    /// the map populated as the guest touches memory. When the guest
+    /// accesses an address that is not mapped, but that is inside one of
+    /// the provided regions, the address is identity mapped (see
+    /// ept::identity_map_page()) using the largest page that the MTRRs, the
+    /// regions, max_page_size and the existing mappings allow, and the
+    /// guest is resumed at the same instruction. EPT violations on mapped
+    /// pages, on addresses outside of the regions, and on addresses that
+    /// cannot be mapped (e.g. because no memory is left for the page
+    /// tables), are passed to the registered handlers as usual.
+    ///
+    /// Since mappings are only ever added, no INVEPT is needed. If the map
+    /// is shared by more than one vCPU, it must be in concurrent mode (see
+    /// ept::mmap::set_concurrent()).
+    ///
+    /// @expects max_page_size is 4k, 2m or 1g
+    /// @ensures
+    ///
+    /// @param map the map to populate. This should be the map this vCPU
+    ///     uses (see vcpu::set_eptp()), and must outlive this handler, or
+    ///     demand mapping must be disabled first.
+    /// @param memory_map the regions that may be mapped on demand
+    /// @param max_page_size the largest page size that may be used
+    /// @param attr the memory attributes to apply to the map
+    ///
+    void enable_demand_mapping(
+        gsl::not_null<ept::mmap *> map,
+        const ept::memory_map_t &memory_map,
+        uint64_t max_page_size = ::intel_x64::ept::pdpt::page_size,
+        ept::mmap::attr_type attr = ept::mmap::attr_type::read_write_execute);
+
+    /// Disable Demand Mapping
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable_demand_mapping();
+
+    /// Demand Mapped
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of bytes this handler has mapped on
+    ///     demand
+    ///
+    uint64_t demand_mapped() const noexcept
+    { return m_demand_mapped; }
+
+    /// Is Demand Mapping Enabled
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns true if demand mapping is enabled, false otherwise
+    ///
+    bool is_demand_mapping_enabled() const noexcept
+    { return m_demand_map != nullptr; }
+
     /// Dump Log
     ///
     /// Example:
@@ -148,6 +210,7 @@ private:
     /// @cond
 
     bool handle(gsl::not_null<vmcs_t *> vmcs);
+    bool handle_demand(uint64_t gpa);
 
     bool handle_read(gsl::not_null<vmcs_t *> vmcs, info_t &info);
     bool handle_write(gsl::not_null<vmcs_t *> vmcs, info_t &info);
@@ -157,12 +220,16 @@ private:
 
 private:
 
-    gsl::not_null<exit_handler_t *> m_exit_handler;
-
     std::list<handler_delegate_t> m_read_handlers;
     std::list<handler_delegate_t> m_write_handlers;
     std::list<handler_delegate_t> m_execute_handlers;
 
+    ept::mmap *m_demand_map{nullptr};
+    std::vector<std::pair<uintptr_t, uintptr_t>> m_demand_ranges;
+    uint64_t m_demand_max_page_size{0};
+    ept::mmap::attr_type m_demand_attr{ept::mmap::attr_type::read_write_execute};
+    uint64_t m_demand_mapped{0};
+
 private:
 
     struct record_t {
@@ -141,7 +141,6 @@ public:
 
 private:
 
-    gsl::not_null<exit_handler_t *> m_exit_handler;
     std::array<std::list<handler_delegate_t>, 256> m_handlers;
 
     std::array<uint64_t, 256> m_log;
@@ -253,7 +253,6 @@ private:
     void store_operand(gsl::not_null<vmcs_t *> vmcs, info_t &info);
 
     gsl::span<uint8_t> m_io_bitmaps;
-    gsl::not_null<exit_handler_t *> m_exit_handler;
 
     std::unordered_map<vmcs_n::value_type, std::list<handler_delegate_t>> m_in_handlers;
     std::unordered_map<vmcs_n::value_type, std::list<handler_delegate_t>> m_out_handlers;
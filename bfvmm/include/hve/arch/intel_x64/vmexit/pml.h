@@ -0,0 +1,222 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#ifndef PML_INTEL_X64_EAPIS_H
+#define PML_INTEL_X64_EAPIS_H
+
+#include <vector>
+
+#include "../base.h"
+
+// -----------------------------------------------------------------------------
+// Definitions
+// -----------------------------------------------------------------------------
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+class vcpu;
+
+/// Page Modification Logging
+///
+/// Provides an interface for collecting the guest physical addresses of the
+/// pages the guest writes to. With PML enabled, every time the CPU sets the
+/// dirty flag of an EPT entry, it writes the guest physical address of the
+/// page into a 512 entry log page. When the log is full, a
+/// page-modification log full exit occurs, and the log is drained into a
+/// dirty ring that consumers pull from in batches. The cost of tracking
+/// dirty memory is thus proportional to the number of pages dirtied, and
+/// not to the size of the guest.
+///
+/// Note that the CPU only logs a page when its dirty flag changes from 0
+/// to 1. Once a page has been pulled from the dirty ring, its dirty flag
+/// must be cleared (e.g. using ept::mmap::harvest_dirty()) for future
+/// writes to be logged again.
+///
+class EXPORT_EAPIS_HVE pml_handler : public base
+{
+public:
+
+    /// Log Size
+    ///
+    /// The number of guest physical addresses the PML log page holds
+    ///
+    constexpr static const uint64_t log_size = 512;
+
+    /// Default Ring Size
+    ///
+    /// The number of guest physical addresses the dirty ring holds by
+    /// default
+    ///
+    constexpr static const uint64_t default_ring_size = 4096;
+
+    /// Constructor
+    ///
+    /// @expects ring_size != 0
+    /// @ensures
+    ///
+    /// @param vcpu the vcpu object for this PML handler
+    /// @param ring_size the number of guest physical addresses the dirty
+    ///     ring can hold before addresses are dropped
+    ///
+    pml_handler(
+        gsl::not_null<eapis::intel_x64::vcpu *> vcpu,
+        uint64_t ring_size = default_ring_size);
+
+    /// Destructor
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    ~pml_handler() final = default;
+
+public:
+
+    /// Enable
+    ///
+    /// @expects the CPU supports PML, and EPT is enabled with accessed and
+    ///     dirty flags enabled
+    /// @ensures
+    ///
+    void enable();
+
+    /// Disable
+    ///
+    /// Disables PML. Any addresses left in the PML log are moved into the
+    /// dirty ring first.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void disable();
+
+    /// Flush
+    ///
+    /// Moves the addresses currently in the PML log into the dirty ring,
+    /// and resets the log. The log is only drained automatically when it is
+    /// full, so this should be called (from this vCPU) before pulling if
+    /// the most recent writes are needed.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void flush();
+
+    /// Pull
+    ///
+    /// Removes up to max_entries guest physical addresses from the dirty
+    /// ring, oldest first. The same page may appear more than once if its
+    /// dirty flag was cleared and it was written to again.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @param max_entries the maximum number of addresses to return
+    /// @return Returns the (4k aligned) guest physical addresses that were
+    ///     removed from the ring
+    ///
+    std::vector<uintptr_t> pull(uint64_t max_entries);
+
+    /// Size
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of addresses in the dirty ring
+    ///
+    uint64_t size() const noexcept
+    { return m_count; }
+
+    /// Dropped
+    ///
+    /// Returns the number of addresses that were dropped because the dirty
+    /// ring was full. If this is not 0, the dirty ring is incomplete and the
+    /// consumer should fall back to scanning the EPT dirty flags (see
+    /// ept::mmap::harvest_dirty()), and then reset the count.
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    /// @return Returns the number of addresses that were dropped
+    ///
+    uint64_t dropped() const noexcept
+    { return m_dropped; }
+
+    /// Reset Dropped
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void reset_dropped() noexcept
+    { m_dropped = 0; }
+
+public:
+
+    /// Dump Log
+    ///
+    /// Example:
+    /// @code
+    /// this->dump_log();
+    /// @endcode
+    ///
+    /// @expects
+    /// @ensures
+    ///
+    void dump_log() final;
+
+public:
+
+    /// @cond
+
+    bool handle(gsl::not_null<vmcs_t *> vmcs);
+
+    /// @endcond
+
+private:
+
+    void push(uintptr_t gpa);
+
+private:
+
+    std::unique_ptr<uintptr_t[]> m_log;
+
+    std::vector<uintptr_t> m_ring;
+    uint64_t m_head{0};
+    uint64_t m_count{0};
+    uint64_t m_dropped{0};
+    uint64_t m_num_full_exits{0};
+
+public:
+
+    /// @cond
+
+    pml_handler(pml_handler &&) = default;
+    pml_handler &operator=(pml_handler &&) = default;
+
+    pml_handler(const pml_handler &) = delete;
+    pml_handler &operator=(const pml_handler &) = delete;
+
+    /// @endcond
+};
+
+}
+}
+
+#endif
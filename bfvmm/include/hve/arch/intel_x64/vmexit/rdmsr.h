@@ -212,7 +212,6 @@ public:
 private:
 
     gsl::span<uint8_t> m_msr_bitmap;
-    gsl::not_null<exit_handler_t *> m_exit_handler;
 
     std::unordered_map<vmcs_n::value_type, std::list<handler_delegate_t>> m_handlers;
 
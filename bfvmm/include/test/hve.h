@@ -24,6 +24,47 @@ using namespace eapis::intel_x64;
 constexpr auto uc = ept::mmap::memory_type::uncacheable;
 constexpr auto wb = ept::mmap::memory_type::write_back;
 
+constexpr auto ept_vpid_cap = ::intel_x64::msrs::ia32_vmx_ept_vpid_cap::addr;
+constexpr auto vmfunc_cap = ::intel_x64::msrs::ia32_vmx_vmfunc::addr;
+constexpr auto all_caps = 0xFFFFFFFFFFFFFFFFULL;
+
+/// Scoped MSR
+///
+/// Sets an MSR (e.g. one of the VMX capability MSRs) for as long as this
+/// object is alive, and puts the previous value back once it is destroyed,
+/// so that a test that fails part way through does not leave the value
+/// behind for the tests that follow it.
+///
+class scoped_msr
+{
+public:
+
+    scoped_msr(uint32_t addr, uint64_t val) :
+        m_addr{addr},
+        m_val{g_msrs[addr]}
+    { g_msrs[addr] = val; }
+
+    ~scoped_msr()
+    { g_msrs[m_addr] = m_val; }
+
+private:
+
+    uint32_t m_addr;
+    uint64_t m_val;
+
+public:
+
+    /// @cond
+
+    scoped_msr(scoped_msr &&) = delete;
+    scoped_msr &operator=(scoped_msr &&) = delete;
+
+    scoped_msr(const scoped_msr &) = delete;
+    scoped_msr &operator=(const scoped_msr &) = delete;
+
+    /// @endcond
+};
+
 static inline auto
 base_to_physbase(uint64_t addr)
 {
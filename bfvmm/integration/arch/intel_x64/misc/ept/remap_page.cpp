@@ -103,8 +103,20 @@ public:
                 gpa1_2m
             );
 
-            auto &pte = g_guest_map.entry(gpa1_4k);
-            ::intel_x64::ept::pt::entry::phys_addr::set(pte, gpa2_4k);
+            // The CPU may set the accessed / dirty flags of the entry
+            // between reading and updating it, in which case the update
+            // fails and has to be redone with the new value
+            //
+            ept::mmap::entry_type pte;
+            ept::mmap::entry_type new_pte;
+
+            do {
+                pte = g_guest_map.entry(gpa1_4k);
+                new_pte = pte;
+
+                ::intel_x64::ept::pt::entry::phys_addr::set(new_pte, gpa2_4k);
+            }
+            while (!g_guest_map.update_entry(gpa1_4k, pte, new_pte));
         });
 
         this->set_eptp(g_guest_map);
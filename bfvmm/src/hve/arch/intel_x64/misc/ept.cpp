@@ -34,12 +34,21 @@ void ept_handler::set_eptp(ept::mmap *map)
 
         if (!m_enabled) {
             vmcs_n::ept_pointer::memory_type::set(vmcs_n::ept_pointer::memory_type::write_back);
-            vmcs_n::ept_pointer::accessed_and_dirty_flags::disable();
             vmcs_n::ept_pointer::page_walk_length_minus_one::set(3U);
 
             vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::enable();
             m_enabled = true;
         }
+
+        if (m_accessed_and_dirty) {
+            vmcs_n::ept_pointer::accessed_and_dirty_flags::enable();
+        }
+        else {
+            vmcs_n::ept_pointer::accessed_and_dirty_flags::disable();
+        }
+
+        m_generation = map->generation();
+        m_stale = true;
     }
     else {
         if (m_enabled) {
@@ -48,7 +57,203 @@ void ept_handler::set_eptp(ept::mmap *map)
         }
 
         vmcs_n::ept_pointer::set(0);
+        m_stale = false;
+    }
+
+    m_map = map;
+}
+
+void ept_handler::enable_accessed_and_dirty_flags()
+{
+    expects(::intel_x64::msrs::ia32_vmx_ept_vpid_cap::accessed_dirty_support::is_enabled());
+    m_accessed_and_dirty = true;
+
+    if (m_enabled) {
+        vmcs_n::ept_pointer::accessed_and_dirty_flags::enable();
+        m_stale = true;
+    }
+
+    for (auto &view : m_views) {
+        m_eptp_list[view.index] = this->eptp(view.map);
+        view.stale = true;
+    }
+}
+
+void ept_handler::disable_accessed_and_dirty_flags()
+{
+    m_accessed_and_dirty = false;
+
+    if (m_enabled) {
+        vmcs_n::ept_pointer::accessed_and_dirty_flags::disable();
+        m_stale = true;
+    }
+
+    for (auto &view : m_views) {
+        m_eptp_list[view.index] = this->eptp(view.map);
+        view.stale = true;
+    }
+}
+
+void ept_handler::add_view(uint64_t index, gsl::not_null<ept::mmap *> map)
+{
+    expects(index < max_views);
+
+    if (!m_eptp_list) {
+        m_eptp_list = std::make_unique<uintptr_t[]>(max_views);
+    }
+
+    if (auto view = this->find_view(index)) {
+        *view = {index, map, map->generation(), true};
+    }
+    else {
+        m_views.push_back({index, map, map->generation(), true});
+    }
+
+    m_eptp_list[index] = this->eptp(map);
+}
+
+void ept_handler::remove_view(uint64_t index)
+{
+    expects(index < max_views);
+
+    auto iter = std::find_if(m_views.begin(), m_views.end(), [&](const auto & view) {
+        return view.index == index;
+    });
+
+    if (iter == m_views.end()) {
+        return;
+    }
+
+    expects(!m_vmfunc || index != vmcs_n::eptp_index::get());
+
+    m_eptp_list[index] = 0;
+    m_views.erase(iter);
+}
+
+void ept_handler::enable_vmfunc()
+{
+    expects(m_enabled);
+    expects(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vm_functions::is_allowed1());
+    expects(::intel_x64::msrs::ia32_vmx_vmfunc::eptp_switching::is_enabled());
+
+    if (!m_eptp_list) {
+        m_eptp_list = std::make_unique<uintptr_t[]>(max_views);
+    }
+
+    vmcs_n::eptp_list_address::set(g_mm->virtptr_to_physint(m_eptp_list.get()));
+    vmcs_n::vm_function_controls::eptp_switching::enable();
+    vmcs_n::secondary_processor_based_vm_execution_controls::enable_vm_functions::enable();
+
+    m_vmfunc = true;
+}
+
+void ept_handler::disable_vmfunc()
+{
+    if (!m_vmfunc) {
+        return;
+    }
+
+    vmcs_n::secondary_processor_based_vm_execution_controls::enable_vm_functions::disable();
+    vmcs_n::vm_function_controls::eptp_switching::disable();
+
+    m_vmfunc = false;
+}
+
+void ept_handler::set_view(uint64_t index)
+{
+    auto view = this->find_view(index);
+    expects(view != nullptr);
+
+    this->set_eptp(view->map);
+    vmcs_n::eptp_index::set(index);
+}
+
+uint64_t ept_handler::current_view() const
+{
+    expects(m_vmfunc);
+    return vmcs_n::eptp_index::get();
+}
+
+bool ept_handler::has_holes() const
+{
+    if (m_map != nullptr && m_map->has_holes()) {
+        return true;
+    }
+
+    for (const auto &view : m_views) {
+        if (view.map->has_holes()) {
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool ept_handler::sync()
+{
+    auto flushed = false;
+
+    if (m_map != nullptr) {
+        auto generation = m_map->generation();
+
+        if (m_stale || generation != m_generation) {
+            ::intel_x64::vmx::invept_single_context(this->eptp(m_map));
+
+            m_generation = generation;
+            m_stale = false;
+            flushed = true;
+        }
+    }
+
+    // Note that INVEPT can be given any EPTP, and not only the current
+    // one, which is what allows the views the guest is not using right now
+    // to be flushed as well.
+    //
+    for (auto &view : m_views) {
+        if (view.map == m_map) {
+            view.generation = m_generation;
+            view.stale = false;
+            continue;
+        }
+
+        auto generation = view.map->generation();
+
+        if (view.stale || generation != view.generation) {
+            ::intel_x64::vmx::invept_single_context(this->eptp(view.map));
+
+            view.generation = generation;
+            view.stale = false;
+            flushed = true;
+        }
+    }
+
+    return flushed;
+}
+
+uintptr_t ept_handler::eptp(ept::mmap *map) const
+{
+    using namespace vmcs_n::ept_pointer;
+
+    auto eptp = map->eptp();
+    eptp |= (memory_type::write_back << memory_type::from) & memory_type::mask;
+    eptp |= (3ULL << page_walk_length_minus_one::from) & page_walk_length_minus_one::mask;
+
+    if (m_accessed_and_dirty) {
+        eptp |= accessed_and_dirty_flags::mask;
+    }
+
+    return eptp;
+}
+
+ept_handler::view_type *ept_handler::find_view(uint64_t index)
+{
+    for (auto &view : m_views) {
+        if (view.index == index) {
+            return &view;
+        }
     }
+
+    return nullptr;
 }
 
 }
@@ -0,0 +1,48 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+ve_handler::ve_handler() :
+    m_page{std::make_unique<uintptr_t[]>(::x64::pt::page_size / sizeof(uintptr_t))},
+    m_info{reinterpret_cast<info_type *>(m_page.get())},
+    m_phys_addr{g_mm->virtptr_to_physint(m_page.get())}
+{ }
+
+void ve_handler::enable()
+{
+    using namespace vmcs_n::secondary_processor_based_vm_execution_controls;
+
+    expects(enable_ept::is_enabled());
+    expects(ept_violation_ve::is_allowed1());
+
+    vmcs_n::virtualization_exception_information_address::set(m_phys_addr);
+    vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::enable();
+}
+
+void ve_handler::disable()
+{ vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::disable(); }
+
+}
+}
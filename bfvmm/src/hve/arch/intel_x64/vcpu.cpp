@@ -25,7 +25,48 @@ namespace intel_x64
 
 vcpu::vcpu(vcpuid::type id) :
     bfvmm::intel_x64::vcpu{id}
-{ }
+{
+    for (auto reason = 0ULL; reason < s_num_exit_reasons; reason++) {
+        this->exit_handler()->add_handler(
+            reason, ::handler_delegate_t::create<vcpu, &vcpu::handle_exit>(this)
+        );
+    }
+}
+
+//==========================================================================
+// VMExits
+//==========================================================================
+
+void vcpu::add_exit_handler(
+    vmcs_n::value_type reason, const ::handler_delegate_t &d)
+{ m_exit_handlers.at(reason).push_front(d); }
+
+bool vcpu::handle_exit(gsl::not_null<vmcs_t *> vmcs)
+{
+    auto handled = false;
+    const auto reason = vmcs_n::exit_reason::basic_exit_reason::get();
+
+    if (reason < s_num_exit_reasons) {
+        for (const auto &d : m_exit_handlers.at(reason)) {
+            if (d(vmcs)) {
+                handled = true;
+                break;
+            }
+        }
+    }
+
+    // This is called for every exit, and the guest is resumed next, either
+    // by the caller if the exit was handled, or by one of the handlers
+    // registered with the base exit handler during its construction if it
+    // was not. Those do not look at the EPT, so anything an EAPIs handler,
+    // or another vCPU sharing the map, did to it must be flushed now.
+    //
+    if (m_ept_handler) {
+        m_ept_handler->sync();
+    }
+
+    return handled;
+}
 
 //==========================================================================
 // MISC
@@ -80,6 +121,61 @@ void vcpu::disable_vpid()
     }
 }
 
+//--------------------------------------------------------------------------
+// PML
+//--------------------------------------------------------------------------
+
+gsl::not_null<pml_handler *> vcpu::pml()
+{ return m_pml_handler.get(); }
+
+void vcpu::enable_pml()
+{
+    this->ept()->enable_accessed_and_dirty_flags();
+
+    if (!m_pml_handler) {
+        m_pml_handler = std::make_unique<eapis::intel_x64::pml_handler>(this);
+    }
+
+    m_pml_handler->enable();
+}
+
+void vcpu::disable_pml()
+{
+    if (m_pml_handler) {
+        m_pml_handler->disable();
+    }
+}
+
+//--------------------------------------------------------------------------
+// #VE
+//--------------------------------------------------------------------------
+
+gsl::not_null<ve_handler *> vcpu::ve()
+{ return m_ve_handler.get(); }
+
+void vcpu::enable_ve()
+{
+    // Violations on addresses that are not mapped are delivered to the
+    // guest as a #VE, so they would never reach the demand mapping code
+    // or the EPT violation handlers
+    //
+    expects(!m_ept_violation_handler || !m_ept_violation_handler->is_demand_mapping_enabled());
+    expects(!this->ept()->has_holes());
+
+    if (!m_ve_handler) {
+        m_ve_handler = std::make_unique<eapis::intel_x64::ve_handler>();
+    }
+
+    m_ve_handler->enable();
+}
+
+void vcpu::disable_ve()
+{
+    if (m_ve_handler) {
+        m_ve_handler->disable();
+    }
+}
+
 //==========================================================================
 // VMExit
 //==========================================================================
@@ -212,6 +308,21 @@ void vcpu::add_ept_execute_violation_handler(
     m_ept_violation_handler->add_execute_handler(std::move(d));
 }
 
+void vcpu::enable_ept_demand_mapping(
+    ept::mmap &map,
+    const ept::memory_map_t &memory_map,
+    uint64_t max_page_size,
+    ept::mmap::attr_type attr)
+{
+    expects(vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::is_disabled());
+
+    if (!m_ept_violation_handler) {
+        m_ept_violation_handler = std::make_unique<eapis::intel_x64::ept_violation_handler>(this);
+    }
+
+    m_ept_violation_handler->enable_demand_mapping(&map, memory_map, max_page_size, attr);
+}
+
 //--------------------------------------------------------------------------
 // External Interrupt
 //--------------------------------------------------------------------------
@@ -31,12 +31,11 @@ default_handler(
 
 control_register_handler::control_register_handler(
     gsl::not_null<eapis::intel_x64::vcpu *> vcpu
-) :
-    m_exit_handler{vcpu->exit_handler()}
+)
 {
     using namespace vmcs_n;
 
-    m_exit_handler->add_handler(
+    vcpu->add_exit_handler(
         exit_reason::basic_exit_reason::control_register_accesses,
         ::handler_delegate_t::create<control_register_handler, &control_register_handler::handle>(this)
     );
@@ -26,12 +26,11 @@ namespace intel_x64
 
 cpuid_handler::cpuid_handler(
     gsl::not_null<eapis::intel_x64::vcpu *> vcpu
-) :
-    m_exit_handler{vcpu->exit_handler()}
+)
 {
     using namespace vmcs_n;
 
-    m_exit_handler->add_handler(
+    vcpu->add_exit_handler(
         exit_reason::basic_exit_reason::cpuid,
         ::handler_delegate_t::create<cpuid_handler, &cpuid_handler::handle>(this)
     );
@@ -26,12 +26,11 @@ namespace intel_x64
 
 ept_violation_handler::ept_violation_handler(
     gsl::not_null<eapis::intel_x64::vcpu *> vcpu
-) :
-    m_exit_handler{vcpu->exit_handler()}
+)
 {
     using namespace vmcs_n;
 
-    m_exit_handler->add_handler(
+    vcpu->add_exit_handler(
         exit_reason::basic_exit_reason::ept_violation,
         ::handler_delegate_t::create<ept_violation_handler, &ept_violation_handler::handle>(this)
     );
@@ -56,6 +55,32 @@ void
 ept_violation_handler::add_execute_handler(handler_delegate_t &&d)
 { m_execute_handlers.push_front(d); }
 
+void
+ept_violation_handler::enable_demand_mapping(
+    gsl::not_null<ept::mmap *> map,
+    const ept::memory_map_t &memory_map,
+    uint64_t max_page_size,
+    ept::mmap::attr_type attr)
+{
+    expects(
+        max_page_size == ::intel_x64::ept::pt::page_size ||
+        max_page_size == ::intel_x64::ept::pd::page_size ||
+        max_page_size == ::intel_x64::ept::pdpt::page_size
+    );
+
+    m_demand_map = map;
+    m_demand_ranges = ept::memory_map_ranges(memory_map);
+    m_demand_max_page_size = max_page_size;
+    m_demand_attr = attr;
+}
+
+void
+ept_violation_handler::disable_demand_mapping()
+{
+    m_demand_map = nullptr;
+    m_demand_ranges.clear();
+}
+
 void
 ept_violation_handler::dump_log()
 {
@@ -92,6 +117,10 @@ ept_violation_handler::handle(gsl::not_null<vmcs_t *> vmcs)
         add_record(m_log, {info.gva, info.gpa, info.exit_qualification});
     }
 
+    if (m_demand_map != nullptr && this->handle_demand(info.gpa)) {
+        return true;
+    }
+
     if (exit_qualification::ept_violation::data_read::is_enabled(qual)) {
         return handle_read(vmcs, info);
     }
@@ -109,6 +138,43 @@ ept_violation_handler::handle(gsl::not_null<vmcs_t *> vmcs)
     );
 }
 
+bool
+ept_violation_handler::handle_demand(uint64_t gpa)
+{
+    auto range = std::upper_bound(
+                     m_demand_ranges.begin(), m_demand_ranges.end(), gpa,
+                     [](auto addr, const auto &r) { return addr < r.first; }
+                 );
+
+    if (range == m_demand_ranges.begin() || gpa >= (--range)->second) {
+        return false;
+    }
+
+    // If the page cannot be mapped (e.g. no memory is left for the page
+    // tables), or if nothing was mapped because the address is already
+    // mapped (e.g. the access itself is not allowed, or another vCPU mapped
+    // it first), the violation is passed on to the registered handlers
+    // instead of being reported as handled.
+    //
+    try {
+        auto mapped = ept::identity_map_page(
+                          *m_demand_map, *g_mtrrs, gpa, range->first, range->second,
+                          m_demand_max_page_size, m_demand_attr
+                      );
+
+        if (mapped == 0) {
+            return false;
+        }
+
+        m_demand_mapped += mapped;
+    }
+    catch (...) {
+        return false;
+    }
+
+    return true;
+}
+
 bool
 ept_violation_handler::handle_read(gsl::not_null<vmcs_t *> vmcs, info_t &info)
 {
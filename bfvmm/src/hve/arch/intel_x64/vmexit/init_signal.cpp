@@ -26,12 +26,11 @@ namespace intel_x64
 
 init_signal_handler::init_signal_handler(
     gsl::not_null<eapis::intel_x64::vcpu *> vcpu
-) :
-    m_exit_handler{vcpu->exit_handler()}
+)
 {
     using namespace vmcs_n;
 
-    vcpu->exit_handler()->add_handler(
+    vcpu->add_exit_handler(
         exit_reason::basic_exit_reason::init_signal,
         ::handler_delegate_t::create<init_signal_handler, &init_signal_handler::handle>(this)
     );
@@ -37,12 +37,11 @@ namespace intel_x64
 io_instruction_handler::io_instruction_handler(
     gsl::not_null<eapis::intel_x64::vcpu *> vcpu
 ) :
-    m_io_bitmaps{vcpu->io_bitmaps()},
-    m_exit_handler{vcpu->exit_handler()}
+    m_io_bitmaps{vcpu->io_bitmaps()}
 {
     using namespace vmcs_n;
 
-    m_exit_handler->add_handler(
+    vcpu->add_exit_handler(
         exit_reason::basic_exit_reason::io_instruction,
         ::handler_delegate_t::create<io_instruction_handler, &io_instruction_handler::handle>(this)
     );
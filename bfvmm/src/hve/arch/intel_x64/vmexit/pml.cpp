@@ -0,0 +1,157 @@
+//
+// Bareflank Extended APIs
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <bfdebug.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+namespace eapis
+{
+namespace intel_x64
+{
+
+// The PML index counts down from 511, and the CPU decrements it after each
+// write to the log. An index outside of the log (i.e. one that has
+// wrapped) means the log is full.
+//
+constexpr const uint64_t pml_index_start = pml_handler::log_size - 1;
+
+pml_handler::pml_handler(
+    gsl::not_null<eapis::intel_x64::vcpu *> vcpu,
+    uint64_t ring_size
+) :
+    m_log{std::make_unique<uintptr_t[]>(log_size)},
+    m_ring(ring_size)
+{
+    using namespace vmcs_n;
+    expects(ring_size != 0);
+
+    vcpu->add_exit_handler(
+        exit_reason::basic_exit_reason::page_modification_log_full,
+        ::handler_delegate_t::create<pml_handler, &pml_handler::handle>(this)
+    );
+
+    pml_address::set(g_mm->virtptr_to_physint(m_log.get()));
+    guest_pml_index::set(pml_index_start);
+}
+
+// -----------------------------------------------------------------------------
+// PML
+// -----------------------------------------------------------------------------
+
+void
+pml_handler::enable()
+{
+    using namespace vmcs_n;
+    expects(secondary_processor_based_vm_execution_controls::enable_pml::is_allowed1());
+
+    secondary_processor_based_vm_execution_controls::enable_pml::enable();
+}
+
+void
+pml_handler::disable()
+{
+    using namespace vmcs_n;
+
+    secondary_processor_based_vm_execution_controls::enable_pml::disable();
+    this->flush();
+}
+
+void
+pml_handler::flush()
+{
+    using namespace vmcs_n;
+
+    auto index = guest_pml_index::get();
+    auto first = index > pml_index_start ? 0 : index + 1;
+
+    for (auto i = pml_index_start + 1; i > first; i--) {
+        this->push(bfn::upper(m_log[i - 1], ::intel_x64::ept::pt::from));
+    }
+
+    guest_pml_index::set(pml_index_start);
+}
+
+std::vector<uintptr_t>
+pml_handler::pull(uint64_t max_entries)
+{
+    auto num = std::min(max_entries, m_count);
+    std::vector<uintptr_t> gpas;
+
+    gpas.reserve(num);
+    for (auto i = 0ULL; i < num; i++) {
+        gpas.push_back(m_ring[m_head]);
+        m_head = (m_head + 1) % m_ring.size();
+    }
+
+    m_count -= num;
+    return gpas;
+}
+
+void
+pml_handler::push(uintptr_t gpa)
+{
+    if (m_count == m_ring.size()) {
+        m_dropped++;
+        return;
+    }
+
+    m_ring[(m_head + m_count) % m_ring.size()] = gpa;
+    m_count++;
+}
+
+// -----------------------------------------------------------------------------
+// Debug
+// -----------------------------------------------------------------------------
+
+void
+pml_handler::dump_log()
+{
+    bfdebug_transaction(0, [&](std::string * msg) {
+        bfdebug_lnbr(0, msg);
+        bfdebug_info(0, "pml log", msg);
+        bfdebug_brk2(0, msg);
+
+        bfdebug_subndec(0, "log full exits", m_num_full_exits, msg);
+        bfdebug_subndec(0, "ring size", m_ring.size(), msg);
+        bfdebug_subndec(0, "ring entries", m_count, msg);
+        bfdebug_subndec(0, "dropped entries", m_dropped, msg);
+
+        bfdebug_lnbr(0, msg);
+    });
+}
+
+// -----------------------------------------------------------------------------
+// Handlers
+// -----------------------------------------------------------------------------
+
+bool
+pml_handler::handle(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+
+    m_num_full_exits++;
+    this->flush();
+
+    // The write that caused the exit has not been performed, so the
+    // guest's instruction pointer must not be advanced.
+    //
+    return true;
+}
+
+}
+}
@@ -26,12 +26,11 @@ namespace intel_x64
 
 sipi_handler::sipi_handler(
     gsl::not_null<eapis::intel_x64::vcpu *> vcpu
-) :
-    m_exit_handler{vcpu->exit_handler()}
+)
 {
     using namespace vmcs_n;
 
-    vcpu->exit_handler()->add_handler(
+    vcpu->add_exit_handler(
         exit_reason::basic_exit_reason::sipi,
         ::handler_delegate_t::create<sipi_handler, &sipi_handler::handle>(this)
     );
@@ -27,12 +27,11 @@ namespace intel_x64
 wrmsr_handler::wrmsr_handler(
     gsl::not_null<eapis::intel_x64::vcpu *> vcpu
 ) :
-    m_msr_bitmap{vcpu->msr_bitmap()},
-    m_exit_handler{vcpu->exit_handler()}
+    m_msr_bitmap{vcpu->msr_bitmap()}
 {
     using namespace vmcs_n;
 
-    m_exit_handler->add_handler(
+    vcpu->add_exit_handler(
         exit_reason::basic_exit_reason::wrmsr,
         ::handler_delegate_t::create<wrmsr_handler, &wrmsr_handler::handle>(this)
     );
@@ -0,0 +1,245 @@
+//
+// Bareflank Hypervisor
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <cstdlib>
+#include <map>
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/misc/ept.h>
+
+using namespace eapis::intel_x64;
+
+// The memory manager is mocked so that virtual addresses are also physical
+// addresses, which makes it possible to control whether a chunk is
+// physically aligned.
+//
+static std::map<void *, void *> g_chunks;
+static bool g_chunk_misaligned = false;
+static bool g_chunk_fail = false;
+
+static void *
+chunk_alloc(size_t size)
+{
+    if (g_chunk_fail) {
+        return nullptr;
+    }
+
+    auto alloc = static_cast<uint8_t *>(aligned_alloc(size, size * 2));
+    auto chunk = g_chunk_misaligned ? alloc + 0x1000 : alloc;
+
+    std::fill(chunk, chunk + size, 0xFF);
+    g_chunks[chunk] = alloc;
+
+    return chunk;
+}
+
+static void
+chunk_free(void *chunk)
+{
+    auto iter = g_chunks.find(chunk);
+    REQUIRE(iter != g_chunks.end());
+
+    free(iter->second);
+    g_chunks.erase(iter);
+}
+
+static auto
+setup_mm(MockRepository &mocks)
+{
+    g_chunk_misaligned = false;
+    g_chunk_fail = false;
+
+    auto mm = mocks.Mock<bfvmm::memory_manager>();
+    mocks.OnCallFunc(bfvmm::memory_manager::instance).Return(mm);
+    mocks.OnCall(mm, bfvmm::memory_manager::alloc).Do(chunk_alloc);
+    mocks.OnCall(mm, bfvmm::memory_manager::free).Do(chunk_free);
+    mocks.OnCall(mm, bfvmm::memory_manager::virtptr_to_physint).Do([](auto ptr) {
+        return reinterpret_cast<uintptr_t>(ptr);
+    });
+    mocks.OnCall(mm, bfvmm::memory_manager::physint_to_virtptr).Do([](auto phys) {
+        return reinterpret_cast<void *>(phys);
+    });
+
+    return mm;
+}
+
+TEST_CASE("guest memory: invalid max page size")
+{
+    MockRepository mocks;
+    setup_mm(mocks);
+
+    ept::mmap mmap{};
+    CHECK_THROWS(ept::guest_memory(&mmap, 0x3000));
+}
+
+TEST_CASE("guest memory: invalid range")
+{
+    MockRepository mocks;
+    setup_mm(mocks);
+
+    ept::mmap mmap{};
+    ept::guest_memory mem{&mmap};
+
+    CHECK_THROWS(mem.map(0x200000, 0));
+    CHECK_THROWS(mem.map(0x200001, 0x1000));
+    CHECK_THROWS(mem.map(0x200000, 0x1001));
+
+    mmap.map_4k(0x201000, 0x0);
+    CHECK_THROWS(mem.map(0x200000, 0x200000));
+    CHECK(mem.size() == 0);
+    CHECK(g_chunks.empty());
+}
+
+TEST_CASE("guest memory: 2m chunks")
+{
+    MockRepository mocks;
+    setup_mm(mocks);
+
+    ept::mmap mmap{};
+
+    {
+        ept::guest_memory mem{&mmap};
+        mem.map(0x1FE000, 0x404000);
+
+        CHECK(mem.stats().mapped_2m == 2);
+        CHECK(mem.stats().mapped_4k == 4);
+        CHECK(mem.stats().chunks == 2);
+        CHECK(mem.stats().failed_chunks == 0);
+        CHECK(mem.stats().fragmented_chunks == 0);
+        CHECK(mem.size() == 0x404000);
+        CHECK(mem.large_page_percent() == 99);
+        CHECK(g_chunks.size() == 2);
+
+        CHECK(mmap.try_virt_to_phys(0x1FE000).page_size == 0x1000);
+        CHECK(mmap.try_virt_to_phys(0x200000).page_size == 0x200000);
+        CHECK(mmap.try_virt_to_phys(0x5FFFFF).page_size == 0x200000);
+        CHECK(mmap.try_virt_to_phys(0x601000).page_size == 0x1000);
+        CHECK(!mmap.try_virt_to_phys(0x602000));
+
+        auto chunk = static_cast<uint8_t *>(
+            g_mm->physint_to_virtptr(mmap.try_virt_to_phys(0x200000).phys_addr)
+        );
+
+        CHECK(chunk[0] == 0);
+        CHECK(chunk[0x1FFFFF] == 0);
+    }
+
+    CHECK(g_chunks.empty());
+    CHECK(mmap.stats().mapped_2m == 0);
+    CHECK(mmap.stats().mapped_4k == 0);
+}
+
+TEST_CASE("guest memory: fragmented chunks")
+{
+    MockRepository mocks;
+    setup_mm(mocks);
+
+    ept::mmap mmap{};
+
+    {
+        ept::guest_memory mem{&mmap};
+
+        g_chunk_misaligned = true;
+        mem.map(0x200000, 0x400000);
+
+        CHECK(mem.stats().mapped_2m == 0);
+        CHECK(mem.stats().mapped_4k == 1024);
+        CHECK(mem.stats().chunks == 2);
+        CHECK(mem.stats().fragmented_chunks == 2);
+        CHECK(mem.large_page_percent() == 0);
+
+        g_chunk_misaligned = false;
+        mem.map(0x600000, 0x200000);
+
+        CHECK(mem.stats().mapped_2m == 1);
+        CHECK(mem.large_page_percent() == 33);
+    }
+
+    CHECK(g_chunks.empty());
+    CHECK(mmap.stats().mapped_4k == 0);
+}
+
+TEST_CASE("guest memory: failed chunks")
+{
+    MockRepository mocks;
+    setup_mm(mocks);
+
+    ept::mmap mmap{};
+
+    {
+        ept::guest_memory mem{&mmap};
+
+        g_chunk_fail = true;
+        mem.map(0x200000, 0x400000);
+
+        CHECK(mem.stats().mapped_4k == 1024);
+        CHECK(mem.stats().chunks == 0);
+        CHECK(mem.stats().failed_chunks == 1);
+        CHECK(mem.size() == 0x400000);
+        CHECK(mem.large_page_percent() == 0);
+        CHECK(mmap.try_virt_to_phys(0x5FF000).page_size == 0x1000);
+    }
+
+    CHECK(g_chunks.empty());
+    CHECK(mmap.stats().mapped_4k == 0);
+}
+
+TEST_CASE("guest memory: 4k only")
+{
+    MockRepository mocks;
+    setup_mm(mocks);
+
+    ept::mmap mmap{};
+
+    {
+        ept::guest_memory mem{&mmap, 0x1000};
+        mem.map(0x200000, 0x200000, ept::mmap::attr_type::read_write);
+
+        CHECK(mem.stats().mapped_4k == 512);
+        CHECK(mem.stats().failed_chunks == 0);
+        CHECK(g_chunks.empty());
+        CHECK(::intel_x64::ept::pt::entry::execute_access::is_disabled(mmap.try_entry(0x200000)));
+    }
+
+    CHECK(mmap.stats().mapped_4k == 0);
+}
+
+TEST_CASE("guest memory: 1g chunks without 1g support")
+{
+    MockRepository mocks;
+    setup_mm(mocks);
+
+    scoped_msr caps{ept_vpid_cap, 0};
+
+    ept::mmap mmap{};
+
+    {
+        ept::guest_memory mem{&mmap, ::intel_x64::ept::pdpt::page_size};
+        mem.map(0x40000000, 0x400000);
+
+        CHECK(mem.stats().mapped_1g == 0);
+        CHECK(mem.stats().mapped_2m == 2);
+        CHECK(mem.stats().chunks == 2);
+        CHECK(mem.stats().failed_chunks == 0);
+    }
+
+    CHECK(g_chunks.empty());
+}
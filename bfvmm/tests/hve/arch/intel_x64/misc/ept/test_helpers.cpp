@@ -16,6 +16,11 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
 
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
@@ -178,6 +183,34 @@ TEST_CASE("identity_map_convert_2m_to_4k")
     CHECK(mmap.is_2m(::intel_x64::ept::pd::page_size - ::intel_x64::ept::pt::page_size));
 }
 
+TEST_CASE("identity_map_convert attr and cache")
+{
+    using namespace ::intel_x64::ept;
+
+    ept::mmap mmap{};
+    identity_map_1g(mmap, 0, pdpt::page_size * 2);
+
+    identity_map_convert_1g_to_2m(
+        mmap, 0, ept::mmap::attr_type::read_only, ept::mmap::memory_type::uncacheable
+    );
+    CHECK(pd::entry::write_access::is_disabled(mmap.entry(pd::page_size)));
+    CHECK(pd::entry::memory_type::get(mmap.entry(pd::page_size)) == 0);
+
+    identity_map_convert_2m_to_4k(mmap, 0, ept::mmap::attr_type::read_write);
+    CHECK(pt::entry::write_access::is_enabled(mmap.entry(pt::page_size)));
+    CHECK(pt::entry::execute_access::is_disabled(mmap.entry(pt::page_size)));
+    CHECK(pt::entry::memory_type::get(mmap.entry(pt::page_size)) == 6);
+    CHECK(pd::entry::write_access::is_disabled(mmap.entry(pd::page_size)));
+
+    identity_map_convert_1g_to_4k(
+        mmap, pdpt::page_size, ept::mmap::attr_type::execute_only, ept::mmap::memory_type::write_through
+    );
+    CHECK(pt::entry::read_access::is_disabled(mmap.entry(pdpt::page_size)));
+    CHECK(pt::entry::execute_access::is_enabled(mmap.entry(pdpt::page_size)));
+    CHECK(pt::entry::memory_type::get(mmap.entry(pdpt::page_size)) == 4);
+    CHECK(mmap.verify_occupancy());
+}
+
 TEST_CASE("identity_map")
 {
     using range_t = mtrrs::range_t;
@@ -201,3 +234,461 @@ TEST_CASE("identity_map")
     CHECK(mmap.is_4k(0x7FF000));
     CHECK(mmap.is_2m(0x800000));
 }
+
+TEST_CASE("identity_map uses 1g pages")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    enable_mtrrs(0);
+    mtrrs m{};
+
+    {
+        ept::mmap mmap{};
+        identity_map(mmap, m, 0, 0x8000000000);
+
+        CHECK(mmap.is_4k(nullptr));
+        CHECK(mmap.is_4k(0x100000));
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(mmap.is_2m(0x3FE00000));
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(mmap.is_1g(0x7FC0000000));
+
+        // pml4, pdpt, 1 pd and 1 pt for the first 2m
+        CHECK(g_allocated_pages.size() == 4);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map without 1g support")
+{
+    scoped_msr caps{ept_vpid_cap, 0};
+
+    enable_mtrrs(0);
+    mtrrs m{};
+
+    {
+        ept::mmap mmap{};
+        identity_map(mmap, m, 0, 0x80000000);
+
+        CHECK(mmap.is_2m(0x3FE00000));
+        CHECK(mmap.is_2m(0x40000000));
+        CHECK(mmap.is_2m(0x7FE00000));
+        CHECK(mmap.stats().mapped_1g == 0);
+        CHECK(mmap.stats().mapped_2m == 0x7FE00000);
+
+        CHECK(identity_map_page(mmap, m, 0x80000000, 0x0, 0x100000000) == 0x200000);
+        CHECK(mmap.is_2m(0x80000000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map with 1g aligned mmio hole")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    using range_t = mtrrs::range_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{uc, 0xC0000000, 0x40000000});
+    mtrrs m{};
+
+    {
+        ept::mmap mmap{};
+        identity_map(mmap, m, 0, 0x200000000);
+
+        CHECK(mmap.is_1g(0x80000000));
+        CHECK(mmap.is_1g(0xC0000000));
+        CHECK(mmap.is_1g(0x100000000));
+
+        CHECK(::intel_x64::ept::pdpt::entry::memory_type::get(mmap.entry(0x80000000)) == 6);
+        CHECK(::intel_x64::ept::pdpt::entry::memory_type::get(mmap.entry(0xC0000000)) == 0);
+        CHECK(::intel_x64::ept::pdpt::entry::memory_type::get(mmap.entry(0x100000000)) == 6);
+
+        CHECK(g_allocated_pages.size() == 4);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map with 2m aligned mmio hole")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    using range_t = mtrrs::range_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{uc, 0xFEC00000, 0x200000});
+    mtrrs m{};
+
+    {
+        ept::mmap mmap{};
+        identity_map(mmap, m, 0, 0x200000000);
+
+        CHECK(mmap.is_1g(0x80000000));
+        CHECK(mmap.is_2m(0xC0000000));
+        CHECK(mmap.is_2m(0xFEC00000));
+        CHECK(mmap.is_2m(0xFEE00000));
+        CHECK(mmap.is_1g(0x100000000));
+
+        CHECK(::intel_x64::ept::pd::entry::memory_type::get(mmap.entry(0xFEA00000)) == 6);
+        CHECK(::intel_x64::ept::pd::entry::memory_type::get(mmap.entry(0xFEC00000)) == 0);
+        CHECK(::intel_x64::ept::pd::entry::memory_type::get(mmap.entry(0xFEE00000)) == 6);
+
+        // pml4, pdpt, 2 pds and 1 pt for the first 2m
+        CHECK(g_allocated_pages.size() == 5);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map with 4k aligned mmio hole")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    using range_t = mtrrs::range_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{uc, 0xFEE00000, 0x1000});
+    mtrrs m{};
+
+    {
+        ept::mmap mmap{};
+        identity_map(mmap, m, 0, 0x200000000);
+
+        CHECK(mmap.is_2m(0xFEC00000));
+        CHECK(mmap.is_4k(0xFEE00000));
+        CHECK(mmap.is_4k(0xFEE01000));
+        CHECK(mmap.is_2m(0xFF000000));
+
+        CHECK(::intel_x64::ept::pt::entry::memory_type::get(mmap.entry(0xFEE00000)) == 0);
+        CHECK(::intel_x64::ept::pt::entry::memory_type::get(mmap.entry(0xFEE01000)) == 6);
+
+        // pml4, pdpt, 2 pds and 2 pts
+        CHECK(g_allocated_pages.size() == 6);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map_convert with attributes")
+{
+    ept::mmap mmap{};
+    identity_map_1g(mmap, 0, ::intel_x64::ept::pdpt::page_size);
+
+    identity_map_convert_1g_to_4k(mmap, 0, ept::mmap::attr_type::read_only, uc);
+    CHECK(mmap.is_4k(::intel_x64::ept::pdpt::page_size - ::intel_x64::ept::pt::page_size));
+
+    auto entry = mmap.entry(::intel_x64::ept::pdpt::page_size - ::intel_x64::ept::pt::page_size);
+    CHECK(::intel_x64::ept::pt::entry::read_access::is_enabled(entry));
+    CHECK(::intel_x64::ept::pt::entry::write_access::is_disabled(entry));
+    CHECK(::intel_x64::ept::pt::entry::memory_type::get(entry) == 0);
+}
+
+TEST_CASE("identity_map memory map")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    using type_t = ept::memory_region_t::type_t;
+
+    enable_mtrrs(0);
+    mtrrs m{};
+
+    ept::memory_map_t memory_map = {
+        {type_t::ram, 0x100000000, 0x40000000},
+        {type_t::ram, 0x0, 0x9FC00},
+        {type_t::reserved, 0x9FC00, 0x400},
+        {type_t::reserved, 0xE0000, 0x20000},
+        {type_t::ram, 0x100000, 0x7FF00000},
+        {type_t::unusable, 0x80000000, 0x1000},
+        {type_t::mmio, 0xFEC00000, 0x1000},
+        {type_t::mmio, 0xFEE00000, 0x400},
+        {type_t::ram, 0x120000000, 0x1000}
+    };
+
+    {
+        ept::mmap mmap{};
+        identity_map(mmap, m, memory_map);
+
+        CHECK(mmap.is_4k(nullptr));
+        CHECK(mmap.is_4k(0x9F000));
+        CHECK_THROWS(mmap.entry(0xA0000));
+        CHECK(mmap.is_4k(0xE0000));
+        CHECK(mmap.is_4k(0x1FF000));
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK_THROWS(mmap.entry(0x80000000));
+        CHECK(mmap.is_4k(0xFEC00000));
+        CHECK_THROWS(mmap.entry(0xFEC01000));
+        CHECK(mmap.is_4k(0xFEE00000));
+        CHECK(mmap.is_1g(0x100000000));
+        CHECK_THROWS(mmap.entry(0x140000000));
+
+        // pml4, pdpt, 2 pds and 3 pts
+        CHECK(g_allocated_pages.size() == 7);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map memory map with mtrrs")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    using range_t = mtrrs::range_t;
+    using type_t = ept::memory_region_t::type_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{uc, 0xC0000000, 0x40000000});
+    mtrrs m{};
+
+    {
+        ept::mmap mmap{};
+        identity_map(mmap, m, {{type_t::ram, 0x80000000, 0x80000000}});
+
+        CHECK(mmap.is_1g(0x80000000));
+        CHECK(mmap.is_1g(0xC0000000));
+        CHECK_THROWS(mmap.entry(0x40000000));
+        CHECK_THROWS(mmap.entry(0x100000000));
+
+        CHECK(::intel_x64::ept::pdpt::entry::memory_type::get(mmap.entry(0x80000000)) == 6);
+        CHECK(::intel_x64::ept::pdpt::entry::memory_type::get(mmap.entry(0xC0000000)) == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("for_each_mtrr_range cursor")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    using range_t = mtrrs::range_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{uc, 0x40000000, 0x40000000});
+    mtrrs m{};
+
+    std::vector<range_t> pieces;
+    auto collect = [&](auto addr, auto size, auto type) {
+        pieces.push_back(range_t{type, addr, size});
+    };
+
+    const mtrrs::range_t *cursor = nullptr;
+
+    ept::for_each_mtrr_range(m, cursor, 0x3FE00000, 0x40200000, collect);
+    REQUIRE(pieces.size() == 2);
+    CHECK(pieces.at(0).type == wb);
+    CHECK(pieces.at(0).size == 0x200000);
+    CHECK(pieces.at(1).type == uc);
+    CHECK(pieces.at(1).base == 0x40000000);
+    CHECK(cursor->type == uc);
+
+    // Continues from the cursor, and starts over when asked for a range
+    // before it
+    //
+    pieces.clear();
+    ept::for_each_mtrr_range(m, cursor, 0x80000000, 0x80200000, collect);
+    REQUIRE(pieces.size() == 1);
+    CHECK(pieces.at(0).type == wb);
+
+    pieces.clear();
+    ept::for_each_mtrr_range(m, cursor, 0x3FE00000, 0x40200000, collect);
+    REQUIRE(pieces.size() == 2);
+    CHECK(pieces.at(0).type == wb);
+    CHECK(pieces.at(1).type == uc);
+}
+
+static void
+parallel_for(size_t num_tasks, const std::function<void(size_t)> &task)
+{
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> threads;
+
+    for (auto t = 0; t < 8; t++) {
+        threads.emplace_back([&] {
+            for (auto i = next++; i < num_tasks; i = next++) {
+                task(i);
+            }
+        });
+    }
+
+    for (auto &thread : threads) {
+        thread.join();
+    }
+}
+
+static void
+check_same_map(ept::mmap &serial, ept::mmap &parallel)
+{
+    auto serial_image = serial.image();
+    auto parallel_image = parallel.image();
+
+    REQUIRE(serial_image.size() == parallel_image.size());
+    for (auto i = 0ULL; i < serial_image.size(); i++) {
+        CHECK(serial_image.at(i).virt_addr == parallel_image.at(i).virt_addr);
+        CHECK(serial_image.at(i).phys_addr == parallel_image.at(i).phys_addr);
+        CHECK(serial_image.at(i).size == parallel_image.at(i).size);
+        CHECK(serial_image.at(i).page_size == parallel_image.at(i).page_size);
+        CHECK(serial_image.at(i).flags == parallel_image.at(i).flags);
+    }
+
+    auto serial_stats = serial.stats();
+    auto parallel_stats = parallel.stats();
+
+    CHECK(serial_stats.num_pdpt_tables == parallel_stats.num_pdpt_tables);
+    CHECK(serial_stats.num_pd_tables == parallel_stats.num_pd_tables);
+    CHECK(serial_stats.num_pt_tables == parallel_stats.num_pt_tables);
+
+    CHECK(!parallel.is_concurrent());
+    CHECK(parallel.verify_occupancy());
+}
+
+TEST_CASE("identity_map_parallel matches identity_map")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    using range_t = mtrrs::range_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{uc, 0xC0000000, 0x40000000});
+    add_variable_range(1, range_t{uc, 0xFEC00000, 0x200000});
+    add_variable_range(2, range_t{uc, 0x1FFFFF000, 0x1000});
+    mtrrs m{};
+
+    {
+        ept::page_pool pool{};
+        ept::mmap serial{};
+        ept::mmap parallel{&pool};
+
+        identity_map(serial, m, 0, 0x10000000000);
+        identity_map_parallel(parallel, m, 0, 0x10000000000, parallel_for);
+
+        check_same_map(serial, parallel);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map_parallel unaligned range")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    enable_mtrrs(0);
+    mtrrs m{};
+
+    {
+        ept::page_pool pool{};
+        ept::mmap serial{};
+        ept::mmap parallel{&pool};
+
+        identity_map(serial, m, 0x3FE00000, 0x140200000);
+        identity_map_parallel(parallel, m, 0x3FE00000, 0x140200000, parallel_for);
+        check_same_map(serial, parallel);
+
+        identity_map_parallel(parallel, m, 0x200000000, 0x200000000, parallel_for);
+        check_same_map(serial, parallel);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map_parallel failure")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    enable_mtrrs(0);
+    mtrrs m{};
+
+    {
+        ept::page_pool pool{};
+        ept::mmap mmap{&pool};
+        mmap.map_4k(0x80001000, 0x80001000);
+
+        CHECK_THROWS(identity_map_parallel(mmap, m, 0x0, 0x100000000, parallel_for));
+        CHECK(!mmap.is_concurrent());
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(mmap.is_1g(0xC0000000));
+        CHECK(mmap.verify_occupancy());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map_parallel parallel_for failure")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    enable_mtrrs(0);
+    mtrrs m{};
+
+    auto throwing_parallel_for = [](auto num_tasks, auto task) {
+        bfignored(num_tasks);
+        bfignored(task);
+
+        throw std::runtime_error("parallel_for failed");
+    };
+
+    {
+        ept::page_pool pool{};
+        ept::mmap mmap{&pool};
+
+        CHECK_THROWS(identity_map_parallel(mmap, m, 0x0, 0x100000000, throwing_parallel_for));
+        CHECK(!mmap.is_concurrent());
+
+        mmap.set_concurrent(true);
+        CHECK_THROWS(identity_map_parallel(mmap, m, 0x0, 0x100000000, throwing_parallel_for));
+        CHECK(mmap.is_concurrent());
+
+        mmap.set_concurrent(false);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map_page")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    using range_t = mtrrs::range_t;
+
+    enable_mtrrs(1);
+    add_variable_range(0, range_t{uc, 0xFEE00000, 0x1000});
+    mtrrs m{};
+
+    {
+        ept::mmap mmap{};
+
+        CHECK(identity_map_page(mmap, m, 0x52345678, 0x0, 0x200000000) == 0x40000000);
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(identity_map_page(mmap, m, 0x52345678, 0x0, 0x200000000) == 0);
+
+        CHECK(identity_map_page(mmap, m, 0x12345678, 0x0, 0x200000000) == 0x200000);
+        CHECK(mmap.is_2m(0x12200000));
+
+        CHECK(identity_map_page(mmap, m, 0x1010, 0x0, 0x200000000) == 0x1000);
+        CHECK(mmap.is_4k(0x1000));
+
+        CHECK(identity_map_page(mmap, m, 0xFEE00010, 0x0, 0x200000000) == 0x1000);
+        CHECK(identity_map_page(mmap, m, 0xFEE01000, 0x0, 0x200000000) == 0x1000);
+        CHECK(identity_map_page(mmap, m, 0xFEC00000, 0x0, 0x200000000) == 0x200000);
+        CHECK(::intel_x64::ept::pt::entry::memory_type::get(mmap.entry(0xFEE00000)) == 0);
+        CHECK(::intel_x64::ept::pt::entry::memory_type::get(mmap.entry(0xFEE01000)) == 6);
+
+        CHECK(identity_map_page(mmap, m, 0x80000000, 0x0, 0x200000000, 0x200000) == 0x200000);
+        CHECK(identity_map_page(mmap, m, 0x100000000, 0x100000000, 0x100201000) == 0x200000);
+        CHECK(identity_map_page(mmap, m, 0x100200000, 0x100000000, 0x100201000) == 0x1000);
+        CHECK_THROWS(mmap.entry(0x100201000));
+
+        CHECK_THROWS(identity_map_page(mmap, m, 0x300000000, 0x0, 0x200000000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("identity_map_page concurrent")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+    enable_mtrrs(0);
+    mtrrs m{};
+
+    {
+        ept::page_pool pool{};
+        ept::mmap mmap{&pool};
+        mmap.set_concurrent(true);
+
+        std::atomic<uint64_t> mapped{0};
+
+        // Every thread touches the same 4k pages of a region that has to be
+        // mapped with 4k pages, so that they race to map each of them.
+        //
+        parallel_for(8, [&](size_t) {
+            for (auto gpa = 0x0ULL; gpa < 0x100000; gpa += 0x1000) {
+                mapped += identity_map_page(mmap, m, gpa, 0x0, 0x100000);
+            }
+        });
+
+        CHECK(mapped == 0x100000);
+        CHECK(mmap.is_4k(0xFF000));
+
+        mmap.set_concurrent(false);
+        CHECK(mmap.verify_occupancy());
+    }
+    CHECK(g_allocated_pages.empty());
+}
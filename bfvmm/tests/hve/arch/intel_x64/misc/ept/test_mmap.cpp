@@ -16,10 +16,15 @@
 // License along with this library; if not, write to the Free Software
 // Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
 
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+
 #include <catch/catch.hpp>
 #include <hippomocks.h>
 
-#include <bfvmm/test/support.h>
+#include <test/support.h>
 #include <hve/arch/intel_x64/misc/ept.h>
 
 using namespace eapis::intel_x64;
@@ -902,3 +907,1872 @@ TEST_CASE("mmap: 4k release range")
     mmap.release(0x3000);
     CHECK(g_allocated_pages.size() == 1);
 }
+
+TEST_CASE("mmap: map range 1g")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_1g(0x40000000, 0x40000000, 0xC0000000);
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(mmap.is_1g(0xC0000000));
+        CHECK(mmap.virt_to_phys(0x80000000) == 0x80000000);
+        CHECK_THROWS(mmap.from(0x100000000));
+        CHECK_THROWS(mmap.from(0x2A));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range 2m")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_2m(0x200000, 0x10000000, 0x600000);
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(mmap.is_2m(0x600000));
+        CHECK(mmap.virt_to_phys(0x400000) == 0x10200000);
+        CHECK_THROWS(mmap.from(0x800000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range 4k")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x1000, 0x10000000, 0x3000);
+        CHECK(mmap.is_4k(0x1000));
+        CHECK(mmap.is_4k(0x3000));
+        CHECK(mmap.virt_to_phys(0x2000) == 0x10001000);
+        CHECK_THROWS(mmap.from(0x4000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range crosses table boundaries")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_range_4k(0x1FF000, 0x1FF000, 0x2000);
+        CHECK(mmap.virt_to_phys(0x1FF000) == 0x1FF000);
+        CHECK(mmap.virt_to_phys(0x200000) == 0x200000);
+
+        mmap.map_range_2m(0x7FE00000, 0x7FE00000, 0x400000);
+        CHECK(mmap.virt_to_phys(0x7FE00000) == 0x7FE00000);
+        CHECK(mmap.virt_to_phys(0x80000000) == 0x80000000);
+
+        mmap.map_range_1g(0x7FC0000000, 0x7FC0000000, 0x80000000);
+        CHECK(mmap.virt_to_phys(0x7FC0000000) == 0x7FC0000000);
+        CHECK(mmap.virt_to_phys(0x8000000000) == 0x8000000000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range uses largest page size")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+
+        mmap.map_range(0x3FFFF000, 0x3FFFF000, 0x40402000);
+        CHECK(mmap.is_4k(0x3FFFF000));
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(mmap.is_2m(0x80000000));
+        CHECK(mmap.is_2m(0x80200000));
+        CHECK(mmap.is_4k(0x80400000));
+        CHECK_THROWS(mmap.from(0x80401000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range without 1g support")
+{
+    scoped_msr caps{ept_vpid_cap, 0};
+
+    {
+        ept::mmap mmap{};
+
+        mmap.map_range(0x40000000, 0x40000000, 0x40000000);
+        CHECK(mmap.is_2m(0x40000000));
+        CHECK(mmap.is_2m(0x7FE00000));
+        CHECK(mmap.stats().mapped_1g == 0);
+        CHECK(mmap.stats().mapped_2m == 0x40000000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range honors phys alignment")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_range(0x40000000, 0x200000, 0x40000000);
+        CHECK(mmap.is_2m(0x40000000));
+        CHECK(mmap.virt_to_phys(0x7FE00000) == 0x40000000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range unaligned fails")
+{
+    {
+        ept::mmap mmap{};
+        CHECK_THROWS(mmap.map_range_1g(0x200000, 0x0, 0x40000000));
+        CHECK_THROWS(mmap.map_range_2m(0x1000, 0x0, 0x200000));
+        CHECK_THROWS(mmap.map_range_4k(0x2A, 0x0, 0x1000));
+        CHECK_THROWS(mmap.map_range_4k(0x1000, 0x2A, 0x1000));
+        CHECK_THROWS(mmap.map_range_4k(0x1000, 0x1000, 0x2A));
+        CHECK_THROWS(mmap.map_range(0x2A, 0x0, 0x1000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range twice fails")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x0, 0x0, 0x4000);
+        CHECK_THROWS(mmap.map_range_4k(0x3000, 0x3000, 0x2000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: map range 4k benchmark", "[.benchmark]")
+{
+    constexpr const auto size = 0x4000000ULL;
+
+    ept::mmap map_per_page{};
+    ept::mmap map_range{};
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto gpa = 0ULL; gpa < size; gpa += ::intel_x64::ept::pt::page_size) {
+        map_per_page.map_4k(gpa, gpa);
+    }
+    auto middle = std::chrono::high_resolution_clock::now();
+    map_range.map_range_4k(0, 0, size);
+    auto end = std::chrono::high_resolution_clock::now();
+
+    for (auto gpa = 0ULL; gpa < size; gpa += ::intel_x64::ept::pt::page_size) {
+        CHECK(map_per_page.entry(gpa) == map_range.entry(gpa));
+    }
+
+    using us = std::chrono::microseconds;
+    bfdebug_ndec(0, "map_4k per page (us)", std::chrono::duration_cast<us>(middle - start).count());
+    bfdebug_ndec(0, "map_range_4k (us)", std::chrono::duration_cast<us>(end - middle).count());
+}
+
+TEST_CASE("mmap: map / lookup benchmark", "[.benchmark]")
+{
+    constexpr const auto size = 0x4000000ULL;
+    constexpr const auto page_size = ::intel_x64::ept::pt::page_size;
+
+    ept::mmap mmap{};
+    uint64_t sum = 0;
+
+    auto start = std::chrono::high_resolution_clock::now();
+    for (auto gpa = 0ULL; gpa < size; gpa += page_size) {
+        mmap.map_4k(gpa, gpa, ept::mmap::attr_type::read_execute, ept::mmap::memory_type::write_through);
+    }
+    auto mapped = std::chrono::high_resolution_clock::now();
+    for (auto gpa = 0ULL; gpa < size; gpa += page_size) {
+        sum += mmap.virt_to_phys(gpa) + mmap.from(gpa) + mmap.entry(gpa);
+    }
+    auto looked_up = std::chrono::high_resolution_clock::now();
+    for (auto gpa = 0ULL; gpa < size; gpa += page_size) {
+        mmap.unmap(gpa);
+    }
+    auto end = std::chrono::high_resolution_clock::now();
+
+    CHECK(sum != 0);
+
+    using us = std::chrono::microseconds;
+    bfdebug_ndec(0, "map_4k (us)", std::chrono::duration_cast<us>(mapped - start).count());
+    bfdebug_ndec(0, "virt_to_phys / from / entry (us)", std::chrono::duration_cast<us>(looked_up - mapped).count());
+    bfdebug_ndec(0, "unmap (us)", std::chrono::duration_cast<us>(end - looked_up).count());
+}
+
+TEST_CASE("mmap: walk cache default size")
+{
+    ept::mmap mmap{};
+    CHECK(mmap.walk_cache_stats().size == ept::mmap::default_walk_cache_size);
+    CHECK(mmap.walk_cache_stats().hits == 0);
+    CHECK(mmap.walk_cache_stats().misses == 0);
+}
+
+TEST_CASE("mmap: walk cache hits when alternating regions")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_4k(0x7FFFF000, 0x7FFFF000);
+        mmap.map_4k(0x100000000, 0x100000000);
+
+        auto stats = mmap.walk_cache_stats();
+        for (auto i = 0; i < 10; i++) {
+            CHECK(mmap.virt_to_phys(0x7FFFF000) == 0x7FFFF000);
+            CHECK(mmap.virt_to_phys(0x100000000) == 0x100000000);
+        }
+
+        CHECK(mmap.walk_cache_stats().hits - stats.hits == 40);
+        CHECK(mmap.walk_cache_stats().misses == stats.misses);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: walk cache skipped for the current tables")
+{
+    {
+        ept::mmap mmap{};
+        mmap.set_walk_cache_size(0);
+
+        mmap.map_4k(0x7FFFE000, 0x7FFFE000);
+        mmap.map_4k(0x7FFFF000, 0x7FFFF000);
+
+        auto stats = mmap.walk_cache_stats();
+        for (auto i = 0; i < 10; i++) {
+            CHECK(mmap.virt_to_phys(0x7FFFE000) == 0x7FFFE000);
+            CHECK(mmap.virt_to_phys(0x7FFFF000) == 0x7FFFF000);
+        }
+
+        CHECK(mmap.walk_cache_stats().hits == 0);
+        CHECK(mmap.walk_cache_stats().misses == stats.misses);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: walk cache disabled")
+{
+    {
+        ept::mmap mmap{};
+        mmap.set_walk_cache_size(0);
+
+        mmap.map_4k(0x7FFFF000, 0x7FFFF000);
+        mmap.map_4k(0x100000000, 0x100000000);
+
+        auto stats = mmap.walk_cache_stats();
+        for (auto i = 0; i < 10; i++) {
+            CHECK(mmap.virt_to_phys(0x7FFFF000) == 0x7FFFF000);
+            CHECK(mmap.virt_to_phys(0x100000000) == 0x100000000);
+        }
+
+        CHECK(mmap.walk_cache_stats().size == 0);
+        CHECK(mmap.walk_cache_stats().hits == 0);
+        CHECK(mmap.walk_cache_stats().misses - stats.misses == 40);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: walk cache too small")
+{
+    {
+        ept::mmap mmap{};
+        mmap.set_walk_cache_size(1);
+
+        mmap.map_4k(0x7FFFF000, 0x7FFFF000);
+        mmap.map_4k(0x100000000, 0x100000000);
+
+        auto stats = mmap.walk_cache_stats();
+        for (auto i = 0; i < 10; i++) {
+            CHECK(mmap.virt_to_phys(0x7FFFF000) == 0x7FFFF000);
+            CHECK(mmap.virt_to_phys(0x100000000) == 0x100000000);
+        }
+
+        CHECK(mmap.walk_cache_stats().misses - stats.misses == 40);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: walk cache after release")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.map_4k(0x40001000, 0x40001000);
+        mmap.release(0x1000);
+        mmap.map_2m(0x2A, 0x2A);
+        mmap.map_4k(0x1000000000, 0x1000000000);
+        mmap.release(0x40001000);
+        mmap.map_4k(0x40002000, 0x40002000);
+
+        CHECK(mmap.is_2m(0x1000));
+        CHECK(mmap.is_4k(0x40002000));
+        CHECK(mmap.virt_to_phys(0x40002000) == 0x40002000);
+        CHECK_THROWS(mmap.virt_to_phys(0x40001000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: concurrent map / unmap")
+{
+    {
+        ept::mmap mmap{};
+        mmap.set_concurrent(true);
+        CHECK(mmap.is_concurrent());
+
+        mmap.map_1g(0x40000000, 0x40000000);
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.map_4k(0x1000, 0x1000);
+
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(mmap.is_4k(0x1000));
+        CHECK(mmap.virt_to_phys(0x4000102A) == 0x40000000);
+        CHECK(mmap.virt_to_phys(0x20102A) == 0x200000);
+        CHECK(mmap.virt_to_phys(0x102A) == 0x1000);
+
+        CHECK_THROWS(mmap.map_1g(0x40000000, 0x40000000));
+        CHECK_THROWS(mmap.map_2m(0x200000, 0x200000));
+        CHECK_THROWS(mmap.map_4k(0x1000, 0x1000));
+        CHECK_THROWS(mmap.map_4k(0x201000, 0x201000));
+
+        mmap.unmap(0x1000);
+        mmap.release(0x200000);
+        CHECK_THROWS(mmap.entry(0x1000));
+        CHECK_THROWS(mmap.virt_to_phys(0x200000));
+        CHECK_THROWS(mmap.from(0x200000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: concurrent lookups do not allocate")
+{
+    {
+        ept::mmap mmap{};
+        mmap.set_concurrent(true);
+
+        CHECK_THROWS(mmap.entry(0x1000000000));
+        CHECK_THROWS(mmap.virt_to_phys(0x1000000000));
+        CHECK_THROWS(mmap.from(0x1000000000));
+        CHECK(g_allocated_pages.size() == 1);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: concurrent map range")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+        mmap.set_concurrent(true);
+
+        mmap.map_range(0x3FFFF000, 0x3FFFF000, 0x40402000);
+        CHECK(mmap.is_4k(0x3FFFF000));
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(mmap.is_2m(0x80000000));
+        CHECK(mmap.is_4k(0x80400000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: update entry")
+{
+    {
+        ept::mmap mmap{};
+        mmap.set_concurrent(true);
+        mmap.map_4k(0x1000, 0x1000);
+
+        auto old_entry = mmap.entry(0x1000);
+        auto new_entry = old_entry;
+        ::intel_x64::ept::pt::entry::write_access::disable(new_entry);
+
+        CHECK(mmap.update_entry(0x1000, old_entry, new_entry));
+        CHECK(mmap.entry(0x1000) == new_entry);
+        CHECK(!mmap.update_entry(0x1000, old_entry, new_entry));
+        CHECK_THROWS(mmap.update_entry(0x2000, old_entry, new_entry));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: concurrent stress")
+{
+    constexpr const auto num_threads = 8ULL;
+    constexpr const auto pages_per_thread = 0x400ULL;
+
+    {
+        ept::page_pool pool{};
+        pool.reserve(64);
+
+        ept::mmap mmap{&pool};
+        mmap.set_concurrent(true);
+
+        std::vector<std::thread> threads;
+        std::atomic<uint64_t> failures{0};
+
+        // Every thread maps every num_threads'th page of the same range so
+        // that all of the threads race to install the same page tables,
+        // while also looking up pages mapped by the other threads.
+        //
+        for (auto t = 0ULL; t < num_threads; t++) {
+            threads.emplace_back([&mmap, &failures, t] {
+                for (auto i = t; i < num_threads * pages_per_thread; i += num_threads) {
+                    auto gpa = 0x7FC00000ULL + (i << ::intel_x64::ept::pt::from);
+                    mmap.map_4k(gpa, gpa + 0x1000000000);
+
+                    if (mmap.virt_to_phys(gpa) != gpa + 0x1000000000) {
+                        failures++;
+                    }
+
+                    try {
+                        mmap.virt_to_phys(gpa + ::intel_x64::ept::pt::page_size);
+                    }
+                    catch (std::runtime_error &) { }
+                }
+            });
+        }
+
+        for (auto &thread : threads) {
+            thread.join();
+        }
+
+        CHECK(failures == 0);
+        for (auto i = 0ULL; i < num_threads * pages_per_thread; i++) {
+            auto gpa = 0x7FC00000ULL + (i << ::intel_x64::ept::pt::from);
+            CHECK(mmap.virt_to_phys(gpa) == gpa + 0x1000000000);
+        }
+
+        // pml4, pdpt, 2 pds, and 16 pts (plus any tables that lost a race
+        // and were returned to the pool)
+        //
+        CHECK(pool.stats().used == 20);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: generation")
+{
+    {
+        ept::mmap mmap{};
+        auto generation = mmap.generation();
+
+        mmap.map_1g(0x40000000, 0x40000000);
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.map_range_4k(0x2000, 0x2000, 0x10000);
+        CHECK(mmap.generation() == generation);
+
+        mmap.unmap(0x100000000);
+        mmap.unmap(0x400000);
+        CHECK(mmap.generation() == generation);
+
+        mmap.unmap(0x1000);
+        CHECK(mmap.generation() == ++generation);
+
+        mmap.unmap(0x1000);
+        CHECK(mmap.generation() == generation);
+
+        mmap.unmap(0x200000);
+        mmap.unmap(0x40000000);
+        CHECK(mmap.generation() == generation + 2);
+        generation += 2;
+
+        mmap.release(0x1000);
+        mmap.release(0x100000000);
+        CHECK(mmap.generation() == generation);
+
+        mmap.map_4k(0x80000000, 0x80000000);
+        mmap.unmap(0x80000000);
+        CHECK(mmap.generation() == ++generation);
+
+        mmap.release(0x80000000);
+        CHECK(mmap.generation() == ++generation);
+
+        auto entry = mmap.entry(0x2000);
+        auto new_entry = entry;
+        ::intel_x64::ept::pt::entry::write_access::disable(new_entry);
+
+        CHECK(mmap.update_entry(0x2000, entry, new_entry));
+        CHECK(mmap.generation() == ++generation);
+        CHECK(!mmap.update_entry(0x2000, entry, new_entry));
+        CHECK(mmap.generation() == generation);
+
+        mmap.invalidate();
+        CHECK(mmap.generation() == ++generation);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: move")
+{
+    {
+        ept::mmap mmap1{};
+        mmap1.map_4k(0x1000, 0x1000);
+        mmap1.unmap(0x1000);
+        mmap1.map_4k(0x2000, 0x2000);
+
+        auto eptp = mmap1.eptp();
+        auto generation = mmap1.generation();
+
+        ept::mmap mmap2{std::move(mmap1)};
+        CHECK(mmap2.eptp() == eptp);
+        CHECK(mmap2.generation() == generation);
+        CHECK(mmap2.virt_to_phys(0x2000) == 0x2000);
+        CHECK(mmap2.stats().mapped_4k == 0x1000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: concurrent generation")
+{
+    {
+        ept::mmap mmap{};
+        mmap.set_concurrent(true);
+
+        mmap.map_4k(0x1000, 0x1000);
+        auto generation = mmap.generation();
+
+        mmap.unmap(0x1000);
+        CHECK(mmap.generation() == ++generation);
+
+        mmap.unmap(0x1000);
+        mmap.release(0x1000);
+        CHECK(mmap.generation() == generation);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+// Emulates what the CPU does when the guest writes to the provided address
+// with EPT accessed and dirty flags enabled: the accessed flag of every
+// entry along the walk is set, and the dirty flag of the final entry is set.
+//
+static void
+guest_write(ept::mmap &mmap, uintptr_t gpa)
+{
+    using namespace ::intel_x64::ept;
+
+    auto table = static_cast<uintptr_t *>(g_mm->physint_to_virtptr(mmap.eptp()));
+
+    auto &pml4e = table[pml4::index(gpa)];
+    pml4::entry::accessed_flag::enable(pml4e);
+    table = static_cast<uintptr_t *>(g_mm->physint_to_virtptr(pml4::entry::phys_addr::get(pml4e)));
+
+    auto &pdpte = table[pdpt::index(gpa)];
+    pdpt::entry::accessed_flag::enable(pdpte);
+    if (pdpt::entry::ps::is_enabled(pdpte)) {
+        pdpt::entry::dirty::enable(pdpte);
+        return;
+    }
+    table = static_cast<uintptr_t *>(g_mm->physint_to_virtptr(pdpt::entry::phys_addr::get(pdpte)));
+
+    auto &pde = table[pd::index(gpa)];
+    pd::entry::accessed_flag::enable(pde);
+    if (pd::entry::ps::is_enabled(pde)) {
+        pd::entry::dirty::enable(pde);
+        return;
+    }
+    table = static_cast<uintptr_t *>(g_mm->physint_to_virtptr(pd::entry::phys_addr::get(pde)));
+
+    auto &pte = table[pt::index(gpa)];
+    pt::entry::accessed_flag::enable(pte);
+    pt::entry::dirty::enable(pte);
+}
+
+// Simulates a write made by a CPU that caches the table entries above the
+// page (which therefore sets no accessed flags), and clears their accessed
+// flags to make sure that they are not relied on
+//
+static void
+cached_write(ept::mmap &mmap, uintptr_t gpa)
+{
+    using namespace ::intel_x64::ept;
+
+    auto table = static_cast<uintptr_t *>(g_mm->physint_to_virtptr(mmap.eptp()));
+
+    auto &pml4e = table[pml4::index(gpa)];
+    pml4::entry::accessed_flag::disable(pml4e);
+    table = static_cast<uintptr_t *>(g_mm->physint_to_virtptr(pml4::entry::phys_addr::get(pml4e)));
+
+    auto &pdpte = table[pdpt::index(gpa)];
+    pdpt::entry::accessed_flag::disable(pdpte);
+    table = static_cast<uintptr_t *>(g_mm->physint_to_virtptr(pdpt::entry::phys_addr::get(pdpte)));
+
+    auto &pde = table[pd::index(gpa)];
+    pd::entry::accessed_flag::disable(pde);
+
+    pt::entry::dirty::enable(mmap.entry(gpa));
+}
+
+// Stands in for the INVEPT / vCPU shootdown a harvest has to be followed by
+//
+static uint64_t g_flushes = 0;
+
+static void
+flush()
+{ g_flushes++; }
+
+static bool
+is_dirty(const ept::mmap::dirty_bitmap_type &bitmap, uint64_t page)
+{ return (bitmap.at(page / 64) & (1ULL << (page % 64))) != 0; }
+
+static uint64_t
+num_dirty(const ept::mmap::dirty_bitmap_type &bitmap)
+{
+    uint64_t num = 0;
+
+    for (auto word : bitmap) {
+        for (; word != 0; word &= word - 1) {
+            num++;
+        }
+    }
+
+    return num;
+}
+
+TEST_CASE("mmap: harvest dirty 4k")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x0, 0x0, 0x400000);
+
+        auto bitmap = mmap.harvest_dirty(0x0, 0x400000, flush);
+        CHECK(bitmap.size() == 16);
+        CHECK(num_dirty(bitmap) == 0);
+
+        guest_write(mmap, 0x1000);
+        guest_write(mmap, 0x1FF000);
+        guest_write(mmap, 0x3FF02A);
+
+        bitmap = mmap.harvest_dirty(0x0, 0x400000, flush);
+        CHECK(num_dirty(bitmap) == 3);
+        CHECK(is_dirty(bitmap, 0x1));
+        CHECK(is_dirty(bitmap, 0x1FF));
+        CHECK(is_dirty(bitmap, 0x3FF));
+
+        bitmap = mmap.harvest_dirty(0x0, 0x400000, flush);
+        CHECK(num_dirty(bitmap) == 0);
+        CHECK(::intel_x64::ept::pt::entry::dirty::is_disabled(mmap.entry(0x1000)));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: harvest dirty large pages")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_1g(0x40000000, 0x40000000);
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.map_2m(0x400000, 0x400000);
+
+        guest_write(mmap, 0x40000000);
+        guest_write(mmap, 0x400000);
+
+        auto bitmap = mmap.harvest_dirty(0x0, 0x80000000, flush);
+        CHECK(num_dirty(bitmap) == 0x40200);
+        CHECK(!is_dirty(bitmap, 0x200));
+        CHECK(is_dirty(bitmap, 0x400));
+        CHECK(is_dirty(bitmap, 0x5FF));
+        CHECK(!is_dirty(bitmap, 0x600));
+        CHECK(is_dirty(bitmap, 0x40000));
+        CHECK(is_dirty(bitmap, 0x7FFFF));
+
+        bitmap = mmap.harvest_dirty(0x0, 0x80000000, flush);
+        CHECK(num_dirty(bitmap) == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: harvest dirty partial range")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.map_range_4k(0x400000, 0x400000, 0x200000);
+
+        guest_write(mmap, 0x200000);
+        guest_write(mmap, 0x401000);
+        guest_write(mmap, 0x402000);
+
+        // Only part of the 2m page, and part of the 4k pages that share a
+        // page table are scanned. Nothing outside of the range may be lost.
+        //
+        auto bitmap = mmap.harvest_dirty(0x3FF000, 0x3000, flush);
+        CHECK(bitmap.size() == 1);
+        CHECK(num_dirty(bitmap) == 2);
+        CHECK(is_dirty(bitmap, 0x0));
+        CHECK(is_dirty(bitmap, 0x2));
+
+        bitmap = mmap.harvest_dirty(0x200000, 0x400000, flush);
+        CHECK(num_dirty(bitmap) == 0x201);
+        CHECK(is_dirty(bitmap, 0x0));
+        CHECK(is_dirty(bitmap, 0x1FF));
+        CHECK(!is_dirty(bitmap, 0x201));
+        CHECK(is_dirty(bitmap, 0x202));
+
+        bitmap = mmap.harvest_dirty(0x200000, 0x400000, flush);
+        CHECK(num_dirty(bitmap) == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: harvest dirty ignores table accessed flags")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x0, 0x0, 0x400000);
+
+        guest_write(mmap, 0x1000);
+        mmap.harvest_dirty(0x0, 0x400000, flush);
+
+        // A CPU that caches the table entries does not set their accessed
+        // flags again, so a write through them only shows up in the page
+        // table entry, and still has to be seen
+        //
+        cached_write(mmap, 0x1000);
+        CHECK(num_dirty(mmap.harvest_dirty(0x0, 0x400000, flush)) == 1);
+        CHECK(num_dirty(mmap.harvest_dirty(0x0, 0x400000, flush)) == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: harvest dirty generation and flush")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_4k(0x1000, 0x1000);
+
+        auto generation = mmap.generation();
+        g_flushes = 0;
+
+        mmap.harvest_dirty(0x0, 0x200000, flush);
+        CHECK(mmap.generation() == generation);
+        CHECK(g_flushes == 0);
+
+        guest_write(mmap, 0x1000);
+        mmap.harvest_dirty(0x0, 0x200000, flush);
+        CHECK(mmap.generation() == generation + 1);
+        CHECK(g_flushes == 1);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: harvest dirty unaligned fails")
+{
+    ept::mmap mmap{};
+
+    CHECK_THROWS(mmap.harvest_dirty(0x2A, 0x1000, flush));
+    CHECK_THROWS(mmap.harvest_dirty(0x1000, 0x2A, flush));
+}
+
+TEST_CASE("mmap: harvest dirty shared fails")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_4k(0x1000, 0x1000);
+
+        auto clone = mmap.clone();
+
+        CHECK_THROWS(mmap.harvest_dirty(0x0, 0x200000, flush));
+        CHECK_THROWS(clone->harvest_dirty(0x0, 0x200000, flush));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact 4k to 2m")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x200000, 0x40000000, 0x400000);
+
+        auto num_pages = g_allocated_pages.size();
+        auto generation = mmap.generation();
+
+        CHECK(mmap.compact(0x200000, 0x400000) == 2);
+        CHECK(g_allocated_pages.size() == num_pages - 2);
+        CHECK(mmap.generation() == generation + 1);
+
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(mmap.is_2m(0x400000));
+        CHECK(mmap.virt_to_phys(0x20102A) == 0x40000000);
+        CHECK(mmap.virt_to_phys(0x40102A) == 0x40200000);
+        CHECK(::intel_x64::ept::pd::entry::read_access::is_enabled(mmap.entry(0x200000)));
+        CHECK(::intel_x64::ept::pd::entry::write_access::is_enabled(mmap.entry(0x200000)));
+        CHECK(::intel_x64::ept::pd::entry::execute_access::is_enabled(mmap.entry(0x200000)));
+
+        CHECK(mmap.compact(0x200000, 0x400000) == 0);
+        CHECK(mmap.generation() == generation + 1);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact 4k to 1g")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x40000000, 0x80000000, 0x40000000);
+
+        auto num_pages = g_allocated_pages.size();
+
+        CHECK(mmap.compact(0x0, 0x100000000) == 513);
+        CHECK(g_allocated_pages.size() == num_pages - 513);
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(mmap.virt_to_phys(0x7FFFF02A) == 0x80000000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact 2m to 1g")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+        mmap.map_range_2m(0x40000000, 0x40000000, 0x40000000, ept::mmap::attr_type::read_only, ept::mmap::memory_type::uncacheable);
+
+        CHECK(mmap.compact(0x40000000, 0x40000000) == 1);
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(::intel_x64::ept::pdpt::entry::read_access::is_enabled(mmap.entry(0x40000000)));
+        CHECK(::intel_x64::ept::pdpt::entry::write_access::is_disabled(mmap.entry(0x40000000)));
+        CHECK(::intel_x64::ept::pdpt::entry::memory_type::get(mmap.entry(0x40000000)) == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact without 1g support")
+{
+    scoped_msr caps{ept_vpid_cap, 0};
+
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x40000000, 0x40000000, 0x40000000);
+
+        auto num_pages = g_allocated_pages.size();
+
+        // The page tables are still collapsed into 2m pages, but the page
+        // directory they end up in has to stay
+        //
+        CHECK(mmap.compact(0x40000000, 0x40000000) == 512);
+        CHECK(g_allocated_pages.size() == num_pages - 512);
+        CHECK(mmap.is_2m(0x40000000));
+        CHECK(mmap.is_2m(0x7FE00000));
+
+        CHECK(mmap.compact(0x40000000, 0x40000000) == 0);
+        CHECK(mmap.is_2m(0x40000000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact after unhooking a page")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_2m(0x200000, 0x200000);
+
+        ept::identity_map_convert_2m_to_4k(mmap, 0x200000);
+        mmap.unmap(0x201000);
+        mmap.map_4k(0x201000, 0x201000, ept::mmap::attr_type::read_only);
+        CHECK(mmap.compact(0x0, 0x40000000) == 0);
+
+        mmap.unmap(0x201000);
+        mmap.map_4k(0x201000, 0x201000);
+        CHECK(mmap.compact(0x0, 0x40000000) == 1);
+        CHECK(mmap.is_2m(0x200000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact skips")
+{
+    {
+        ept::mmap mmap{};
+
+        // missing entry
+        //
+        mmap.map_range_4k(0x200000, 0x200000, 0x1FF000);
+
+        // not physically contiguous
+        //
+        mmap.map_range_4k(0x400000, 0x400000, 0x1FF000);
+        mmap.map_4k(0x5FF000, 0x1000);
+
+        // different memory types
+        //
+        mmap.map_range_4k(0x600000, 0x600000, 0x1FF000);
+        mmap.map_4k(0x7FF000, 0x7FF000, ept::mmap::attr_type::read_write_execute, ept::mmap::memory_type::uncacheable);
+
+        // not 2m aligned physically
+        //
+        mmap.map_range_4k(0x800000, 0x801000, 0x200000);
+
+        // only partially inside of the range
+        //
+        mmap.map_range_4k(0xA00000, 0xA00000, 0x200000);
+
+        CHECK(mmap.compact(0x0, 0xBFF000) == 0);
+        CHECK(mmap.is_4k(0x200000));
+        CHECK(mmap.is_4k(0x400000));
+        CHECK(mmap.is_4k(0x600000));
+        CHECK(mmap.is_4k(0x800000));
+        CHECK(mmap.is_4k(0xA00000));
+
+        CHECK(mmap.compact(0xA00000, 0x200000) == 1);
+        CHECK(mmap.is_2m(0xA00000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact combines accessed and dirty flags")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x200000, 0x200000, 0x200000);
+
+        guest_write(mmap, 0x3FF000);
+        CHECK(mmap.compact(0x200000, 0x200000) == 1);
+
+        CHECK(::intel_x64::ept::pd::entry::accessed_flag::is_enabled(mmap.entry(0x200000)));
+        CHECK(::intel_x64::ept::pd::entry::dirty::is_enabled(mmap.entry(0x200000)));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: compact concurrent fails")
+{
+    ept::mmap mmap{};
+    mmap.set_concurrent(true);
+
+    CHECK_THROWS(mmap.compact(0x0, 0x40000000));
+}
+
+TEST_CASE("mmap: split 2m")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_2m(0x200000, 0x40000000, ept::mmap::attr_type::read_execute, ept::mmap::memory_type::write_through);
+
+        auto num_pages = g_allocated_pages.size();
+        auto generation = mmap.generation();
+
+        mmap.split_2m(0x200000);
+        CHECK(g_allocated_pages.size() == num_pages + 1);
+        CHECK(mmap.generation() == generation + 1);
+
+        for (auto gpa = 0x200000ULL; gpa < 0x400000ULL; gpa += 0x1000) {
+            auto entry = mmap.entry(gpa);
+
+            CHECK(mmap.is_4k(gpa));
+            CHECK(mmap.virt_to_phys(gpa) == gpa - 0x200000 + 0x40000000);
+            CHECK(::intel_x64::ept::pt::entry::read_access::is_enabled(entry));
+            CHECK(::intel_x64::ept::pt::entry::write_access::is_disabled(entry));
+            CHECK(::intel_x64::ept::pt::entry::execute_access::is_enabled(entry));
+            CHECK(::intel_x64::ept::pt::entry::memory_type::get(entry) == 4);
+            CHECK(::intel_x64::ept::pd::entry::ps::is_disabled(entry));
+        }
+
+        CHECK_THROWS(mmap.split_2m(0x200000));
+        CHECK(mmap.compact(0x200000, 0x200000) == 1);
+        CHECK(mmap.is_2m(0x200000));
+        CHECK(::intel_x64::ept::pd::entry::write_access::is_disabled(mmap.entry(0x200000)));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: split 1g")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_1g(0x40000000, 0x40000000, ept::mmap::attr_type::read_only, ept::mmap::memory_type::uncacheable);
+
+        mmap.split_1g(0x40000000);
+        CHECK(mmap.is_2m(0x40000000));
+        CHECK(mmap.is_2m(0x7FE00000));
+        CHECK(mmap.virt_to_phys(0x7FE0102A) == 0x7FE00000);
+        CHECK(::intel_x64::ept::pd::entry::write_access::is_disabled(mmap.entry(0x7FE00000)));
+        CHECK(::intel_x64::ept::pd::entry::memory_type::get(mmap.entry(0x7FE00000)) == 0);
+
+        mmap.split_2m(0x7FE00000);
+        CHECK(mmap.is_4k(0x7FFFF000));
+        CHECK(mmap.virt_to_phys(0x7FFFF02A) == 0x7FFFF000);
+
+        CHECK_THROWS(mmap.split_1g(0x40000000));
+        CHECK_THROWS(mmap.split_2m(0x7FE00000));
+        CHECK_THROWS(mmap.split_1g(0x80000000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: split keeps dirty flags")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_2m(0x200000, 0x200000);
+
+        guest_write(mmap, 0x200000);
+        mmap.split_2m(0x200000);
+
+        CHECK(::intel_x64::ept::pt::entry::dirty::is_enabled(mmap.entry(0x3FF000)));
+
+        // The write was made to the 2m page, so every 4k page it was split
+        // into has to be reported, even though the CPU has not walked the
+        // new page table yet
+        //
+        auto bitmap = mmap.harvest_dirty(0x200000, 0x200000, flush);
+        CHECK(num_dirty(bitmap) == 512);
+
+        bitmap = mmap.harvest_dirty(0x200000, 0x200000, flush);
+        CHECK(num_dirty(bitmap) == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: concurrent split")
+{
+    {
+        ept::mmap mmap{};
+        mmap.set_concurrent(true);
+        mmap.map_2m(0x200000, 0x200000);
+
+        mmap.split_2m(0x200000);
+        CHECK(mmap.is_4k(0x3FF000));
+        CHECK(mmap.virt_to_phys(0x3FF02A) == 0x3FF000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: occupancy map / unmap / release")
+{
+    {
+        ept::mmap mmap{};
+        CHECK(mmap.verify_occupancy());
+
+        mmap.map_1g(0x40000000, 0x40000000);
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.map_4k(0x2000, 0x2000);
+        CHECK(mmap.verify_occupancy());
+
+        mmap.unmap(0x1000);
+        mmap.unmap(0x1000);
+        CHECK(mmap.verify_occupancy());
+
+        mmap.release(0x1000);
+        mmap.release(0x1000);
+        CHECK(mmap.verify_occupancy());
+        CHECK(mmap.is_4k(0x2000));
+
+        mmap.unmap(0x2000);
+        mmap.release(0x2000);
+        CHECK(mmap.verify_occupancy());
+        CHECK(mmap.is_2m(0x200000));
+
+        mmap.unmap(0x200000);
+        mmap.release(0x200000);
+        mmap.unmap(0x40000000);
+        mmap.release(0x40000000);
+        CHECK(mmap.verify_occupancy());
+        CHECK(g_allocated_pages.size() == 1);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: occupancy of many tables")
+{
+    {
+        ept::mmap mmap{};
+
+        for (auto i = 0ULL; i < 1024; i++) {
+            mmap.map_4k(i * 0x200000, 0x0);
+        }
+
+        CHECK(mmap.verify_occupancy());
+        CHECK(mmap.stats().num_pt_tables == 1024);
+
+        // Every other table is freed, starting from the last one, so that
+        // counts are removed from the middle of runs of occupied slots
+        //
+        for (auto i = 1023LL; i >= 0; i -= 2) {
+            mmap.unmap(static_cast<uintptr_t>(i) * 0x200000);
+            mmap.release(static_cast<uintptr_t>(i) * 0x200000);
+        }
+
+        CHECK(mmap.verify_occupancy());
+        CHECK(mmap.stats().num_pt_tables == 512);
+
+        for (auto i = 0ULL; i < 1024; i += 2) {
+            CHECK(mmap.is_4k(i * 0x200000));
+            mmap.unmap(i * 0x200000);
+            mmap.release(i * 0x200000);
+        }
+
+        CHECK(mmap.verify_occupancy());
+        CHECK(mmap.stats().num_pt_tables == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: occupancy map range / release range")
+{
+    {
+        ept::mmap mmap{};
+
+        mmap.map_range(0x3FFFF000, 0x3FFFF000, 0x40402000);
+        CHECK(mmap.verify_occupancy());
+
+        for (auto gpa = 0x80000000ULL; gpa < 0x80400000ULL; gpa += 0x1000) {
+            mmap.unmap(gpa);
+            mmap.release(gpa);
+        }
+
+        CHECK(mmap.verify_occupancy());
+        CHECK_THROWS(mmap.entry(0x80000000));
+        CHECK(mmap.is_4k(0x80400000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: occupancy split / compact / update entry")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+        mmap.map_1g(0x40000000, 0x40000000);
+
+        mmap.split_1g(0x40000000);
+        mmap.split_2m(0x40000000);
+        CHECK(mmap.verify_occupancy());
+
+        auto entry = mmap.entry(0x40001000);
+        CHECK(mmap.update_entry(0x40001000, entry, 0));
+        CHECK(mmap.verify_occupancy());
+        CHECK(mmap.compact(0x40000000, 0x40000000) == 0);
+
+        mmap.map_4k(0x40001000, 0x40001000);
+        CHECK(mmap.verify_occupancy());
+        CHECK(mmap.compact(0x40000000, 0x40000000) == 2);
+        CHECK(mmap.verify_occupancy());
+
+        mmap.unmap(0x40000000);
+        mmap.release(0x40000000);
+        CHECK(mmap.verify_occupancy());
+        CHECK(g_allocated_pages.size() == 1);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: occupancy concurrent")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_4k(0x1000, 0x1000);
+
+        mmap.set_concurrent(true);
+        mmap.map_4k(0x2000, 0x2000);
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.unmap(0x1000);
+        CHECK(mmap.verify_occupancy());
+
+        mmap.set_concurrent(false);
+        CHECK(mmap.verify_occupancy());
+
+        mmap.unmap(0x2000);
+        mmap.release(0x2000);
+        mmap.release(0x1000);
+        CHECK(mmap.verify_occupancy());
+        CHECK(mmap.is_2m(0x200000));
+
+        mmap.unmap(0x200000);
+        mmap.release(0x200000);
+        CHECK(g_allocated_pages.size() == 1);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: clone shares page tables")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x40000000, 0x40000000, 0x400000);
+        mmap.map_2m(0x80000000, 0x80000000);
+
+        auto num_pages = g_allocated_pages.size();
+        auto clone = mmap.clone();
+
+        CHECK(g_allocated_pages.size() == num_pages + 1);
+        CHECK(clone->virt_to_phys(0x40001000) == 0x40001000);
+        CHECK(clone->is_2m(0x80000000));
+        CHECK(clone->verify_occupancy());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: clone copies on write")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x40000000, 0x40000000, 0x400000);
+
+        auto num_pages = g_allocated_pages.size();
+        auto clone = mmap.clone();
+
+        clone->unmap(0x40001000);
+        CHECK(g_allocated_pages.size() == num_pages + 4);
+        CHECK_THROWS(clone->virt_to_phys(0x40001000));
+        CHECK(mmap.virt_to_phys(0x40001000) == 0x40001000);
+
+        clone->unmap(0x40002000);
+        clone->map_4k(0x40002000, 0x1000);
+        CHECK(g_allocated_pages.size() == num_pages + 4);
+        CHECK(clone->virt_to_phys(0x40002000) == 0x1000);
+        CHECK(mmap.virt_to_phys(0x40002000) == 0x40002000);
+
+        mmap.unmap(0x40200000);
+        mmap.map_4k(0x40200000, 0x2000, ept::mmap::attr_type::read_only);
+        CHECK(g_allocated_pages.size() == num_pages + 5);
+        CHECK(mmap.virt_to_phys(0x40200000) == 0x2000);
+        CHECK(clone->virt_to_phys(0x40200000) == 0x40200000);
+
+        CHECK(mmap.verify_occupancy());
+        CHECK(clone->verify_occupancy());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: clone destroyed in any order")
+{
+    {
+        auto mmap = std::make_unique<ept::mmap>();
+        mmap->map_range_4k(0x40000000, 0x40000000, 0x400000);
+
+        auto clone1 = mmap->clone();
+        auto clone2 = clone1->clone();
+        clone2->unmap(0x40000000);
+
+        mmap.reset();
+        CHECK(clone1->virt_to_phys(0x40000000) == 0x40000000);
+
+        clone1.reset();
+        CHECK(clone2->virt_to_phys(0x40001000) == 0x40001000);
+        CHECK(clone2->verify_occupancy());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: clone split / release")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+        mmap.map_1g(0x40000000, 0x40000000);
+        mmap.map_4k(0x1000, 0x1000);
+
+        auto clone = mmap.clone();
+        clone->split_1g(0x40000000);
+        CHECK(clone->is_2m(0x40000000));
+        CHECK(mmap.is_1g(0x40000000));
+
+        clone->unmap(0x1000);
+        clone->release(0x1000);
+        CHECK(mmap.virt_to_phys(0x1000) == 0x1000);
+        CHECK(mmap.verify_occupancy());
+        CHECK(clone->verify_occupancy());
+
+        CHECK(clone->compact(0x40000000, 0x40000000) == 1);
+        CHECK(clone->is_1g(0x40000000));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: clone concurrent fails")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_4k(0x1000, 0x1000);
+
+        auto clone = mmap.clone();
+        CHECK_THROWS(clone->set_concurrent(true));
+        CHECK_THROWS(mmap.set_concurrent(true));
+
+        ept::mmap concurrent{};
+        concurrent.set_concurrent(true);
+        CHECK_THROWS(concurrent.clone());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: image")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+        mmap.map_range(0x1000, 0x1000, 0x80000000 - 0x1000);
+        mmap.map_range_4k(0x80000000, 0x80000000, 0x4000, ept::mmap::attr_type::read_only);
+        mmap.map_range_4k(0x80004000, 0x80004000, 0x1000, ept::mmap::attr_type::read_only,
+                          ept::mmap::memory_type::uncacheable);
+        mmap.map_4k(0x80005000, 0x10000000);
+
+        auto image = mmap.image();
+        REQUIRE(image.size() == 6);
+
+        CHECK(image.at(0).virt_addr == 0x1000);
+        CHECK(image.at(0).size == 0x1FF000);
+        CHECK(image.at(0).page_size == 0x1000);
+        CHECK(image.at(1).virt_addr == 0x200000);
+        CHECK(image.at(1).size == 0x3FE00000);
+        CHECK(image.at(1).page_size == 0x200000);
+        CHECK(image.at(2).virt_addr == 0x40000000);
+        CHECK(image.at(2).size == 0x40000000);
+        CHECK(image.at(2).page_size == 0x40000000);
+        CHECK(image.at(3).size == 0x4000);
+        CHECK(image.at(3).flags != image.at(0).flags);
+        CHECK(image.at(4).flags != image.at(3).flags);
+        CHECK(image.at(5).phys_addr == 0x10000000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: restore")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+        mmap.map_range(0x1000, 0x1000, 0x80000000 - 0x1000);
+        mmap.map_range_4k(0x80000000, 0x80000000, 0x4000, ept::mmap::attr_type::read_only);
+        mmap.map_range_4k(0x8000000000, 0x1000, 0x2000);
+        guest_write(mmap, 0x1000);
+
+        auto num_pages = g_allocated_pages.size();
+        auto image = mmap.image();
+
+        ept::mmap restored{};
+        restored.restore(image);
+
+        CHECK(g_allocated_pages.size() == num_pages * 2);
+        CHECK(restored.verify_occupancy());
+        CHECK(restored.virt_to_phys(0x8000001000) == 0x2000);
+        CHECK(restored.is_1g(0x40000000));
+        CHECK(restored.entry(0x80001000) == mmap.entry(0x80001000));
+        CHECK(!is_dirty(restored.harvest_dirty(0x1000, 0x1000, flush), 0));
+
+        auto restored_image = restored.image();
+        REQUIRE(restored_image.size() == image.size());
+
+        for (auto i = 0U; i < image.size(); i++) {
+            CHECK(restored_image.at(i).virt_addr == image.at(i).virt_addr);
+            CHECK(restored_image.at(i).phys_addr == image.at(i).phys_addr);
+            CHECK(restored_image.at(i).size == image.at(i).size);
+            CHECK(restored_image.at(i).page_size == image.at(i).page_size);
+            CHECK(restored_image.at(i).flags == image.at(i).flags);
+        }
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: restore failures")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range(0x1000, 0x1000, 0x400000);
+
+        auto image = mmap.image();
+        CHECK_THROWS(mmap.restore(image));
+
+        ept::mmap restored{};
+        std::swap(image.at(0), image.at(1));
+        CHECK_THROWS(restored.restore(image));
+
+        image.at(0).page_size = 0x2000;
+        CHECK_THROWS(restored.restore(image));
+
+        image = {{0x1000, 0x1000, 0x200000, 0x200000, 0x7}};
+        CHECK_THROWS(restored.restore(image));
+        CHECK(g_allocated_pages.size() == 6);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: ranges empty")
+{
+    {
+        ept::mmap mmap{};
+
+        auto ranges = mmap.ranges();
+        CHECK(ranges.begin() == ranges.end());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: ranges")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range(0x1000, 0x1000, 0x80000000 - 0x1000);
+        mmap.map_range_4k(0x80000000, 0x80000000, 0x4000, ept::mmap::attr_type::read_only);
+        mmap.map_4k(0x80004000, 0x10000000);
+        mmap.map_4k(0x80005000, 0x10001000);
+        mmap.map_4k(0x8000000000, 0x10002000);
+        guest_write(mmap, 0x1000);
+
+        auto num_pages = g_allocated_pages.size();
+
+        std::vector<ept::mmap::range_type> ranges;
+        for (const auto &range : mmap.ranges()) {
+            ranges.push_back(range);
+        }
+
+        CHECK(g_allocated_pages.size() == num_pages);
+        REQUIRE(ranges.size() == 4);
+
+        CHECK(ranges.at(0).virt_addr == 0x1000);
+        CHECK(ranges.at(0).phys_addr == 0x1000);
+        CHECK(ranges.at(0).size == 0x80000000 - 0x1000);
+        CHECK(ranges.at(1).virt_addr == 0x80000000);
+        CHECK(ranges.at(1).size == 0x4000);
+        CHECK(ranges.at(1).flags != ranges.at(0).flags);
+        CHECK(ranges.at(2).virt_addr == 0x80004000);
+        CHECK(ranges.at(2).phys_addr == 0x10000000);
+        CHECK(ranges.at(2).size == 0x2000);
+        CHECK(ranges.at(2).flags == ranges.at(0).flags);
+        CHECK(ranges.at(3).virt_addr == 0x8000000000);
+        CHECK(ranges.at(3).phys_addr == 0x10002000);
+        CHECK(ranges.at(3).size == 0x1000);
+
+        auto iter = mmap.ranges().begin();
+        CHECK((iter++)->virt_addr == 0x1000);
+        CHECK(iter->virt_addr == 0x80000000);
+        CHECK(iter != mmap.ranges().end());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: has holes")
+{
+    {
+        ept::mmap mmap{};
+        CHECK(mmap.has_holes());
+
+        mmap.map_range(0x1000, 0x1000, 0x200000);
+        CHECK(mmap.has_holes());
+
+        mmap.map_range_4k(0x0, 0x10000000, 0x1000);
+        CHECK(!mmap.has_holes());
+
+        mmap.map_range_4k(0x201000, 0x201000, 0x2000, ept::mmap::attr_type::read_only);
+        CHECK(!mmap.has_holes());
+
+        mmap.unmap(0x202000);
+        CHECK(!mmap.has_holes());
+
+        mmap.unmap(0x100000);
+        CHECK(mmap.has_holes());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: protect")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+        mmap.map_range(0x0, 0x0, 0x80000000);
+        guest_write(mmap, 0x40000000);
+
+        auto changed = mmap.protect(0x40000000, 0x40000000, ept::mmap::attr_type::read_only);
+        REQUIRE(changed.size() == 1);
+        CHECK(changed.at(0).virt_addr == 0x40000000);
+        CHECK(changed.at(0).size == 0x40000000);
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(::intel_x64::ept::pdpt::entry::write_access::is_disabled(mmap.entry(0x40000000)));
+        CHECK(::intel_x64::ept::pdpt::entry::dirty::is_enabled(mmap.entry(0x40000000)));
+
+        changed = mmap.protect(0x40000000, 0x40000000, ept::mmap::attr_type::read_only);
+        CHECK(changed.empty());
+        CHECK(mmap.verify_occupancy());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: protect splits edges")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_1g(0x40000000, 0x40000000);
+
+        auto num_pages = g_allocated_pages.size();
+        auto changed = mmap.protect(0x40001000, 0x400000, ept::mmap::attr_type::read_execute);
+
+        REQUIRE(changed.size() == 1);
+        CHECK(changed.at(0).virt_addr == 0x40001000);
+        CHECK(changed.at(0).phys_addr == 0x40001000);
+        CHECK(changed.at(0).size == 0x400000);
+        CHECK(g_allocated_pages.size() == num_pages + 3);
+
+        CHECK(mmap.is_4k(0x40000000));
+        CHECK(mmap.is_4k(0x40001000));
+        CHECK(mmap.is_2m(0x40200000));
+        CHECK(mmap.is_4k(0x40400000));
+        CHECK(mmap.is_2m(0x40600000));
+
+        auto attr = [&](uintptr_t virt) {
+            auto entry = mmap.entry(virt);
+            return ::intel_x64::ept::pd::entry::write_access::is_enabled(entry);
+        };
+
+        CHECK(attr(0x40000000));
+        CHECK(!attr(0x40001000));
+        CHECK(!attr(0x40200000));
+        CHECK(!attr(0x40400000));
+        CHECK(attr(0x40401000));
+        CHECK(mmap.virt_to_phys(0x40401000) == 0x40401000);
+        CHECK(mmap.verify_occupancy());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: protect skips holes")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.map_4k(0x3000, 0x3000);
+        mmap.map_4k(0x8000000000, 0x4000);
+
+        auto changed = mmap.protect(0x0, 0x10000000000, ept::mmap::attr_type::none);
+        REQUIRE(changed.size() == 3);
+        CHECK(changed.at(0).virt_addr == 0x1000);
+        CHECK(changed.at(1).virt_addr == 0x3000);
+        CHECK(changed.at(2).virt_addr == 0x8000000000);
+        CHECK(mmap.entry(0x1000) != 0);
+
+        CHECK_THROWS(mmap.protect(0x2A, 0x1000, ept::mmap::attr_type::none));
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: suppress ve")
+{
+    using namespace ::intel_x64::ept::pd::entry;
+
+    {
+        ept::mmap mmap{};
+        mmap.map_2m(0x200000, 0x200000);
+        mmap.map_4k(0x1000, 0x1000);
+        CHECK(suppress_ve::is_enabled(mmap.entry(0x1000)));
+        CHECK(suppress_ve::is_enabled(mmap.entry(0x200000)));
+
+        auto changed = mmap.enable_ve(0x1000, 0x201000);
+        REQUIRE(changed.size() == 2);
+        CHECK(changed.at(0).virt_addr == 0x1000);
+        CHECK(changed.at(1).virt_addr == 0x200000);
+        CHECK(changed.at(1).size == 0x2000);
+
+        CHECK(suppress_ve::is_disabled(mmap.entry(0x1000)));
+        CHECK(suppress_ve::is_disabled(mmap.entry(0x201000)));
+        CHECK(suppress_ve::is_enabled(mmap.entry(0x202000)));
+        CHECK(read_access::is_enabled(mmap.entry(0x202000)));
+
+        CHECK(mmap.disable_ve(0x0, 0x400000).size() == 2);
+        CHECK(suppress_ve::is_enabled(mmap.entry(0x201000)));
+        CHECK(mmap.verify_occupancy());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+static std::vector<uintptr_t>
+sorted_phys_to_virt(const ept::mmap &mmap, uintptr_t phys_addr)
+{
+    auto virt_addrs = mmap.phys_to_virt(phys_addr);
+    std::sort(virt_addrs.begin(), virt_addrs.end());
+
+    return virt_addrs;
+}
+
+TEST_CASE("mmap: rmap map / unmap / release")
+{
+    {
+        ept::mmap mmap{};
+        CHECK(!mmap.is_rmap_enabled());
+        CHECK_THROWS(mmap.phys_to_virt(0x1000));
+
+        mmap.enable_rmap();
+        CHECK(mmap.is_rmap_enabled());
+
+        mmap.map_4k(0x1000, 0x5000);
+        mmap.map_2m(0x200000, 0x400000);
+        mmap.map_1g(0x40000000, 0x80000000);
+
+        CHECK(sorted_phys_to_virt(mmap, 0x5000) == std::vector<uintptr_t>({0x1000}));
+        CHECK(sorted_phys_to_virt(mmap, 0x5ABC) == std::vector<uintptr_t>({0x1ABC}));
+        CHECK(sorted_phys_to_virt(mmap, 0x401000) == std::vector<uintptr_t>({0x201000}));
+        CHECK(sorted_phys_to_virt(mmap, 0x80201000) == std::vector<uintptr_t>({0x40201000}));
+        CHECK(mmap.phys_to_virt(0x6000).empty());
+
+        mmap.unmap(0x1000);
+        CHECK(mmap.phys_to_virt(0x5000).empty());
+
+        mmap.release(0x200000);
+        CHECK(mmap.phys_to_virt(0x400000).empty());
+
+        mmap.release(0x40000000);
+        CHECK(mmap.phys_to_virt(0x80000000).empty());
+
+        mmap.map_4k(0x1000, 0x5000);
+        CHECK(mmap.update_entry(0x1000, mmap.entry(0x1000), 0));
+        CHECK(mmap.phys_to_virt(0x5000).empty());
+
+        mmap.disable_rmap();
+        CHECK(!mmap.is_rmap_enabled());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: rmap aliases")
+{
+    {
+        ept::mmap mmap{};
+        mmap.enable_rmap();
+
+        mmap.map_4k(0x1000, 0x200000);
+        mmap.map_4k(0x8000000000, 0x200000);
+        mmap.map_2m(0x200000, 0x200000);
+
+        CHECK(sorted_phys_to_virt(mmap, 0x200000) ==
+              std::vector<uintptr_t>({0x1000, 0x200000, 0x8000000000}));
+        CHECK(sorted_phys_to_virt(mmap, 0x201000) == std::vector<uintptr_t>({0x201000}));
+
+        CHECK(mmap.revoke(0x200010) == 3);
+        CHECK(mmap.phys_to_virt(0x200000).empty());
+        CHECK_THROWS(mmap.entry(0x1000));
+        CHECK_THROWS(mmap.entry(0x8000000000));
+        CHECK_THROWS(mmap.entry(0x200000));
+        CHECK(mmap.revoke(0x200000) == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: rmap split / compact")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+        mmap.enable_rmap();
+
+        mmap.map_1g(0x40000000, 0x40000000);
+        mmap.split_1g(0x40000000);
+        CHECK(sorted_phys_to_virt(mmap, 0x40201000) == std::vector<uintptr_t>({0x40201000}));
+
+        mmap.split_2m(0x40200000);
+        CHECK(sorted_phys_to_virt(mmap, 0x40201000) == std::vector<uintptr_t>({0x40201000}));
+        CHECK(sorted_phys_to_virt(mmap, 0x40400000) == std::vector<uintptr_t>({0x40400000}));
+
+        mmap.protect(0x40000000, 0x1000, ept::mmap::attr_type::read_only);
+        CHECK(sorted_phys_to_virt(mmap, 0x40000000) == std::vector<uintptr_t>({0x40000000}));
+        CHECK(mmap.is_4k(0x40000000));
+
+        mmap.protect(0x40000000, 0x1000, ept::mmap::attr_type::read_write_execute);
+        CHECK(mmap.compact(0x40000000, 0x40000000) == 3);
+        CHECK(mmap.is_1g(0x40000000));
+        CHECK(sorted_phys_to_virt(mmap, 0x40201000) == std::vector<uintptr_t>({0x40201000}));
+
+        CHECK(mmap.revoke(0x40201000) == 1);
+        CHECK(mmap.phys_to_virt(0x40000000).empty());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: rmap enable existing / clone")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range_4k(0x1000, 0x1000, 0x3000);
+        mmap.map_2m(0x200000, 0x0);
+
+        mmap.enable_rmap();
+        CHECK(sorted_phys_to_virt(mmap, 0x1000) == std::vector<uintptr_t>({0x1000, 0x201000}));
+        CHECK(sorted_phys_to_virt(mmap, 0x3000) == std::vector<uintptr_t>({0x3000, 0x203000}));
+
+        auto copy = mmap.clone();
+        CHECK(copy->is_rmap_enabled());
+        CHECK(copy->revoke(0x1000) == 2);
+
+        CHECK(copy->phys_to_virt(0x1000).empty());
+        CHECK(sorted_phys_to_virt(mmap, 0x1000) == std::vector<uintptr_t>({0x1000, 0x201000}));
+
+        CHECK_THROWS(mmap.set_concurrent(true));
+        mmap.disable_rmap();
+
+        ept::mmap concurrent{};
+        concurrent.set_concurrent(true);
+        CHECK_THROWS(concurrent.enable_rmap());
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: stats")
+{
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    {
+        ept::mmap mmap{};
+
+        auto stats = mmap.stats();
+        CHECK(stats.num_pml4_tables == 1);
+        CHECK(stats.num_pdpt_tables == 0);
+        CHECK(stats.mapped_4k == 0);
+        CHECK(stats.num_memory_types == 0);
+
+        mmap.map_1g(0x40000000, 0x40000000);
+        mmap.map_2m(0x200000, 0x200000, ept::mmap::attr_type::read_write, ept::mmap::memory_type::uncacheable);
+        mmap.map_range_4k(0x1000, 0x1000, 0x3000);
+
+        stats = mmap.stats();
+        CHECK(stats.num_pdpt_tables == 1);
+        CHECK(stats.num_pd_tables == 1);
+        CHECK(stats.num_pt_tables == 1);
+        CHECK(stats.mapped_1g == 0x40000000);
+        CHECK(stats.mapped_2m == 0x200000);
+        CHECK(stats.mapped_4k == 0x3000);
+        CHECK(stats.num_memory_types == 2);
+
+        mmap.split_1g(0x40000000);
+        mmap.split_2m(0x40000000);
+
+        stats = mmap.stats();
+        CHECK(stats.num_pd_tables == 2);
+        CHECK(stats.num_pt_tables == 2);
+        CHECK(stats.mapped_1g == 0);
+        CHECK(stats.mapped_2m == 0x200000 + 0x3FE00000);
+        CHECK(stats.mapped_4k == 0x3000 + 0x200000);
+        CHECK(stats.num_splits == 2);
+
+        CHECK(mmap.compact(0x40000000, 0x40000000) == 2);
+
+        stats = mmap.stats();
+        CHECK(stats.num_pd_tables == 1);
+        CHECK(stats.num_pt_tables == 1);
+        CHECK(stats.mapped_1g == 0x40000000);
+        CHECK(stats.num_merges == 2);
+
+        mmap.unmap(0x1000);
+        mmap.release(0x200000);
+
+        stats = mmap.stats();
+        CHECK(stats.mapped_2m == 0);
+        CHECK(stats.mapped_4k == 0x2000);
+        CHECK(stats.num_memory_types == 1);
+
+        mmap.release(0x2000);
+        mmap.release(0x3000);
+        mmap.release(0x40000000);
+
+        stats = mmap.stats();
+        CHECK(stats.num_pdpt_tables == 0);
+        CHECK(stats.num_pd_tables == 0);
+        CHECK(stats.num_pt_tables == 0);
+        CHECK(stats.mapped_1g == 0);
+        CHECK(stats.mapped_4k == 0);
+        CHECK(stats.num_memory_types == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: stats clone / restore / concurrent")
+{
+    {
+        ept::mmap mmap{};
+        mmap.map_range(0x0, 0x0, 0x40201000);
+
+        auto stats = mmap.stats();
+        auto copy = mmap.clone();
+        auto copy_stats = copy->stats();
+        CHECK(copy_stats.num_pd_tables == stats.num_pd_tables);
+        CHECK(copy_stats.num_pt_tables == stats.num_pt_tables);
+        CHECK(copy_stats.mapped_1g == stats.mapped_1g);
+        CHECK(copy_stats.mapped_2m == stats.mapped_2m);
+        CHECK(copy_stats.mapped_4k == stats.mapped_4k);
+
+        ept::mmap restored{};
+        restored.restore(mmap.image());
+        auto restored_stats = restored.stats();
+        CHECK(restored_stats.num_pdpt_tables == stats.num_pdpt_tables);
+        CHECK(restored_stats.num_pd_tables == stats.num_pd_tables);
+        CHECK(restored_stats.num_pt_tables == stats.num_pt_tables);
+        CHECK(restored_stats.mapped_1g == stats.mapped_1g);
+        CHECK(restored_stats.mapped_4k == stats.mapped_4k);
+
+        ept::mmap concurrent{};
+        concurrent.set_concurrent(true);
+        concurrent.map_4k(0x1000, 0x1000);
+        concurrent.map_2m(0x200000, 0x200000);
+        concurrent.protect(0x200000, 0x1000, ept::mmap::attr_type::read_only);
+        concurrent.unmap(0x1000);
+
+        auto concurrent_stats = concurrent.stats();
+        CHECK(concurrent_stats.num_pt_tables == 2);
+        CHECK(concurrent_stats.mapped_2m == 0);
+        CHECK(concurrent_stats.mapped_4k == 0x200000);
+        CHECK(concurrent_stats.num_splits == 1);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: unmapped size")
+{
+    {
+        ept::mmap mmap{};
+        CHECK(mmap.unmapped_size(0x1000) == 0x8000000000);
+
+        mmap.map_4k(0x1000, 0x1000);
+        mmap.map_2m(0x40200000, 0x40200000);
+
+        CHECK(mmap.unmapped_size(0x1000) == 0);
+        CHECK(mmap.unmapped_size(0x2000) == 0x1000);
+        CHECK(mmap.unmapped_size(0x200000) == 0x200000);
+        CHECK(mmap.unmapped_size(0x40000000) == 0x200000);
+        CHECK(mmap.unmapped_size(0x40201000) == 0);
+        CHECK(mmap.unmapped_size(0x80000000) == 0x40000000);
+        CHECK(mmap.unmapped_size(0x8000000000) == 0x8000000000);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("mmap: try lookups")
+{
+    {
+        ept::mmap mmap{};
+        CHECK(mmap.try_entry(0x1000) == 0);
+        CHECK(!mmap.try_virt_to_phys(0x1000));
+
+        mmap.map_4k(0x1000, 0x5000);
+        mmap.map_2m(0x200000, 0x40000000, ept::mmap::attr_type::read_only);
+
+        auto entry = mmap.entry(0x1000);
+        auto num_pages = g_allocated_pages.size();
+        auto walk_cache_stats = mmap.walk_cache_stats();
+
+        CHECK(mmap.try_entry(0x1000) == entry);
+        CHECK(mmap.try_entry(0x2000) == 0);
+        CHECK(mmap.try_entry(0x8000000000) == 0);
+        CHECK(::intel_x64::ept::pd::entry::write_access::is_disabled(mmap.try_entry(0x20102A)));
+
+        auto translation = mmap.try_virt_to_phys(0x20102A);
+        CHECK(translation);
+        CHECK(translation.phys_addr == 0x40000000);
+        CHECK(translation.page_size == 0x200000);
+
+        translation = mmap.try_virt_to_phys(0x102A);
+        CHECK(translation.phys_addr == 0x5000);
+        CHECK(translation.page_size == 0x1000);
+
+        translation = mmap.try_virt_to_phys(0x40000000);
+        CHECK(!translation);
+        CHECK(translation.phys_addr == 0);
+
+        CHECK(g_allocated_pages.size() == num_pages);
+        CHECK(mmap.walk_cache_stats().hits == walk_cache_stats.hits);
+        CHECK(mmap.walk_cache_stats().misses == walk_cache_stats.misses);
+
+        auto copy = mmap.clone();
+        CHECK(copy->try_entry(0x1000) == mmap.try_entry(0x1000));
+        CHECK(copy->try_virt_to_phys(0x1000).phys_addr == 0x5000);
+        CHECK(g_allocated_pages.size() == num_pages + 1);
+    }
+    CHECK(g_allocated_pages.empty());
+}
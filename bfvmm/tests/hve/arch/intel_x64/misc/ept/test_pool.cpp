@@ -0,0 +1,183 @@
+//
+// Bareflank Hypervisor
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <bfvmm/test/support.h>
+#include <hve/arch/intel_x64/misc/ept.h>
+
+using namespace eapis::intel_x64;
+
+TEST_CASE("pool: constructor / destructor")
+{
+    {
+        ept::page_pool pool{};
+        CHECK(pool.stats().total == 0);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("pool: invalid grow size")
+{
+    CHECK_THROWS(ept::page_pool{0});
+}
+
+TEST_CASE("pool: reserve")
+{
+    {
+        ept::page_pool pool{};
+        pool.reserve(10);
+
+        CHECK(g_allocated_pages.size() == 10);
+        CHECK(pool.stats().total == 10);
+        CHECK(pool.stats().free == 10);
+        CHECK(pool.stats().used == 0);
+
+        pool.reserve(5);
+        CHECK(g_allocated_pages.size() == 10);
+        CHECK(pool.stats().total == 10);
+
+        pool.reserve(12);
+        CHECK(g_allocated_pages.size() == 12);
+        CHECK(pool.stats().total == 12);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("pool: allocate / free")
+{
+    {
+        ept::page_pool pool{4};
+        pool.reserve(2);
+
+        auto page1 = pool.allocate();
+        auto page2 = pool.allocate();
+
+        CHECK(page1.virt_addr != page2.virt_addr);
+        CHECK(page1.phys_addr == g_mm->virtptr_to_physint(page1.virt_addr));
+        CHECK(page2.phys_addr == g_mm->virtptr_to_physint(page2.virt_addr));
+        CHECK(pool.stats().used == 2);
+        CHECK(pool.stats().misses == 0);
+
+        page1.virt_addr[42] = 42;
+        pool.free(page1.virt_addr, page1.phys_addr);
+        CHECK(pool.stats().used == 1);
+
+        auto page3 = pool.allocate();
+        CHECK(page3.virt_addr == page1.virt_addr);
+        CHECK(page3.phys_addr == page1.phys_addr);
+        CHECK(page3.virt_addr[42] == 0);
+
+        CHECK(pool.stats().allocations == 3);
+        CHECK(pool.stats().releases == 1);
+        CHECK(pool.stats().peak == 2);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("pool: allocate grows the pool")
+{
+    {
+        ept::page_pool pool{4};
+
+        pool.allocate();
+        CHECK(pool.stats().total == 4);
+        CHECK(pool.stats().misses == 1);
+
+        pool.allocate();
+        pool.allocate();
+        pool.allocate();
+        CHECK(pool.stats().total == 4);
+        CHECK(pool.stats().misses == 1);
+
+        pool.allocate();
+        CHECK(pool.stats().total == 8);
+        CHECK(pool.stats().misses == 2);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("pool: free nullptr fails")
+{
+    ept::page_pool pool{};
+    CHECK_THROWS(pool.free(nullptr, 0));
+}
+
+TEST_CASE("pool: mmap uses pool")
+{
+    {
+        ept::page_pool pool{};
+        pool.reserve(4);
+
+        {
+            ept::mmap mmap{&pool};
+            mmap.map_4k(0x2A, 0x2A);
+
+            CHECK(g_allocated_pages.size() == 4);
+            CHECK(pool.stats().used == 4);
+            CHECK(pool.stats().misses == 0);
+            CHECK(mmap.eptp() != 0);
+        }
+
+        CHECK(pool.stats().used == 0);
+        CHECK(g_allocated_pages.size() == 4);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("pool: mmap release returns pages to the pool")
+{
+    {
+        ept::page_pool pool{};
+
+        ept::mmap mmap{&pool};
+        mmap.map_4k(0x2A, 0x2A);
+        mmap.release(0x2A);
+        CHECK(pool.stats().used == 1);
+
+        mmap.map_4k(0x2A, 0x2A);
+        CHECK(mmap.virt_to_phys(0x2A) == 0x0);
+        CHECK(pool.stats().used == 4);
+        CHECK(pool.stats().total == 64);
+    }
+    CHECK(g_allocated_pages.empty());
+}
+
+TEST_CASE("pool: shared by several maps")
+{
+    {
+        ept::page_pool pool{};
+
+        {
+            ept::mmap mmap1{&pool};
+            ept::mmap mmap2{&pool};
+
+            ept::identity_map_2m(mmap1, 0, 0x40000000);
+            ept::identity_map_4k(mmap2, 0, 0x400000);
+
+            CHECK(mmap1.is_2m(0x200000));
+            CHECK(mmap2.is_4k(0x200000));
+            CHECK(pool.stats().used == 3 + 5);
+        }
+
+        CHECK(pool.stats().used == 0);
+        CHECK(pool.stats().peak == 8);
+    }
+    CHECK(g_allocated_pages.empty());
+}
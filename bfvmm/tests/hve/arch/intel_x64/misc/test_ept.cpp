@@ -53,3 +53,235 @@ TEST_CASE("set_eptp")
     eh.set_eptp(nullptr);
     CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::is_disabled());
 }
+
+TEST_CASE("sync")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto invalidations = 0;
+
+    mocks.OnCallFunc(_invept).Do([&](auto, auto) {
+        invalidations++;
+        return true;
+    });
+
+    auto mm = ept::mmap{};
+    auto eh = ept_handler{};
+
+    CHECK(!eh.sync());
+    CHECK(invalidations == 0);
+
+    mm.map_4k(0x1000, 0x1000);
+    mm.map_4k(0x2000, 0x2000);
+    mm.map_4k(0x3000, 0x3000);
+
+    eh.set_eptp(&mm);
+    CHECK(eh.sync());
+    CHECK(!eh.sync());
+    CHECK(invalidations == 1);
+
+    mm.unmap(0x1000);
+    mm.unmap(0x2000);
+    mm.unmap(0x3000);
+    mm.release(0x1000);
+    mm.release(0x2000);
+    mm.release(0x3000);
+
+    CHECK(eh.sync());
+    CHECK(!eh.sync());
+    CHECK(invalidations == 2);
+
+    eh.set_eptp(nullptr);
+    mm.invalidate();
+
+    CHECK(!eh.sync());
+    CHECK(invalidations == 2);
+}
+
+TEST_CASE("sync multiple vcpus")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto invalidations = 0;
+
+    mocks.OnCallFunc(_invept).Do([&](auto, auto) {
+        invalidations++;
+        return true;
+    });
+
+    auto mm = ept::mmap{};
+    auto eh1 = ept_handler{};
+    auto eh2 = ept_handler{};
+
+    eh1.set_eptp(&mm);
+    eh2.set_eptp(&mm);
+    eh1.sync();
+    eh2.sync();
+    invalidations = 0;
+
+    for (auto i = 0ULL; i < 0x100; i++) {
+        mm.map_4k(i << 12, i << 12);
+        mm.unmap(i << 12);
+    }
+
+    CHECK(eh1.sync());
+    CHECK(eh2.sync());
+    CHECK(invalidations == 2);
+
+    mm.invalidate();
+
+    CHECK(eh1.sync());
+    CHECK(!eh1.sync());
+    CHECK(invalidations == 3);
+
+    CHECK(eh2.sync());
+    CHECK(invalidations == 4);
+}
+
+TEST_CASE("accessed and dirty flags")
+{
+    setup_eapis_test_support();
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    auto mm = ept::mmap{};
+    auto eh = ept_handler{};
+
+    eh.set_eptp(&mm);
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_disabled());
+
+    eh.enable_accessed_and_dirty_flags();
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_enabled());
+
+    eh.set_eptp(nullptr);
+    eh.set_eptp(&mm);
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_enabled());
+
+    eh.disable_accessed_and_dirty_flags();
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_disabled());
+
+    eh.set_eptp(nullptr);
+    eh.enable_accessed_and_dirty_flags();
+    eh.set_eptp(&mm);
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_enabled());
+}
+
+TEST_CASE("accessed and dirty flags not supported")
+{
+    setup_eapis_test_support();
+    scoped_msr caps{ept_vpid_cap, 0};
+
+    auto mm = ept::mmap{};
+    auto eh = ept_handler{};
+
+    eh.set_eptp(&mm);
+    CHECK_THROWS(eh.enable_accessed_and_dirty_flags());
+    CHECK(vmcs_n::ept_pointer::accessed_and_dirty_flags::is_disabled());
+}
+
+TEST_CASE("views")
+{
+    setup_eapis_test_support();
+    scoped_msr caps{vmfunc_cap, all_caps};
+
+    auto mm1 = ept::mmap{};
+    auto mm2 = ept::mmap{};
+    auto eh = ept_handler{};
+
+    CHECK_THROWS(eh.enable_vmfunc());
+    CHECK_THROWS(eh.add_view(ept_handler::max_views, &mm1));
+    CHECK_THROWS(eh.set_view(1));
+
+    eh.set_eptp(&mm1);
+    eh.add_view(0, &mm1);
+    eh.add_view(1, &mm2);
+
+    eh.enable_vmfunc();
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vm_functions::is_enabled());
+    CHECK(vmcs_n::vm_function_controls::eptp_switching::is_enabled());
+    CHECK(vmcs_n::eptp_list_address::get() != 0);
+
+    eh.set_view(1);
+    CHECK(vmcs_n::ept_pointer::phys_addr::get() == mm2.eptp());
+    CHECK(eh.current_view() == 1);
+
+    eh.set_view(0);
+    CHECK(vmcs_n::ept_pointer::phys_addr::get() == mm1.eptp());
+    CHECK(eh.current_view() == 0);
+
+    CHECK_THROWS(eh.remove_view(0));
+    CHECK_NOTHROW(eh.set_view(0));
+
+    eh.remove_view(1);
+    CHECK_THROWS(eh.set_view(1));
+    CHECK_NOTHROW(eh.remove_view(1));
+
+    eh.disable_vmfunc();
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vm_functions::is_disabled());
+    CHECK_THROWS(eh.current_view());
+}
+
+TEST_CASE("vmfunc not supported")
+{
+    setup_eapis_test_support();
+
+    auto mm = ept::mmap{};
+    auto eh = ept_handler{};
+
+    eh.set_eptp(&mm);
+    eh.add_view(0, &mm);
+
+    {
+        scoped_msr caps{vmfunc_cap, 0};
+        CHECK_THROWS(eh.enable_vmfunc());
+    }
+
+    {
+        scoped_msr caps{vmfunc_cap, all_caps};
+        scoped_msr ctls2{::intel_x64::msrs::ia32_vmx_procbased_ctls2::addr, 0};
+        CHECK_THROWS(eh.enable_vmfunc());
+    }
+
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_vm_functions::is_disabled());
+}
+
+TEST_CASE("sync views")
+{
+    setup_eapis_test_support();
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    MockRepository mocks;
+    auto invalidations = 0;
+
+    mocks.OnCallFunc(_invept).Do([&](auto, auto) {
+        invalidations++;
+        return true;
+    });
+
+    auto mm1 = ept::mmap{};
+    auto mm2 = ept::mmap{};
+    auto eh = ept_handler{};
+
+    eh.set_eptp(&mm1);
+    eh.add_view(0, &mm1);
+    eh.add_view(1, &mm2);
+
+    CHECK(eh.sync());
+    CHECK(!eh.sync());
+    CHECK(invalidations == 2);
+
+    mm2.map_4k(0x1000, 0x1000);
+    CHECK(eh.sync());
+    CHECK(!eh.sync());
+    CHECK(invalidations == 3);
+
+    eh.enable_accessed_and_dirty_flags();
+    CHECK(eh.sync());
+    CHECK(invalidations == 5);
+
+    eh.remove_view(1);
+    mm2.invalidate();
+    CHECK(!eh.sync());
+    CHECK(invalidations == 5);
+}
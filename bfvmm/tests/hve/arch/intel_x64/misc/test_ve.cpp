@@ -0,0 +1,82 @@
+//
+// Bareflank Extended APIs
+//
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/misc/ve.h>
+
+using namespace eapis::intel_x64;
+
+TEST_CASE("constructor")
+{
+    setup_eapis_test_support();
+
+    auto vh = ve_handler{};
+    CHECK(vh.phys_addr() != 0);
+    CHECK(!vh.is_busy());
+}
+
+TEST_CASE("enable / disable")
+{
+    setup_eapis_test_support();
+
+    auto vh = ve_handler{};
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::is_disabled());
+
+    vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::disable();
+    CHECK_THROWS(vh.enable());
+
+    vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::enable();
+
+    vh.enable();
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::is_enabled());
+    CHECK(vmcs_n::virtualization_exception_information_address::get() == vh.phys_addr());
+
+    vh.disable();
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::is_disabled());
+}
+
+TEST_CASE("enable not supported")
+{
+    setup_eapis_test_support();
+    vmcs_n::secondary_processor_based_vm_execution_controls::enable_ept::enable();
+
+    scoped_msr ctls2{::intel_x64::msrs::ia32_vmx_procbased_ctls2::addr, 0};
+
+    auto vh = ve_handler{};
+    CHECK_THROWS(vh.enable());
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::is_disabled());
+}
+
+TEST_CASE("busy / clear")
+{
+    setup_eapis_test_support();
+
+    auto vh = ve_handler{};
+    auto info = const_cast<ve_handler::info_type *>(&vh.info());
+
+    info->busy = ve_handler::busy;
+    info->guest_physical_address = 0x1000;
+    CHECK(vh.is_busy());
+    CHECK(vh.info().guest_physical_address == 0x1000);
+
+    vh.clear();
+    CHECK(!vh.is_busy());
+}
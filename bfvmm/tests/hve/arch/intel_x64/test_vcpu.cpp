@@ -0,0 +1,147 @@
+//
+// Bareflank Extended APIs
+//
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+using namespace eapis::intel_x64;
+namespace reason = vmcs_n::exit_reason::basic_exit_reason;
+
+static ept::mmap *g_map = nullptr;
+static bool g_handled = true;
+
+static bool
+test_unmap_handler(gsl::not_null<vmcs_t *> vmcs)
+{
+    bfignored(vmcs);
+
+    g_map->unmap(0x1000);
+    return g_handled;
+}
+
+TEST_CASE("exit handlers sync ept")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto invalidations = 0;
+
+    mocks.OnCallFunc(_invept).Do([&](auto, auto) {
+        invalidations++;
+        return true;
+    });
+
+    auto mm = ept::mmap{};
+    mm.map_4k(0x1000, 0x1000);
+    g_map = &mm;
+    g_handled = true;
+
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    vcpu->set_eptp(mm);
+    vcpu->add_exit_handler(reason::cpuid, ::handler_delegate_t::create<test_unmap_handler>());
+
+    g_vmcs_fields[vmcs_n::exit_reason::addr] = reason::cpuid;
+
+    // The handler unmaps a page, which has to be flushed (together with
+    // the new EPTP) before the guest is resumed
+    //
+    CHECK(vcpu->handle_exit(vcpu->vmcs()));
+    CHECK(invalidations == 1);
+
+    CHECK(vcpu->handle_exit(vcpu->vmcs()));
+    CHECK(invalidations == 1);
+
+    // Exits that are passed on to the base exit handler are flushed too,
+    // as it resumes the guest without looking at the EPT
+    //
+    g_handled = false;
+    mm.invalidate();
+
+    CHECK(!vcpu->handle_exit(vcpu->vmcs()));
+    CHECK(invalidations == 2);
+}
+
+TEST_CASE("exits without eapis handlers sync ept")
+{
+    setup_eapis_test_support();
+
+    MockRepository mocks;
+    auto invalidations = 0;
+
+    mocks.OnCallFunc(_invept).Do([&](auto, auto) {
+        invalidations++;
+        return true;
+    });
+
+    auto mm = ept::mmap{};
+    mm.map_4k(0x1000, 0x1000);
+
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    vcpu->set_eptp(mm);
+
+    // No EAPIs handler exists for a vmcall, so the exit is passed on to
+    // the base exit handler, but the map has changed (the new EPTP) and
+    // still has to be flushed before the guest is resumed
+    //
+    g_vmcs_fields[vmcs_n::exit_reason::addr] = reason::vmcall;
+
+    CHECK(!vcpu->handle_exit(vcpu->vmcs()));
+    CHECK(invalidations == 1);
+
+    mm.unmap(0x1000);
+
+    CHECK(!vcpu->handle_exit(vcpu->vmcs()));
+    CHECK(invalidations == 2);
+
+    CHECK(!vcpu->handle_exit(vcpu->vmcs()));
+    CHECK(invalidations == 2);
+}
+
+TEST_CASE("enable ve rejects holes and demand mapping")
+{
+    setup_eapis_test_support();
+    scoped_msr caps{ept_vpid_cap, all_caps};
+
+    auto mm = ept::mmap{};
+    mm.map_range(0x0, 0x0, 0x80000000);
+
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    vcpu->set_eptp(mm);
+
+    ept::memory_map_t memory_map = {
+        {ept::memory_region_t::type_t::ram, 0x80000000, 0x80000000}
+    };
+    vcpu->enable_ept_demand_mapping(mm, memory_map);
+    CHECK_THROWS(vcpu->enable_ve());
+
+    vcpu->ept_violation()->disable_demand_mapping();
+    mm.unmap(0x40000000);
+    CHECK_THROWS(vcpu->enable_ve());
+
+    mm.map_range(0x40000000, 0x40000000, 0x40000000);
+    vcpu->enable_ve();
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::ept_violation_ve::is_enabled());
+
+    CHECK_THROWS(vcpu->enable_ept_demand_mapping(mm, memory_map));
+
+    vcpu->disable_ve();
+}
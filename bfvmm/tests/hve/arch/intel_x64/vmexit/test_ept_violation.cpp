@@ -0,0 +1,163 @@
+//
+// Bareflank Extended APIs
+//
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <test/hve.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+using namespace eapis::intel_x64;
+namespace reason = vmcs_n::exit_reason::basic_exit_reason;
+
+static int g_reads = 0;
+
+static bool
+test_read_handler(
+    gsl::not_null<vmcs_t *> vmcs, ept_violation_handler::info_t &info)
+{
+    bfignored(vmcs);
+
+    info.ignore_advance = true;
+    g_reads++;
+
+    return true;
+}
+
+// Emulates an EPT violation caused by the guest reading from gpa
+//
+static bool
+read_violation(gsl::not_null<eapis::intel_x64::vcpu *> vcpu, uint64_t gpa)
+{
+    using namespace vmcs_n::exit_qualification::ept_violation;
+
+    g_vmcs_fields[vmcs_n::exit_reason::addr] = reason::ept_violation;
+    g_vmcs_fields[vmcs_n::guest_physical_address::addr] = gpa;
+    g_vmcs_fields[vmcs_n::exit_qualification::addr] = data_read::mask;
+
+    return vcpu->handle_exit(vcpu->vmcs());
+}
+
+TEST_CASE("ept violation: demand mapping")
+{
+    setup_eapis_test_support();
+    enable_mtrrs(0);
+
+    g_reads = 0;
+
+    auto mm = ept::mmap{};
+    mm.map_4k(0x80200000, 0x80200000);
+
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    vcpu->add_ept_read_violation_handler(
+        ept_violation_handler::handler_delegate_t::create<test_read_handler>()
+    );
+
+    ept::memory_map_t memory_map = {
+        {ept::memory_region_t::type_t::ram, 0x80000000, 0x80000000}
+    };
+
+    vcpu->enable_ept_demand_mapping(
+        mm, memory_map, ::intel_x64::ept::pd::page_size, ept::mmap::attr_type::read_only
+    );
+
+    // An unmapped address in the memory map is mapped using the largest
+    // page that fits, with the requested attributes
+    //
+    CHECK(read_violation(vcpu.get(), 0x80001000));
+    CHECK(g_reads == 0);
+    CHECK(vcpu->ept_violation()->demand_mapped() == 0x200000);
+    CHECK(mm.try_virt_to_phys(0x80001000).page_size == 0x200000);
+    CHECK(::intel_x64::ept::pd::entry::write_access::is_disabled(mm.try_entry(0x80000000)));
+
+    // Addresses outside of the memory map, and addresses that are already
+    // mapped (e.g. a read from a page that is not readable, for which
+    // nothing is mapped) are passed on to the read handlers
+    //
+    CHECK(read_violation(vcpu.get(), 0x1000));
+    CHECK(g_reads == 1);
+    CHECK(!mm.try_virt_to_phys(0x1000));
+
+    CHECK(read_violation(vcpu.get(), 0x80001000));
+    CHECK(g_reads == 2);
+    CHECK(vcpu->ept_violation()->demand_mapped() == 0x200000);
+
+    CHECK(read_violation(vcpu.get(), 0x80200000));
+    CHECK(g_reads == 3);
+    CHECK(mm.try_virt_to_phys(0x80200000).page_size == 0x1000);
+
+    // The rest of the 2m page next to the existing 4k page is mapped
+    // using 4k pages
+    //
+    CHECK(read_violation(vcpu.get(), 0x80201000));
+    CHECK(g_reads == 3);
+    CHECK(mm.try_virt_to_phys(0x80201000).page_size == 0x1000);
+    CHECK(vcpu->ept_violation()->demand_mapped() == 0x201000);
+
+    vcpu->ept_violation()->disable_demand_mapping();
+
+    CHECK(read_violation(vcpu.get(), 0x80400000));
+    CHECK(g_reads == 4);
+    CHECK(!mm.try_virt_to_phys(0x80400000));
+}
+
+TEST_CASE("ept violation: demand mapping failure")
+{
+    setup_eapis_test_support();
+    enable_mtrrs(0);
+
+    g_reads = 0;
+
+    auto mm = ept::mmap{};
+
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    vcpu->add_ept_read_violation_handler(
+        ept_violation_handler::handler_delegate_t::create<test_read_handler>()
+    );
+
+    ept::memory_map_t memory_map = {
+        {ept::memory_region_t::type_t::ram, 0x80000000, 0x80000000}
+    };
+
+    vcpu->enable_ept_demand_mapping(mm, memory_map, ::intel_x64::ept::pd::page_size);
+
+    // The page tables needed to map the address cannot be allocated, which
+    // passes the exit on to the read handlers instead of failing it
+    //
+    {
+        MockRepository mocks;
+        auto mm_mock = mocks.Mock<bfvmm::memory_manager>();
+
+        mocks.OnCallFunc(bfvmm::memory_manager::instance).Return(mm_mock);
+        mocks.OnCall(mm_mock, bfvmm::memory_manager::alloc).Throw(std::bad_alloc());
+
+        CHECK(read_violation(vcpu.get(), 0x80001000));
+        CHECK(g_reads == 1);
+    }
+
+    CHECK(vcpu->ept_violation()->demand_mapped() == 0);
+    CHECK(!mm.try_virt_to_phys(0x80001000));
+
+    CHECK(read_violation(vcpu.get(), 0x80001000));
+    CHECK(g_reads == 1);
+    CHECK(vcpu->ept_violation()->demand_mapped() == 0x200000);
+
+    vcpu->ept_violation()->disable_demand_mapping();
+}
@@ -0,0 +1,175 @@
+//
+// Bareflank Extended APIs
+//
+// Copyright (C) 2018 Assured Information Security, Inc.
+//
+// This library is free software; you can redistribute it and/or
+// modify it under the terms of the GNU Lesser General Public
+// License as published by the Free Software Foundation; either
+// version 2.1 of the License, or (at your option) any later version.
+//
+// This library is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the GNU
+// Lesser General Public License for more details.
+//
+// You should have received a copy of the GNU Lesser General Public
+// License along with this library; if not, write to the Free Software
+// Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA 02110-1301 USA
+
+#include <catch/catch.hpp>
+#include <hippomocks.h>
+
+#include <test/support.h>
+#include <hve/arch/intel_x64/vcpu.h>
+
+using namespace eapis::intel_x64;
+namespace reason = vmcs_n::exit_reason::basic_exit_reason;
+
+// Emulates what the CPU does when it logs a write: the guest physical
+// address is stored at the current PML index, and the index is decremented
+// (wrapping to 0xFFFF once the log is full).
+//
+static void
+log_write(uintptr_t gpa)
+{
+    auto log = static_cast<uintptr_t *>(
+        g_mm->physint_to_virtptr(vmcs_n::pml_address::get())
+    );
+
+    auto index = vmcs_n::guest_pml_index::get();
+    REQUIRE(index < pml_handler::log_size);
+
+    log[index] = gpa;
+    vmcs_n::guest_pml_index::set(index == 0 ? 0xFFFF : index - 1);
+}
+
+TEST_CASE("pml: constructor")
+{
+    setup_eapis_test_support();
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+
+    CHECK_THROWS(pml_handler(vcpu.get(), 0));
+
+    auto ph = pml_handler{vcpu.get()};
+    CHECK(vmcs_n::pml_address::get() != 0);
+    CHECK(vmcs_n::guest_pml_index::get() == pml_handler::log_size - 1);
+    CHECK(ph.size() == 0);
+    CHECK(ph.dropped() == 0);
+}
+
+TEST_CASE("pml: enable / disable")
+{
+    setup_eapis_test_support();
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    auto ph = pml_handler{vcpu.get()};
+
+    ph.enable();
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_pml::is_enabled());
+
+    log_write(0x1000);
+    ph.disable();
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_pml::is_disabled());
+    CHECK(ph.size() == 1);
+}
+
+TEST_CASE("pml: enable not supported")
+{
+    setup_eapis_test_support();
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    auto ph = pml_handler{vcpu.get()};
+
+    scoped_msr ctls2{::intel_x64::msrs::ia32_vmx_procbased_ctls2::addr, 0};
+
+    CHECK_THROWS(ph.enable());
+    CHECK(vmcs_n::secondary_processor_based_vm_execution_controls::enable_pml::is_disabled());
+}
+
+TEST_CASE("pml: flush and pull")
+{
+    setup_eapis_test_support();
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    auto ph = pml_handler{vcpu.get()};
+
+    ph.flush();
+    CHECK(ph.size() == 0);
+
+    log_write(0x1000);
+    log_write(0x2ABC);
+    log_write(0x3000);
+
+    ph.flush();
+    CHECK(ph.size() == 3);
+    CHECK(vmcs_n::guest_pml_index::get() == pml_handler::log_size - 1);
+
+    auto gpas = ph.pull(2);
+    REQUIRE(gpas.size() == 2);
+    CHECK(gpas[0] == 0x1000);
+    CHECK(gpas[1] == 0x2000);
+
+    log_write(0x4000);
+    ph.flush();
+
+    gpas = ph.pull(10);
+    REQUIRE(gpas.size() == 2);
+    CHECK(gpas[0] == 0x3000);
+    CHECK(gpas[1] == 0x4000);
+
+    CHECK(ph.size() == 0);
+    CHECK(ph.pull(10).empty());
+}
+
+TEST_CASE("pml: ring full")
+{
+    setup_eapis_test_support();
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    auto ph = pml_handler{vcpu.get(), 4};
+
+    for (auto gpa = 0x1000ULL; gpa <= 0x6000ULL; gpa += 0x1000) {
+        log_write(gpa);
+    }
+
+    ph.flush();
+    CHECK(ph.size() == 4);
+    CHECK(ph.dropped() == 2);
+
+    // The ring wraps once the oldest entries have been pulled
+    //
+    CHECK(ph.pull(3).back() == 0x3000);
+
+    log_write(0x7000);
+    log_write(0x8000);
+    ph.flush();
+
+    auto gpas = ph.pull(10);
+    REQUIRE(gpas.size() == 3);
+    CHECK(gpas[0] == 0x4000);
+    CHECK(gpas[1] == 0x7000);
+    CHECK(gpas[2] == 0x8000);
+
+    ph.reset_dropped();
+    CHECK(ph.dropped() == 0);
+}
+
+TEST_CASE("pml: log full exit")
+{
+    setup_eapis_test_support();
+    auto vcpu = std::make_unique<eapis::intel_x64::vcpu>(0);
+    auto ph = pml_handler{vcpu.get(), 1024};
+
+    for (auto i = 0ULL; i < pml_handler::log_size; i++) {
+        log_write(i << 12);
+    }
+
+    CHECK(vmcs_n::guest_pml_index::get() == 0xFFFF);
+
+    g_vmcs_fields[vmcs_n::exit_reason::addr] = reason::page_modification_log_full;
+    CHECK(vcpu->handle_exit(vcpu->vmcs()));
+
+    CHECK(ph.size() == pml_handler::log_size);
+    CHECK(vmcs_n::guest_pml_index::get() == pml_handler::log_size - 1);
+
+    auto gpas = ph.pull(pml_handler::log_size);
+    CHECK(gpas.front() == 0x0);
+    CHECK(gpas.back() == (pml_handler::log_size - 1) << 12);
+}